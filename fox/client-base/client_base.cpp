@@ -1,3 +1,4 @@
+#include <QCryptographicHash>
 #include <QHostAddress>
 #include <QStringList>
 #include <QTimer>
@@ -25,7 +26,15 @@ QString directionString(uint8_t dir)
 CBaseClientTcpHandler::CBaseClientTcpHandler(CBaseClient *b) : baseClient(b),
                                                                tcpReadBlockSize(0),
                                                                bytesReceivedLastSecond(0),
-                                                               bytesReceivedThisSecond(0)
+                                                               bytesReceivedThisSecond(0),
+                                                               udpTelemetry(false),
+                                                               gotUdpFrame(false),
+                                                               lastUdpSequence(0),
+                                                               udpFramesReceived(0),
+                                                               udpFramesLost(0),
+                                                               udpFramesStale(0),
+                                                               compression(true),
+                                                               serverCodec(TCP_CODEC_NONE)
 {
     clientSocket = new QTcpSocket(this);
     connect(clientSocket, SIGNAL(connected()), this, SLOT(connectedToServer()));
@@ -34,7 +43,8 @@ CBaseClientTcpHandler::CBaseClientTcpHandler(CBaseClient *b) : baseClient(b),
     connect(clientSocket, SIGNAL(error(QAbstractSocket::SocketError)),
             this, SLOT(socketError(QAbstractSocket::SocketError)));
 
-    initTcpDataTypes();
+    udpSocket = new QUdpSocket(this);
+    connect(udpSocket, SIGNAL(readyRead()), this, SLOT(serverHasDatagrams()));
 
     bytesReceivedTimer = new QTimer(this);
     connect(bytesReceivedTimer, SIGNAL(timeout()), this, SLOT(updateBytesReceived()));
@@ -43,7 +53,18 @@ CBaseClientTcpHandler::CBaseClientTcpHandler(CBaseClient *b) : baseClient(b),
 void CBaseClientTcpHandler::connectedToServer(void)
 {
     bytesReceivedTimer->start(1000);
+
+    // Before anything else, so the script list can be compressed
+    serverCodec = TCP_CODEC_NONE;
+    sentCompression = receivedCompression = STcpCompressionStats();
+    if (compression)
+        requestCompression();
+
     clientSocket->write(CTcpMsgComposer(TCP_GETSCRIPTS));
+
+    gotUdpFrame = false;
+    if (udpTelemetry)
+        requestUdpTelemetry();
     
     baseClient->updateConnection(true);
     baseClient->appendLogOutput(QString("Connected to server (%1:%2)\n").
@@ -95,6 +116,57 @@ void CBaseClientTcpHandler::serverHasData()
     }
 }
 
+void CBaseClientTcpHandler::serverHasDatagrams()
+{
+    // Only the newest frame matters: skip anything older
+    QByteArray newest;
+    bool gotnew = false;
+
+    while (udpSocket->hasPendingDatagrams())
+    {
+        QByteArray datagram;
+        datagram.resize(udpSocket->pendingDatagramSize());
+        udpSocket->readDatagram(datagram.data(), datagram.size());
+        bytesReceivedThisSecond += datagram.size();
+
+        if (datagram.size() < (int)sizeof(quint32))
+            continue;
+
+        QDataStream in(datagram);
+        in.setVersion(QDataStream::Qt_4_4);
+        quint32 seq;
+        in >> seq;
+
+        ++udpFramesReceived;
+
+        // Signed difference handles wrap around
+        if (gotUdpFrame && (static_cast<qint32>(seq - lastUdpSequence) <= 0))
+        {
+            ++udpFramesStale;
+            continue;
+        }
+
+        if (gotUdpFrame)
+            udpFramesLost += (seq - lastUdpSequence - 1);
+
+        if (gotnew)
+            ++udpFramesStale; // Superseded by this frame
+
+        lastUdpSequence = seq;
+        gotUdpFrame = gotnew = true;
+        newest = datagram;
+    }
+
+    if (gotnew && connected())
+    {
+        QDataStream in(newest);
+        in.setVersion(QDataStream::Qt_4_4);
+        quint32 seq;
+        in >> seq;
+        baseClient->parseTelemetry(in);
+    }
+}
+
 void CBaseClientTcpHandler::socketError(QAbstractSocket::SocketError)
 {
     baseClient->tcpError(clientSocket->errorString());
@@ -109,6 +181,52 @@ void CBaseClientTcpHandler::updateBytesReceived()
     bytesReceivedThisSecond = 0;
 }
 
+void CBaseClientTcpHandler::requestUdpTelemetry()
+{
+    if (udpSocket->state() != QAbstractSocket::BoundState)
+        udpSocket->bind(QHostAddress::Any, 0);
+
+    clientSocket->write(CTcpMsgComposer(TCP_UDPTELEMETRY) << udpSocket->localPort());
+}
+
+void CBaseClientTcpHandler::setUdpTelemetry(bool e)
+{
+    udpTelemetry = e;
+
+    if (connected())
+    {
+        if (e)
+            requestUdpTelemetry();
+        else // Port 0: back to TCP
+            clientSocket->write(CTcpMsgComposer(TCP_UDPTELEMETRY) << (quint16)0);
+    }
+}
+
+void CBaseClientTcpHandler::requestCompression()
+{
+    clientSocket->write(CTcpMsgComposer(TCP_SETCOMPRESSION) <<
+                        static_cast<quint8>((compression) ? TCP_CODEC_DEFLATE : TCP_CODEC_NONE));
+}
+
+void CBaseClientTcpHandler::send(const QByteArray &msg)
+{
+    const QByteArray compressed(compressTcpMessages(serverCodec, msg.constData(), msg.size(),
+                                                    &sentCompression));
+    clientSocket->write((compressed.isEmpty()) ? msg : compressed);
+}
+
+void CBaseClientTcpHandler::setCompression(bool e)
+{
+    compression = e;
+
+    if (connected())
+    {
+        if (!e) // Server may still send compressed data until it got this
+            serverCodec = TCP_CODEC_NONE;
+        requestCompression();
+    }
+}
+
 void CBaseClientTcpHandler::connectToHost(const QString &host)
 {
     clientSocket->abort(); // Always disconnect first
@@ -116,9 +234,11 @@ void CBaseClientTcpHandler::connectToHost(const QString &host)
 }
 
 
-CBaseClient::CBaseClient() : tcpHandler(this), driveForwardSpeed(0),
+CBaseClient::CBaseClient() : tcpHandler(this), tcpToRenderLatency(LATENCY_WINDOW),
+                             serialToRenderLatency(LATENCY_WINDOW), driveForwardSpeed(0),
                              driveTurnSpeed(0), driveTurning(false)
 {
+    clock.start();
     currentStateSensors.byte = 0;
     currentMotorDirections.byte = 0;
 }
@@ -136,10 +256,10 @@ void CBaseClient::parseTcp(QDataStream &stream)
         appendConsoleOutput(text + "\n");
     }
     // Robot data?
-    else if ((msg > TCP_MIN_ROBOT_INDEX) && (msg < TCP_MAX_ROBOT_INDEX))
+    else if (isRobotChannel(msg))
     {
         int data;
-        if (tcpDataTypes[msg] == DATA_BYTE)
+        if (getTcpDataType(msg) == DATA_BYTE)
         {
             uint8_t b;
             stream >> b;
@@ -152,43 +272,38 @@ void CBaseClient::parseTcp(QDataStream &stream)
             data = w;
         }
 
-        if (msg == TCP_STATE_SENSORS)
-        {
-            SStateSensors state;
-            state.byte = data;
-            
-            tcpRobotStateUpdate(currentStateSensors, state);
-
-            if (currentStateSensors.movementComplete && !state.movementComplete)
-                appendLogOutput("Started movement.");
-            else if (!currentStateSensors.movementComplete && state.movementComplete)
-                appendLogOutput("Finished movement.");
-            
-            if (msg == TCP_STATE_SENSORS)
-                currentStateSensors = state;
-        }
-        else
-        {
-            if (msg == TCP_MOTOR_DIRECTIONS)
-            {
-                SMotorDirections dir;
-                dir.byte = data;
-                updateMotorDirections(dir);
-            }
-            
-            tcpHandleRobotData(msg, data);
-        }
+        handleRobotData(msg, data);
     }
     else if (msg == TCP_LUASCRIPTS)
     {
         QStringList scripts;
+        QList<QByteArray> hashes;
         stream >> scripts;
+        if (!stream.atEnd()) // Older servers only send names
+            stream >> hashes;
+
+        serverScriptHashes.clear();
+        for (int i=0; i<hashes.size() && i<scripts.size(); ++i)
+            serverScriptHashes[scripts[i]] = hashes[i];
+
+        // Forget scripts that were changed or removed
+        for (QHash<QByteArray, QByteArray>::iterator it=serverScriptCache.begin();
+             it!=serverScriptCache.end();)
+        {
+            if (hashes.contains(it.key()))
+                ++it;
+            else
+                it = serverScriptCache.erase(it);
+        }
+
         tcpLuaScripts(scripts);
     }
     else if (msg == TCP_REQUESTEDSCRIPT)
     {
         QByteArray script;
         stream >> script;
+        const QByteArray hash(QCryptographicHash::hash(script, QCryptographicHash::Sha1));
+        serverScriptCache[hash.toHex()] = script;
         tcpRequestedScript(script);
     }
     else if (msg == TCP_SCRIPTRUNNING)
@@ -207,8 +322,148 @@ void CBaseClient::parseTcp(QDataStream &stream)
     else if (msg == TCP_LUAMSG)
     {
         QString msg;
-        stream >> msg;
-        tcpHandleLuaMsg(msg, stream);
+        QByteArray args;
+        stream >> msg >> args;
+        CLuaMsgReader reader(args);
+        tcpHandleLuaMsg(msg, reader);
+    }
+    else if (msg == TCP_CHANNELSTATS)
+    {
+        uint8_t channel;
+        uint16_t window;
+        CWindowStats::SResult stats;
+        stream >> channel >> window >> stats;
+        tcpChannelStats(static_cast<ETcpMessage>(channel), window, stats);
+    }
+    else if (msg == TCP_DATAAGE)
+    {
+        quint32 servertime;
+        quint8 count;
+        stream >> servertime >> count;
+
+        const int time = clock.elapsed();
+        for (quint8 i=0; i<count; ++i)
+        {
+            quint8 m;
+            quint16 age;
+            stream >> m >> age;
+
+            const ETcpMessage channel = static_cast<ETcpMessage>(m);
+            if (!isRobotChannel(channel))
+                continue;
+
+            // Newer data replaces data that wasn't shown yet
+            SPendingData &pd = pendingData[getChannelIndex(channel)];
+            pd.pending = true;
+            pd.age = age;
+            pd.receiveTime = time;
+        }
+    }
+    else if (msg == TCP_LATENCYSTATS)
+    {
+        uint16_t window;
+        stream >> window >> serverLatency;
+    }
+    else if (msg == TCP_ROBOTLIST)
+    {
+        QStringList robots;
+        stream >> robots;
+        tcpRobotList(robots);
+    }
+    else if (msg == TCP_POSE)
+    {
+        SRobotPose pose;
+        stream >> pose;
+        tcpPose(pose);
+    }
+    else if (msg == TCP_COMPRESSION)
+    {
+        quint8 codec;
+        stream >> codec;
+        tcpHandler.serverCodec = static_cast<ETcpCodec>(codec);
+        appendLogOutput(QString("Compression: %1\n").
+                        arg(getTcpCodecName(tcpHandler.serverCodec)));
+    }
+    else if (msg == TCP_COMPRESSED)
+    {
+        quint8 codec;
+        QByteArray data;
+        stream >> codec >> data;
+
+        const QList<QByteArray> blocks(splitTcpMessages(
+                uncompressTcpMessages(static_cast<ETcpCodec>(codec), data,
+                                      &tcpHandler.receivedCompression)));
+        foreach(QByteArray b, blocks)
+        {
+            QDataStream s(b);
+            s.setVersion(QDataStream::Qt_4_4);
+            parseTcp(s);
+        }
+    }
+    else if (msg == TCP_LUAPROFILE)
+    {
+        bool active;
+        quint32 duration, samples;
+        quint16 count;
+        stream >> active >> duration >> samples >> count;
+
+        QList<SLuaProfileEntry> entries;
+        for (quint16 i=0; i<count; ++i)
+        {
+            SLuaProfileEntry entry;
+            stream >> entry;
+            entries << entry;
+        }
+
+        tcpLuaProfile(active, duration, samples, entries);
+    }
+}
+
+void CBaseClient::parseTelemetry(QDataStream &stream)
+{
+    quint32 time;
+    quint8 count;
+    stream >> time >> count;
+
+    for (quint8 i=0; i<count; ++i)
+    {
+        quint8 m;
+        quint16 data;
+        stream >> m >> data;
+
+        const ETcpMessage msg = static_cast<ETcpMessage>(m);
+        if (isRobotChannel(msg))
+            handleRobotData(msg, data);
+    }
+}
+
+void CBaseClient::handleRobotData(ETcpMessage msg, int data)
+{
+    if (msg == TCP_STATE_SENSORS)
+    {
+        SStateSensors state;
+        state.byte = data;
+        
+        tcpRobotStateUpdate(currentStateSensors, state);
+
+        if (currentStateSensors.movementComplete && !state.movementComplete)
+            appendLogOutput("Started movement.");
+        else if (!currentStateSensors.movementComplete && state.movementComplete)
+            appendLogOutput("Finished movement.");
+        
+        if (msg == TCP_STATE_SENSORS)
+            currentStateSensors = state;
+    }
+    else
+    {
+        if (msg == TCP_MOTOR_DIRECTIONS)
+        {
+            SMotorDirections dir;
+            dir.byte = data;
+            updateMotorDirections(dir);
+        }
+        
+        tcpHandleRobotData(msg, data);
     }
 }
 
@@ -347,17 +602,18 @@ void CBaseClient::stopDrive()
 
 void CBaseClient::uploadLocalScript(const QString &name, const QByteArray &text)
 {
-    tcpHandler.getSocket()->write(CTcpMsgComposer(TCP_UPLOADLUA) << name << text);
+    tcpHandler.send(CTcpMsgComposer(TCP_UPLOADLUA) << name << text);
 }
 
-void CBaseClient::runLocalScript(const QByteArray &text)
+void CBaseClient::runLocalScript(const QByteArray &text, const QString &name,
+                                 uint8_t priority)
 {
-    tcpHandler.getSocket()->write(CTcpMsgComposer(TCP_RUNLUA) << text);
+    tcpHandler.send(CTcpMsgComposer(TCP_RUNLUA) << text << name << priority);
 }
 
 void CBaseClient::uploadRunLocalScript(const QString &name, const QByteArray &text)
 {
-    tcpHandler.getSocket()->write(CTcpMsgComposer(TCP_UPRUNLUA) << name << text);
+    tcpHandler.send(CTcpMsgComposer(TCP_UPRUNLUA) << name << text);
 }
 
 void CBaseClient::runServerScript(const QString &name)
@@ -372,10 +628,78 @@ void CBaseClient::removeServerScript(const QString &name)
 
 void CBaseClient::downloadServerScript(const QString &name)
 {
+    QHash<QByteArray, QByteArray>::iterator it =
+            serverScriptCache.find(serverScriptHashes.value(name));
+    if (it != serverScriptCache.end())
+    {
+        tcpRequestedScript(it.value());
+        return;
+    }
+
     tcpHandler.getSocket()->write(CTcpMsgComposer(TCP_GETSERVERLUA) << name);
 }
 
-void CBaseClient::executeScriptCommand(const QString &cmd, const QStringList &args)
+void CBaseClient::executeScriptCommand(const QString &cmd, const QStringList &args,
+                                       const QString &script)
+{
+    tcpHandler.getSocket()->write(CTcpMsgComposer(TCP_LUACOMMAND) << cmd << args << script);
+}
+
+void CBaseClient::requestChannelStats(ETcpMessage msg, uint16_t window)
+{
+    tcpHandler.getSocket()->write(CTcpMsgComposer(TCP_GETCHANNELSTATS) <<
+                                  (uint8_t)msg << window);
+}
+
+void CBaseClient::requestLatencyStats()
+{
+    if (connected())
+        tcpHandler.getSocket()->write(CTcpMsgComposer(TCP_GETLATENCYSTATS));
+}
+
+void CBaseClient::setLuaProfiling(bool enable)
+{
+    tcpHandler.getSocket()->write(CTcpMsgComposer(TCP_SETLUAPROFILE) << enable);
+}
+
+void CBaseClient::selectRobot(int robot)
+{
+    if (!connected())
+        return;
+
+    tcpHandler.getSocket()->write(CTcpMsgComposer(TCP_SELECTROBOT) << (uint8_t)robot);
+
+    // Data of the previous robot shouldn't count as shown
+    for (int i=0; i<ROBOT_CHANNEL_COUNT; ++i)
+        pendingData[i].pending = false;
+    currentStateSensors.byte = 0;
+    currentMotorDirections.byte = 0;
+}
+
+void CBaseClient::dataRendered()
+{
+    const int time = clock.elapsed();
+    for (int i=0; i<ROBOT_CHANNEL_COUNT; ++i)
+    {
+        SPendingData &pd = pendingData[i];
+        if (!pd.pending)
+            continue;
+
+        const int delay = time - pd.receiveTime;
+        tcpToRenderLatency.addSample(delay, time);
+        serialToRenderLatency.addSample(pd.age + delay, time);
+        pd.pending = false;
+    }
+}
+
+CWindowStats::SResult CBaseClient::getRenderLatency()
+{
+    tcpToRenderLatency.expire(clock.elapsed());
+    return tcpToRenderLatency.getResult();
+}
+
+CWindowStats::SResult CBaseClient::getEndToEndLatency()
 {
-    tcpHandler.getSocket()->write(CTcpMsgComposer(TCP_LUACOMMAND) << cmd << args);
+    serialToRenderLatency.expire(clock.elapsed());
+    return serialToRenderLatency.getResult();
 }
@@ -1,8 +1,14 @@
+#include <QHash>
 #include <QObject>
 #include <QStringList>
 #include <QTcpSocket>
+#include <QTime>
+#include <QUdpSocket>
 
+#include "luamsg.h"
 #include "shared.h"
+#include "tcputil.h"
+#include "windowstats.h"
 
 class QDataStream;
 class QTimer;
@@ -18,11 +24,23 @@ class CBaseClientTcpHandler: public QObject
     quint32 tcpReadBlockSize, bytesReceivedLastSecond, bytesReceivedThisSecond;
     QTcpSocket *clientSocket;
     QTimer *bytesReceivedTimer;
+    QUdpSocket *udpSocket;
+    bool udpTelemetry, gotUdpFrame;
+    quint32 lastUdpSequence, udpFramesReceived, udpFramesLost, udpFramesStale;
+    bool compression;
+    ETcpCodec serverCodec; // Confirmed by TCP_COMPRESSION
+    STcpCompressionStats sentCompression, receivedCompression;
+
+    void requestUdpTelemetry(void);
+    void requestCompression(void);
+
+    friend class CBaseClient;
    
 private slots:
     void connectedToServer(void);
     void disconnectedFromServer(void);
     void serverHasData(void);
+    void serverHasDatagrams(void);
     void socketError(QAbstractSocket::SocketError);
     void updateBytesReceived(void);
     
@@ -35,17 +53,49 @@ public:
     bool connected(void) const
     { return (clientSocket->state() == QAbstractSocket::ConnectedState); }
     quint32 bytesReceivedSecond(void) const { return bytesReceivedLastSecond; }
+    void setUdpTelemetry(bool e);
+    bool getUdpTelemetry(void) const { return udpTelemetry; }
+    quint32 getUdpFramesReceived(void) const { return udpFramesReceived; }
+    quint32 getUdpFramesLost(void) const { return udpFramesLost; }
+    quint32 getUdpFramesStale(void) const { return udpFramesStale; }
+    // Compresses large messages once the server agreed to
+    void send(const QByteArray &msg);
+    void setCompression(bool e);
+    ETcpCodec getCodec(void) const { return serverCodec; }
+    const STcpCompressionStats &getSentCompression(void) const { return sentCompression; }
+    const STcpCompressionStats &getReceivedCompression(void) const
+    { return receivedCompression; }
 };
 
 class CBaseClient
 {
+    // New data from the server which wasn't shown yet
+    struct SPendingData
+    {
+        bool pending;
+        uint16_t age; // ms, on the server
+        int receiveTime; // clock
+        SPendingData(void) : pending(false), age(0), receiveTime(0) { }
+    };
+
+    enum { LATENCY_WINDOW = 10000 };
+
     CBaseClientTcpHandler tcpHandler;
+    QTime clock;
+    SPendingData pendingData[ROBOT_CHANNEL_COUNT];
+    CWindowStats tcpToRenderLatency, serialToRenderLatency;
+    CWindowStats::SResult serverLatency; // serial -> TCP
     SStateSensors currentStateSensors;
     SMotorDirections currentMotorDirections;
     int driveForwardSpeed, driveTurnSpeed;
     bool driveTurning;
+    // Downloaded server scripts are kept, until their hash changes
+    QHash<QString, QByteArray> serverScriptHashes; // Name -> hash (hex)
+    QHash<QByteArray, QByteArray> serverScriptCache; // Hash -> script
 
     void parseTcp(QDataStream &stream);
+    void parseTelemetry(QDataStream &stream);
+    void handleRobotData(ETcpMessage msg, int data);
     void updateMotorDirections(const SMotorDirections &dir);
     void changeDriveSpeedVar(int &speed, int delta);
 
@@ -57,7 +107,14 @@ class CBaseClient
     virtual void tcpLuaScripts(const QStringList &) { }
     virtual void tcpRequestedScript(const QByteArray &) { }
     virtual void tcpScriptRunning(bool) { }
-    virtual void tcpHandleLuaMsg(const QString &, QDataStream &) { }
+    virtual void tcpHandleLuaMsg(const QString &, CLuaMsgReader &) { }
+    virtual void tcpChannelStats(ETcpMessage, uint16_t,
+                                 const CWindowStats::SResult &) { }
+    virtual void tcpRobotList(const QStringList &) { }
+    virtual void tcpPose(const SRobotPose &) { }
+    // duration: ms since profiling was started
+    virtual void tcpLuaProfile(bool, quint32, quint32,
+                               const QList<SLuaProfileEntry> &) { }
     virtual void updateDriveSpeed(int left, int right) = 0;
 
     friend class CBaseClientTcpHandler;
@@ -67,17 +124,43 @@ protected:
     void disconnectFromServer(void) { tcpHandler.disconnectFromServer(); }
     bool connected(void) const { return tcpHandler.connected(); }
     quint32 bytesReceivedSecond(void) const { return tcpHandler.bytesReceivedSecond(); }
+    void setUdpTelemetry(bool e) { tcpHandler.setUdpTelemetry(e); }
+    bool getUdpTelemetry(void) const { return tcpHandler.getUdpTelemetry(); }
+    quint32 udpFramesLost(void) const { return tcpHandler.getUdpFramesLost(); }
+    // Enabled by default, large messages are compressed if the server supports it
+    void setCompression(bool e) { tcpHandler.setCompression(e); }
+    ETcpCodec getCompressionCodec(void) const { return tcpHandler.getCodec(); }
+    const STcpCompressionStats &getSentCompression(void) const
+    { return tcpHandler.getSentCompression(); }
+    const STcpCompressionStats &getReceivedCompression(void) const
+    { return tcpHandler.getReceivedCompression(); }
     void executeCommand(const QString &cmd);
     void updateDriving(int dir);
     void stopDrive(void);
     void uploadLocalScript(const QString &name, const QByteArray &text);
-    void runLocalScript(const QByteArray &text);
+    // name: runs next to other scripts, replacing a script with the same
+    // name, the main script otherwise. priority: 1-10, 0 for the default
+    void runLocalScript(const QByteArray &text, const QString &name=QString(),
+                        uint8_t priority=0);
     void uploadRunLocalScript(const QString &name, const QByteArray &text);
     void runServerScript(const QString &name);
     void removeServerScript(const QString &name);
     void downloadServerScript(const QString &name);
+    // script: name given to runLocalScript(), empty for the main script
     void executeScriptCommand(const QString &cmd,
-                              const QStringList &args=QStringList());
+                              const QStringList &args=QStringList(),
+                              const QString &script=QString());
+    void requestChannelStats(ETcpMessage msg, uint16_t window);
+    void requestLatencyStats(void);
+    // Results are sent every second until stopped, see tcpLuaProfile()
+    void setLuaProfiling(bool enable);
+    // Index in the list given to tcpRobotList(), robot 0 is used by default
+    void selectRobot(int robot);
+    // Should be called when received data is shown, for latency statistics
+    void dataRendered(void);
+    const CWindowStats::SResult &getServerLatency(void) const { return serverLatency; }
+    CWindowStats::SResult getRenderLatency(void);
+    CWindowStats::SResult getEndToEndLatency(void);
 
     virtual void appendConsoleOutput(const QString &text) = 0;
     virtual void appendLogOutput(const QString &text) = 0;
@@ -42,7 +42,9 @@ QT += network
 LIBS += -lncursesw
 INCLUDEPATH += ../../shared
 DEPENDPATH += ../../shared
-SOURCES += tcputil.cpp
+SOURCES += tcputil.cpp \
+    luamsg.cpp \
+    windowstats.cpp
 INCLUDEPATH += ../client-base
 DEPENDPATH += ../client-base
 HEADERS += client_base.h
@@ -197,8 +197,8 @@ void CNCursClient::tcpRobotStateUpdate(const SStateSensors &,
 
 void CNCursClient::tcpHandleRobotData(ETcpMessage msg, int data)
 {
-    averagedSensorDataMap[msg].count++;
-    averagedSensorDataMap[msg].total += data;
+    averagedSensorData[getChannelIndex(msg)].count++;
+    averagedSensorData[getChannelIndex(msg)].total += data;
 }
 
 void CNCursClient::appendConsoleOutput(const QString &text)
@@ -287,17 +287,17 @@ void CNCursClient::update()
 {
     if (updateTime.isNull() || (updateTime.elapsed() >= 1000))
     {
-        for (std::map<ETcpMessage, SSensorData>::iterator it=averagedSensorDataMap.begin();
-             it!= averagedSensorDataMap.end(); ++it)
+        for (int i=0; i<ROBOT_CHANNEL_COUNT; ++i)
         {
-            if (!it->second.count)
+            SSensorData &sdata = averagedSensorData[i];
+            if (!sdata.count)
                 continue;
 
-            const ETcpMessage msg = it->first;
-            const uint32_t data = it->second.total / it->second.count;
+            const ETcpMessage msg = robotChannels[i].tcpMessage;
+            const uint32_t data = sdata.total / sdata.count;
 
-            it->second.total = 0;
-            it->second.count = 0;
+            sdata.total = 0;
+            sdata.count = 0;
 
             if (msg == TCP_BASE_LEDS)
                 otherDisplay->setDisplayValue(DISPLAY_MAIN_LEDS, 0,
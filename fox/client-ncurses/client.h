@@ -69,7 +69,7 @@ class CNCursClient: public CBaseClient, public NNCurses::CWindow
         SSensorData(void) : total(0), count(0) {}
     };
 
-    std::map<ETcpMessage, SSensorData> averagedSensorDataMap;
+    SSensorData averagedSensorData[ROBOT_CHANNEL_COUNT]; // Indexed by getChannelIndex()
 
     CDisplayWidget *movementDisplay, *sensorDisplay, *otherDisplay;
     NNCurses::CButton *connectButton;
@@ -22,7 +22,9 @@ HEADERS += client.h \
     drivewidget.h
 INCLUDEPATH += ../../../shared
 DEPENDPATH += ../../../shared
-SOURCES += tcputil.cpp
+SOURCES += tcputil.cpp \
+    luamsg.cpp \
+    windowstats.cpp
 INCLUDEPATH += ../../client-base
 DEPENDPATH += ../../client-base
 HEADERS += client_base.h
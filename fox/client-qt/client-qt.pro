@@ -15,6 +15,8 @@ QT += network
 DEPENDPATH += ../../shared \
     ../client-base
 SOURCES += tcputil.cpp \
+    luamsg.cpp \
+    windowstats.cpp \
     client.cpp \
     sensorplot.cpp \
     scanner.cpp \
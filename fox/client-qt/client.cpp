@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdint.h>
 
 #include <QtGui>
@@ -128,6 +129,9 @@ CQtClient::CQtClient() : isACSScanning(false), alternatingACSScan(false),
                          currentScanPosition(0), previousScriptItem(NULL), robotNavEnabled(false),
                          simNavUpdatePathGrid(true), firstStateUpdate(false), ACSPowerState(ACS_POWER_OFF)
 {
+    for (int i=0; i<ROBOT_CHANNEL_COUNT; ++i)
+        delayedSensorData[i] = 0;
+    
     QTabWidget *mainTab = new QTabWidget;
     mainTab->setTabPosition(QTabWidget::West);
     setCentralWidget(mainTab);
@@ -143,6 +147,19 @@ CQtClient::CQtClient() : isACSScanning(false), alternatingACSScan(false),
     bytesReceivedLabel->setText("D: 0 B/s");
     statusBar()->addPermanentWidget(bytesReceivedLabel);
 
+    latencyLabel = new QLabel;
+    latencyLabel->setFrameStyle(QFrame::StyledPanel | QFrame::Sunken);
+    latencyLabel->setToolTip("Data latency, median/99th percentile (ms)\n"
+                             "serial: serial port -> sent by server\n"
+                             "UI: received -> shown\n"
+                             "total: serial port -> shown");
+    statusBar()->addPermanentWidget(latencyLabel);
+
+    poseLabel = new QLabel;
+    poseLabel->setFrameStyle(QFrame::StyledPanel | QFrame::Sunken);
+    poseLabel->setToolTip("Robot pose from odometry (cm, degrees) and its standard deviation");
+    statusBar()->addPermanentWidget(poseLabel);
+
     QTimer *uptimer = new QTimer(this);
     connect(uptimer, SIGNAL(timeout()), this, SLOT(updateSensors()));
     uptimer->start(500);
@@ -539,6 +556,15 @@ QWidget *CQtClient::createConnectionWidget()
     
     hbox->addWidget(connectButton = new QPushButton("Connect"));
     connect(connectButton, SIGNAL(clicked()), this, SLOT(toggleServerConnection()));
+
+    hbox->addWidget(robotComboBox = new QComboBox);
+    robotComboBox->setToolTip("Robot to control (server serial port)");
+    connectionDependentWidgets << robotComboBox;
+    connect(robotComboBox, SIGNAL(activated(int)), this, SLOT(robotSelected(int)));
+
+    hbox->addWidget(udpTelemetryBox = new QCheckBox("UDP telemetry"));
+    udpTelemetryBox->setToolTip("Receive sensor data over UDP (lower latency, may drop updates)");
+    connect(udpTelemetryBox, SIGNAL(toggled(bool)), this, SLOT(udpTelemetryToggled(bool)));
     
     return ret;
 }
@@ -695,8 +721,11 @@ QWidget *CQtClient::createLuaScriptTab()
 {
     QSplitter *split = new QSplitter(Qt::Vertical);
 
+    QSplitter *editsplit = new QSplitter(Qt::Horizontal);
+    split->addWidget(editsplit);
+
     QGroupBox *group = new QGroupBox("Editor");
-    split->addWidget(group);
+    editsplit->addWidget(group);
     QVBoxLayout *vbox = new QVBoxLayout(group);
 
     vbox->addWidget(scriptEditor = new CEditor(this));
@@ -705,6 +734,10 @@ QWidget *CQtClient::createLuaScriptTab()
                          "Save", scriptEditor->editor(), SLOT(save()));
     a->setShortcut(tr("Ctrl+S"));
 
+    editsplit->addWidget(createLuaProfileWidget());
+    editsplit->setStretchFactor(0, 65);
+    editsplit->setStretchFactor(1, 35);
+
     QWidget *w = new QWidget;
     QHBoxLayout *hbox = new QHBoxLayout(w);
     split->addWidget(w);
@@ -717,6 +750,32 @@ QWidget *CQtClient::createLuaScriptTab()
     return split;
 }
 
+QWidget *CQtClient::createLuaProfileWidget()
+{
+    QGroupBox *ret = new QGroupBox("Profiler");
+    ret->setToolTip("Time and memory used by server scripts, per line");
+
+    QVBoxLayout *vbox = new QVBoxLayout(ret);
+
+    vbox->addWidget(luaProfileTree = new QTreeWidget);
+    luaProfileTree->setHeaderLabels(QStringList() << "Function" << "Source" << "Line" <<
+                                    "Time (ms)" << "Time (%)" << "Samples" << "Alloc (kB)");
+    luaProfileTree->setRootIsDecorated(false);
+    luaProfileTree->setSortingEnabled(true);
+    luaProfileTree->sortByColumn(3, Qt::DescendingOrder);
+
+    QHBoxLayout *hbox = new QHBoxLayout;
+    vbox->addLayout(hbox);
+
+    hbox->addWidget(luaProfileButton = new QPushButton("Profile"));
+    luaProfileButton->setCheckable(true);
+    connect(luaProfileButton, SIGNAL(toggled(bool)), this, SLOT(luaProfileToggled(bool)));
+
+    hbox->addWidget(luaProfileLabel = new QLabel, 1);
+
+    return ret;
+}
+
 QWidget *CQtClient::createLuaConsoleTab()
 {
     QWidget *ret = new QWidget;
@@ -1145,31 +1204,31 @@ void CQtClient::tcpHandleRobotData(ETcpMessage msg, int data)
         case TCP_MOTOR_CURRENT_RIGHT:
         case TCP_BATTERY:
         case TCP_MIC:
-            averagedSensorDataMap[msg].total += data;
-            averagedSensorDataMap[msg].count++;
+            averagedSensorData[getChannelIndex(msg)].total += data;
+            averagedSensorData[getChannelIndex(msg)].count++;
             break;
 
         case TCP_MOTOR_DESTSPEED_LEFT:
         case TCP_MOTOR_DESTSPEED_RIGHT:
-            delayedSensorDataMap[msg] = data;
+            delayedSensorData[getChannelIndex(msg)] = data;
             break;
 
         case TCP_MOTOR_DIST_LEFT:
             motorDistance[0] = data;
-            delayedSensorDataMap[msg] = data;
+            delayedSensorData[getChannelIndex(msg)] = data;
             break;
             
         case TCP_MOTOR_DIST_RIGHT:
             motorDistance[1] = data;
-            delayedSensorDataMap[msg] = data;
+            delayedSensorData[getChannelIndex(msg)] = data;
             break;
             
         case TCP_SHARPIR:
             if (isTurretScanning)
                 turretScanData << data;
             
-            averagedSensorDataMap[msg].total += data;
-            averagedSensorDataMap[msg].count++;
+            averagedSensorData[getChannelIndex(msg)].total += data;
+            averagedSensorData[getChannelIndex(msg)].count++;
             break;
 
         default: break;
@@ -1182,6 +1241,49 @@ void CQtClient::tcpLuaScripts(const QStringList &list)
     serverScriptListWidget->addItems(list);
 }
 
+void CQtClient::tcpRobotList(const QStringList &list)
+{
+    // Server starts with the first robot
+    robotComboBox->clear();
+    robotComboBox->addItems(list);
+}
+
+void CQtClient::tcpPose(const SRobotPose &pose)
+{
+    const float sdpos = sqrtf(pose.covariance[SRobotPose::COV_XX] +
+                              pose.covariance[SRobotPose::COV_YY]);
+    const float sdangle = sqrtf(pose.covariance[SRobotPose::COV_AA]);
+    poseLabel->setText(QString("Pose: %1, %2 (%3) %4 deg (%5)").arg(pose.x, 0, 'f', 1).
+                       arg(pose.y, 0, 'f', 1).arg(sdpos, 0, 'f', 1).
+                       arg(pose.angle, 0, 'f', 0).arg(sdangle, 0, 'f', 0));
+}
+
+void CQtClient::tcpLuaProfile(bool active, quint32 duration, quint32 samples,
+                              const QList<SLuaProfileEntry> &entries)
+{
+    luaProfileButton->blockSignals(true);
+    luaProfileButton->setChecked(active);
+    luaProfileButton->blockSignals(false);
+
+    luaProfileLabel->setText(QString("%1 s, %2 samples").arg(duration / 1000.0, 0, 'f', 1).
+                             arg(samples));
+
+    luaProfileTree->clear();
+    foreach(SLuaProfileEntry e, entries)
+    {
+        // Numbers as data, so they sort numerically
+        QTreeWidgetItem *item = new QTreeWidgetItem(luaProfileTree);
+        item->setText(0, e.function);
+        item->setText(1, e.source);
+        item->setData(2, Qt::DisplayRole, e.line);
+        item->setData(3, Qt::DisplayRole, qRound64(e.timeUS / 100.0) / 10.0);
+        if (duration)
+            item->setData(4, Qt::DisplayRole, qRound64(e.timeUS / static_cast<double>(duration)) / 10.0);
+        item->setData(5, Qt::DisplayRole, e.samples);
+        item->setData(6, Qt::DisplayRole, qRound64(e.allocBytes / 102.4) / 10.0);
+    }
+}
+
 void CQtClient::tcpRequestedScript(const QByteArray &text)
 {
     QString fn = QFileDialog::getSaveFileName(this, "Save script", downloadScript,
@@ -1222,7 +1324,7 @@ void CQtClient::tcpScriptRunning(bool r)
     luaAbortScriptButton->setEnabled(r);
 }
 
-void CQtClient::tcpHandleLuaMsg(const QString &msg, QDataStream &args)
+void CQtClient::tcpHandleLuaMsg(const QString &msg, CLuaMsgReader &args)
 {
     qDebug() << "Received msg:" << msg;
 
@@ -1277,14 +1379,26 @@ void CQtClient::tcpHandleLuaMsg(const QString &msg, QDataStream &args)
         }
         else if (msg == "path")
         {
-            QMap<QString, QVariant> p;
-            args >> p;
+            // Array of {x=, y=} tables
+            const int size = args.readArray();
             QList<QPoint> path;
 
-            for (QMap<QString, QVariant>::iterator it=p.begin(); it!=p.end(); ++it)
+            for (int i=0; i<size; ++i)
             {
-                const QMap<QString, QVariant> coord(it.value().toMap());
-                path << QPoint(coord["x"].toInt(), coord["y"].toInt());
+                QPoint p;
+                const int fields = args.readMap();
+                for (int f=0; f<fields; ++f)
+                {
+                    QString key;
+                    args >> key;
+                    if (key == "x")
+                        args >> p.rx();
+                    else if (key == "y")
+                        args >> p.ry();
+                    else
+                        args.skip();
+                }
+                path << p;
             }
 
             robotNavMap->setPath(path);
@@ -1321,77 +1435,97 @@ void CQtClient::updateSensors()
     if (!connected())
         return;
     
-    for (QMap<ETcpMessage, SSensorData>::iterator it=averagedSensorDataMap.begin();
-         it!=averagedSensorDataMap.end(); ++it)
+    for (int i=0; i<ROBOT_CHANNEL_COUNT; ++i)
     {
-        if (it.value().count == 0)
+        SSensorData &sdata = averagedSensorData[i];
+        if (sdata.count == 0)
             continue;
         
-        int data = it.value().total / it.value().count;
+        const ETcpMessage msg = robotChannels[i].tcpMessage;
+        int data = sdata.total / sdata.count;
         
-        if (it.key() == TCP_LIGHT_LEFT)
+        if (msg == TCP_LIGHT_LEFT)
         {
             lightSensorsLCD[0]->display(data);
             lightSensorsPlot->addData("Left", data);
         }
-        else if (it.key() == TCP_LIGHT_RIGHT)
+        else if (msg == TCP_LIGHT_RIGHT)
         {
             lightSensorsLCD[1]->display(data);
             lightSensorsPlot->addData("Right", data);
         }
-        else if (it.key() == TCP_MOTOR_SPEED_LEFT)
+        else if (msg == TCP_MOTOR_SPEED_LEFT)
         {
             motorSpeedLCD[0]->display(data);
             motorSpeedPlot->addData("Left (actual)", data);
         }
-        else if (it.key() == TCP_MOTOR_SPEED_RIGHT)
+        else if (msg == TCP_MOTOR_SPEED_RIGHT)
         {
             motorSpeedLCD[1]->display(data);
             motorSpeedPlot->addData("Right (actual)", data);
         }
-        else if (it.key() == TCP_MOTOR_CURRENT_LEFT)
+        else if (msg == TCP_MOTOR_CURRENT_LEFT)
         {
             motorCurrentLCD[0]->display(data);
             motorCurrentPlot->addData("Left", data);
         }
-        else if (it.key() == TCP_MOTOR_CURRENT_RIGHT)
+        else if (msg == TCP_MOTOR_CURRENT_RIGHT)
         {
             motorCurrentLCD[1]->display(data);
             motorCurrentPlot->addData("Right", data);
         }
-        else if (it.key() == TCP_BATTERY)
+        else if (msg == TCP_BATTERY)
         {
             batteryLCD->display(data);
             batteryPlot->addData("Battery", data);
         }
-        else if (it.key() == TCP_MIC)
+        else if (msg == TCP_MIC)
             micPlot->addData("Microphone", data);
-        else if (it.key() == TCP_SHARPIR)
+        else if (msg == TCP_SHARPIR)
         {
             sharpIRSensor->display(data);
             sharpIRPlot->addData("Sharp IR", data);
         }
         
-        it.value().total = it.value().count = 0;
+        sdata.total = sdata.count = 0;
     }
     
     motorSpeedPlot->addData("Left (destination)",
-                            delayedSensorDataMap[TCP_MOTOR_DESTSPEED_LEFT]);
+                            delayedSensorData[getChannelIndex(TCP_MOTOR_DESTSPEED_LEFT)]);
     
     motorSpeedPlot->addData("Right (destination)",
-                            delayedSensorDataMap[TCP_MOTOR_DESTSPEED_RIGHT]);
+                            delayedSensorData[getChannelIndex(TCP_MOTOR_DESTSPEED_RIGHT)]);
     
-    motorDistanceLCD[0]->display(delayedSensorDataMap[TCP_MOTOR_DIST_LEFT]);
-    motorDistancePlot->addData("Left", delayedSensorDataMap[TCP_MOTOR_DIST_LEFT]);
+    motorDistanceLCD[0]->display(delayedSensorData[getChannelIndex(TCP_MOTOR_DIST_LEFT)]);
+    motorDistancePlot->addData("Left", delayedSensorData[getChannelIndex(TCP_MOTOR_DIST_LEFT)]);
     
-    motorDistanceLCD[1]->display(delayedSensorDataMap[TCP_MOTOR_DIST_RIGHT]);
-    motorDistancePlot->addData("Right", delayedSensorDataMap[TCP_MOTOR_DIST_RIGHT]);
+    motorDistanceLCD[1]->display(delayedSensorData[getChannelIndex(TCP_MOTOR_DIST_RIGHT)]);
+    motorDistancePlot->addData("Right", delayedSensorData[getChannelIndex(TCP_MOTOR_DIST_RIGHT)]);
+
+    dataRendered();
 }
 
 void CQtClient::updateBytesReceivedSecond()
 {
     const quint32 bytes = bytesReceivedSecond();
-    bytesReceivedLabel->setText(QString("D: %1 B/s").arg(bytes));
+    QString text(QString("D: %1 B/s").arg(bytes));
+    if (getUdpTelemetry())
+        text += QString(" (UDP lost: %1)").arg(udpFramesLost());
+
+    // Compressed size in percent of the original
+    const ETcpCodec codec = getCompressionCodec();
+    if (codec != TCP_CODEC_NONE)
+        text += QString(" (%1: in %2%, out %3%)").arg(getTcpCodecName(codec)).
+                arg(getReceivedCompression().getRatio()).arg(getSentCompression().getRatio());
+
+    bytesReceivedLabel->setText(text);
+
+    const CWindowStats::SResult &serial = getServerLatency();
+    const CWindowStats::SResult ui = getRenderLatency(), total = getEndToEndLatency();
+    latencyLabel->setText(QString("Lat: serial %1/%2 UI %3/%4 total %5/%6 ms").
+                          arg(serial.p50).arg(serial.p99).arg(ui.p50).arg(ui.p99).
+                          arg(total.p50).arg(total.p99));
+    requestLatencyStats(); // For the next update
 }
 
 void CQtClient::toggleServerConnection()
@@ -26,6 +26,7 @@ class QSignalMapper;
 class QSlider;
 class QSpinBox;
 class QTimer;
+class QTreeWidget;
 
 class QwtSlider;
 
@@ -40,6 +41,8 @@ class CQtClient: public QMainWindow, public CBaseClient
     
     QLineEdit *serverEdit;
     QPushButton *connectButton;
+    QComboBox *robotComboBox;
+    QCheckBox *udpTelemetryBox;
     QList<QWidget *> connectionDependentWidgets, scriptDisabledWidgets;
     QPlainTextEdit *consoleOut;
     QLineEdit *consoleIn;
@@ -51,10 +54,11 @@ class CQtClient: public QMainWindow, public CBaseClient
         SSensorData(void) : total(0), count(0) {}
     };
     
-    QMap<ETcpMessage, SSensorData> averagedSensorDataMap;
-    QMap<ETcpMessage, int> delayedSensorDataMap;
+    // Indexed by getChannelIndex()
+    SSensorData averagedSensorData[ROBOT_CHANNEL_COUNT];
+    int delayedSensorData[ROBOT_CHANNEL_COUNT];
     QTimer *bytesReceivedTimer;
-    QLabel *bytesReceivedLabel;
+    QLabel *bytesReceivedLabel, *latencyLabel, *poseLabel;
     
     // Overview widget
     QLCDNumber *motorSpeedLCD[2];
@@ -117,6 +121,9 @@ class CQtClient: public QMainWindow, public CBaseClient
     QListWidget *localScriptListWidget, *serverScriptListWidget;
     QListWidgetItem *previousScriptItem;
     QString downloadScript;
+    QTreeWidget *luaProfileTree;
+    QPushButton *luaProfileButton;
+    QLabel *luaProfileLabel;
 
     // Lua console
     QPlainTextEdit *luaConsoleOut;
@@ -171,6 +178,7 @@ class CQtClient: public QMainWindow, public CBaseClient
     QWidget *createLuaConsoleTab(void);
     QWidget *createLocalLuaWidget(void);
     QWidget *createServerLuaWidget(void);
+    QWidget *createLuaProfileWidget(void);
     
     QWidget *createRobotNavWidget(void);
     QWidget *createSimNavWidget(void);
@@ -190,13 +198,19 @@ class CQtClient: public QMainWindow, public CBaseClient
     virtual void tcpLuaScripts(const QStringList &list);
     virtual void tcpRequestedScript(const QByteArray &text);
     virtual void tcpScriptRunning(bool r);
-    virtual void tcpHandleLuaMsg(const QString &msg, QDataStream &args);
+    virtual void tcpHandleLuaMsg(const QString &msg, CLuaMsgReader &args);
+    virtual void tcpRobotList(const QStringList &list);
+    virtual void tcpPose(const SRobotPose &pose);
+    virtual void tcpLuaProfile(bool active, quint32 duration, quint32 samples,
+                               const QList<SLuaProfileEntry> &entries);
     virtual void updateDriveSpeed(int left, int right);
     
 private slots:
     void updateSensors(void);
     void updateBytesReceivedSecond(void);
     void toggleServerConnection(void);
+    void udpTelemetryToggled(bool checked) { setUdpTelemetry(checked); }
+    void robotSelected(int robot) { selectRobot(robot); }
     void setMicUpdateTime(int value);
     void micPlotToggled(bool checked);
     void driveButtonPressed(int dir) { updateDriving(dir); }
@@ -217,6 +231,7 @@ private slots:
     void downloadServerScriptPressed(void);
     void sendLuaConsolePressed(void);
     void luaAbortScriptPressed(void);
+    void luaProfileToggled(bool checked) { setLuaProfiling(checked); }
     void robotNavStartPressed(void);
     void robotNavSetStartToggled(bool e);
     void robotNavSetGoalToggled(bool e);
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <QString>
+
+#include "tcputil.h"
+#include "timeutil.h"
+
+// Compares the time to build outgoing messages with CTcpMsgComposer and
+// CTcpMsgWriter, for the kinds of messages the server sends most.
+
+namespace {
+
+// Keeps the compiler from optimizing the work away
+volatile int sink = 0;
+
+void report(const char *name, uint64_t composerus, uint64_t writerus, int messages)
+{
+    const double cns = composerus * 1000.0 / messages, wns = writerus * 1000.0 / messages;
+    printf("%-28s composer %8.1f ns/msg  writer %8.1f ns/msg  (%.1fx)\n", name, cns, wns,
+           (wns > 0.0) ? cns / wns : 0.0);
+}
+
+void benchChannel(int iterations)
+{
+    const ETcpMessage msg = robotChannels[0].tcpMessage;
+
+    uint64_t start = getTimeUS();
+    for (int i=0; i<iterations; ++i)
+    {
+        const QByteArray block(CTcpMsgComposer(msg) << static_cast<quint16>(i));
+        sink += block.size();
+    }
+    const uint64_t composer = getTimeUS() - start;
+
+    CTcpMsgWriter writer;
+    start = getTimeUS();
+    for (int i=0; i<iterations; ++i)
+    {
+        writer.clear();
+        writer.begin(msg) << static_cast<quint16>(i);
+        writer.end();
+        sink += writer.size();
+    }
+    const uint64_t w = getTimeUS() - start;
+
+    report("channel value", composer, w, iterations);
+}
+
+void benchTick(int iterations)
+{
+    // All channels of a send tick, as one buffer
+    uint64_t start = getTimeUS();
+    for (int i=0; i<iterations; ++i)
+    {
+        QByteArray data;
+        for (int c=0; c<ROBOT_CHANNEL_COUNT; ++c)
+            data += CTcpMsgComposer(robotChannels[c].tcpMessage) << static_cast<quint16>(i);
+        sink += data.size();
+    }
+    const uint64_t composer = getTimeUS() - start;
+
+    CTcpMsgWriter writer;
+    start = getTimeUS();
+    for (int i=0; i<iterations; ++i)
+    {
+        writer.clear();
+        for (int c=0; c<ROBOT_CHANNEL_COUNT; ++c)
+        {
+            writer.begin(robotChannels[c].tcpMessage) << static_cast<quint16>(i);
+            writer.end();
+        }
+        sink += writer.size();
+    }
+    const uint64_t w = getTimeUS() - start;
+
+    report("tick (all channels)", composer, w, iterations * ROBOT_CHANNEL_COUNT);
+}
+
+void benchText(int iterations)
+{
+    const QString text("Lua output: calculated path with 42 cells");
+
+    uint64_t start = getTimeUS();
+    for (int i=0; i<iterations; ++i)
+    {
+        const QByteArray block(CTcpMsgComposer(TCP_LUATEXT) << text);
+        sink += block.size();
+    }
+    const uint64_t composer = getTimeUS() - start;
+
+    CTcpMsgWriter writer;
+    start = getTimeUS();
+    for (int i=0; i<iterations; ++i)
+    {
+        writer.clear();
+        writer.begin(TCP_LUATEXT) << text;
+        writer.end();
+        sink += writer.size();
+    }
+    const uint64_t w = getTimeUS() - start;
+
+    report("Lua text", composer, w, iterations);
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = 1000000, opt;
+
+    while ((opt = getopt(argc, argv, "n:h")) != -1)
+    {
+        if (opt == 'n')
+            iterations = atoi(optarg);
+        else
+        {
+            fprintf(stderr, "Usage: %s [-n <iterations>] (default 1000000)\n", argv[0]);
+            return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if (iterations <= 0)
+        return 1;
+
+    benchChannel(iterations);
+    benchTick(iterations / ROBOT_CHANNEL_COUNT);
+    benchText(iterations);
+
+    return 0;
+}
@@ -0,0 +1,14 @@
+TEMPLATE = app
+TARGET = msgbench
+CONFIG += console
+QT -= gui
+HEADERS += tcputil.h \
+    timeutil.h
+SOURCES += main.cpp
+INCLUDEPATH += ../../shared \
+    ../server
+DEPENDPATH += ../../shared \
+    ../server
+SOURCES += tcputil.cpp \
+    timeutil.cpp
+OBJECTS_DIR = obj
@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <QCoreApplication>
+
+#include "netbench.h"
+
+namespace {
+
+void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+            "Compares robot data latency over TCP and UDP telemetry on loopback.\n"
+            "  -i <ms>      Interval between frames (default 20)\n"
+            "  -t <secs>    Duration (default 10)\n"
+            "  -b <kB/s>    Extra TCP traffic, e.g. script transfers (default 0)\n", name);
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    CNetBench::SOptions options;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:t:b:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            options.interval = atoi(optarg);
+            break;
+        case 't':
+            options.duration = atoi(optarg);
+            break;
+        case 'b':
+            options.bulkRate = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if ((options.interval <= 0) || (options.duration <= 0) || (options.bulkRate < 0))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    CNetBench bench(options);
+    if (!bench.start())
+        return 1;
+
+    return app.exec();
+}
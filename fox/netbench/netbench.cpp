@@ -0,0 +1,195 @@
+#include <stdio.h>
+
+#include <QtCore>
+#include <QtNetwork>
+
+#include "netbench.h"
+#include "timeutil.h"
+
+CNetBench::CNetBench(const SOptions &o) : options(o), sendSocket(0), sequence(0),
+                                          tcpReadBlockSize(0), framesSent(0), bulkBytesSent(0),
+                                          tcpPath("TCP"), udpPath("UDP")
+{
+    tcpServer = new QTcpServer(this);
+    connect(tcpServer, SIGNAL(newConnection()), this, SLOT(clientConnected()));
+
+    receiveSocket = new QTcpSocket(this);
+    connect(receiveSocket, SIGNAL(readyRead()), this, SLOT(tcpHasData()));
+
+    udpSendSocket = new QUdpSocket(this);
+    udpReceiveSocket = new QUdpSocket(this);
+    connect(udpReceiveSocket, SIGNAL(readyRead()), this, SLOT(udpHasDatagrams()));
+
+    frameTimer = new QTimer(this);
+    connect(frameTimer, SIGNAL(timeout()), this, SLOT(sendFrame()));
+    bulkTimer = new QTimer(this);
+    connect(bulkTimer, SIGNAL(timeout()), this, SLOT(sendBulk()));
+}
+
+void CNetBench::handleFrame(SPath &path, const QByteArray &frame, bool shown)
+{
+    QDataStream in(frame);
+    in.setVersion(QDataStream::Qt_4_4);
+    quint32 seq, time;
+    in >> seq >> time;
+
+    // Same as the client: older frames are useless
+    if (path.gotFrame && (static_cast<qint32>(seq - path.lastSequence) <= 0))
+    {
+        ++path.stale;
+        return;
+    }
+
+    if (path.gotFrame)
+        path.lost += seq - path.lastSequence - 1;
+
+    path.gotFrame = true;
+    path.lastSequence = seq;
+
+    if (!shown)
+    {
+        ++path.stale; // Superseded by a newer frame that arrived with it
+        return;
+    }
+
+    ++path.received;
+    path.latencies << static_cast<quint32>(getTimeUS()) - time;
+}
+
+void CNetBench::printPath(const SPath &path, uint32_t sent)
+{
+    QVector<uint32_t> lat(path.latencies);
+    qSort(lat);
+
+    uint64_t sum = 0;
+    foreach(uint32_t l, lat)
+        sum += l;
+
+    const int n = lat.size();
+    printf("%s: %u/%u frames, lost %u, stale %u, latency (us) mean %llu p50 %u p99 %u max %u\n",
+           path.name, path.received, sent, path.lost, path.stale,
+           static_cast<unsigned long long>((n) ? sum / n : 0), (n) ? lat[n / 2] : 0,
+           (n) ? lat[qMin(n - 1, (n * 99) / 100)] : 0, (n) ? lat[n - 1] : 0);
+}
+
+void CNetBench::clientConnected()
+{
+    sendSocket = tcpServer->nextPendingConnection();
+
+    frameTimer->start(options.interval);
+    if (options.bulkRate)
+        bulkTimer->start(BULK_INTERVAL);
+    QTimer::singleShot(options.duration * 1000, this, SLOT(finish()));
+}
+
+void CNetBench::sendFrame()
+{
+    // Telemetry datagram layout, see tcputil.h
+    frameWriter.clear();
+    frameWriter << sequence++ << static_cast<quint32>(getTimeUS()) <<
+                   static_cast<quint8>(ROBOT_CHANNEL_COUNT);
+    for (int i=0; i<ROBOT_CHANNEL_COUNT; ++i)
+        frameWriter << static_cast<quint8>(robotChannels[i].tcpMessage) << static_cast<quint16>(i);
+
+    const QByteArray frame(frameWriter.data(), frameWriter.size());
+    udpSendSocket->writeDatagram(frame, QHostAddress::LocalHost, udpReceiveSocket->localPort());
+
+    // The message type doesn't matter, the receiver only sees frames and bulk
+    tcpWriter.clear();
+    tcpWriter.begin(TCP_DATAAGE) << frame;
+    tcpWriter.end();
+    sendSocket->write(tcpWriter.data(), tcpWriter.size());
+
+    ++framesSent;
+}
+
+void CNetBench::sendBulk()
+{
+    const int size = options.bulkRate * 1024 * BULK_INTERVAL / 1000;
+    sendSocket->write(CTcpMsgComposer(TCP_REQUESTEDSCRIPT) << QByteArray(size, 'x'));
+    bulkBytesSent += size;
+}
+
+void CNetBench::tcpHasData()
+{
+    QDataStream in(receiveSocket);
+    in.setVersion(QDataStream::Qt_4_4);
+
+    while (true)
+    {
+        if (tcpReadBlockSize == 0)
+        {
+            if (receiveSocket->bytesAvailable() < (int)sizeof(quint32))
+                return;
+            in >> tcpReadBlockSize;
+        }
+
+        if (receiveSocket->bytesAvailable() < tcpReadBlockSize)
+            return;
+
+        const QByteArray block(receiveSocket->read(tcpReadBlockSize));
+        tcpReadBlockSize = 0;
+
+        if (static_cast<uint8_t>(block[0]) == TCP_DATAAGE)
+        {
+            QDataStream blockin(block);
+            blockin.setVersion(QDataStream::Qt_4_4);
+            quint8 msg;
+            QByteArray frame;
+            blockin >> msg >> frame;
+            handleFrame(tcpPath, frame, true);
+        }
+    }
+}
+
+void CNetBench::udpHasDatagrams()
+{
+    // Newest wins, like the client
+    QByteArray newest;
+    while (udpReceiveSocket->hasPendingDatagrams())
+    {
+        QByteArray datagram;
+        datagram.resize(udpReceiveSocket->pendingDatagramSize());
+        udpReceiveSocket->readDatagram(datagram.data(), datagram.size());
+
+        if (!newest.isEmpty())
+            handleFrame(udpPath, newest, false);
+        newest = datagram;
+    }
+
+    if (!newest.isEmpty())
+        handleFrame(udpPath, newest, true);
+}
+
+void CNetBench::finish()
+{
+    frameTimer->stop();
+    bulkTimer->stop();
+
+    printf("%u frames of %d channels every %d ms, bulk TCP traffic: %llu kB\n", framesSent,
+           ROBOT_CHANNEL_COUNT, options.interval,
+           static_cast<unsigned long long>(bulkBytesSent / 1024));
+    printPath(tcpPath, framesSent);
+    printPath(udpPath, framesSent);
+
+    QCoreApplication::quit();
+}
+
+bool CNetBench::start()
+{
+    if (!tcpServer->listen(QHostAddress::LocalHost, 0))
+    {
+        fprintf(stderr, "Failed to listen: %s\n", qPrintable(tcpServer->errorString()));
+        return false;
+    }
+
+    if (!udpReceiveSocket->bind(QHostAddress::LocalHost, 0))
+    {
+        fprintf(stderr, "Failed to bind UDP socket: %s\n",
+                qPrintable(udpReceiveSocket->errorString()));
+        return false;
+    }
+
+    receiveSocket->connectToHost(QHostAddress::LocalHost, tcpServer->serverPort());
+    return true;
+}
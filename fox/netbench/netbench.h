@@ -0,0 +1,76 @@
+#ifndef NETBENCH_H
+#define NETBENCH_H
+
+#include <stdint.h>
+
+#include <QObject>
+#include <QVector>
+
+#include "tcputil.h"
+
+class QTcpServer;
+class QTcpSocket;
+class QTimer;
+class QUdpSocket;
+
+// Compares the latency of robot data frames sent over TCP (as before UDP
+// telemetry) with the UDP telemetry channel, both over loopback in one
+// process. Every frame has the telemetry datagram layout with the send time
+// (usec) as server time; over TCP it is wrapped in a normal message. Bulk
+// TCP traffic (scripts, Lua output) can be added to show head-of-line
+// blocking.
+class CNetBench: public QObject
+{
+    Q_OBJECT
+
+public:
+    struct SOptions
+    {
+        int interval; // ms between frames
+        int duration; // s
+        int bulkRate; // Extra TCP traffic, kB/s
+        SOptions(void) : interval(20), duration(10), bulkRate(0) { }
+    };
+
+private:
+    enum { BULK_INTERVAL = 100 }; // ms
+
+    struct SPath
+    {
+        const char *name;
+        QVector<uint32_t> latencies; // usec
+        uint32_t received, lost, stale, lastSequence;
+        bool gotFrame;
+        SPath(const char *n) : name(n), received(0), lost(0), stale(0), lastSequence(0),
+                               gotFrame(false) { }
+    };
+
+    SOptions options;
+    QTcpServer *tcpServer;
+    QTcpSocket *sendSocket, *receiveSocket;
+    QUdpSocket *udpSendSocket, *udpReceiveSocket;
+    QTimer *frameTimer, *bulkTimer;
+    CTcpMsgWriter frameWriter, tcpWriter;
+    quint32 sequence, tcpReadBlockSize, framesSent;
+    uint64_t bulkBytesSent;
+    SPath tcpPath, udpPath;
+
+    // shown: false if a newer frame arrived at the same time
+    void handleFrame(SPath &path, const QByteArray &frame, bool shown);
+    static void printPath(const SPath &path, uint32_t sent);
+
+private slots:
+    void clientConnected(void);
+    void sendFrame(void);
+    void sendBulk(void);
+    void tcpHasData(void);
+    void udpHasDatagrams(void);
+    void finish(void);
+
+public:
+    CNetBench(const SOptions &o);
+
+    bool start(void);
+};
+
+#endif
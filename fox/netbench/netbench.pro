@@ -0,0 +1,17 @@
+TEMPLATE = app
+TARGET = netbench
+CONFIG += console
+QT += network
+QT -= gui
+HEADERS += netbench.h \
+    tcputil.h \
+    timeutil.h
+SOURCES += netbench.cpp \
+    main.cpp
+INCLUDEPATH += ../../shared \
+    ../server
+DEPENDPATH += ../../shared \
+    ../server
+SOURCES += tcputil.cpp \
+    timeutil.cpp
+OBJECTS_DIR = obj
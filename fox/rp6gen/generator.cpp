@@ -0,0 +1,561 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // ppoll()
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "generator.h"
+
+namespace {
+
+const char *groupNames[CRP6Generator::GROUP_MAX_INDEX] =
+{
+    "led", "light", "motor", "battery", "acs", "mic", "rc5", "sharpir", "state"
+};
+
+// Same defaults as main.lua, state sensors are sent by the m32 on change
+const int defaultIntervals[CRP6Generator::GROUP_MAX_INDEX] =
+{
+    1000, 500, 1000, 2000, 500, 0, 500, 500, 500
+};
+
+// Argument size per opcode (ESerialCommand), see m32/command.c
+const int commandArgSize[SERIAL_CMD_MAX_INDEX] =
+{
+    1, 1, 1, 1, 2, 1, 1, 3, 1, 4, 4, 0, 3, 5
+};
+
+uint16_t getWordArg(const uint8_t *args)
+{
+    return args[0] + (args[1] << 8);
+}
+
+}
+
+CRP6Generator::SRobot::SRobot() : baseLEDs(0), m32LEDs(0), speedLeft(0), speedRight(0),
+                                  destSpeedLeft(0), destSpeedRight(0), dirLeft(FWD),
+                                  dirRight(FWD), distLeft(0.0f), distRight(0.0f),
+                                  destDistLeft(0), destDistRight(0), battery(780),
+                                  ACSPower(ACS_POWER_OFF), lastRC5(0), sharpIR(80),
+                                  moving(false)
+{
+    state.byte = 0;
+}
+
+CRP6Generator::CRP6Generator() : master(-1), slave(-1), rateScale(1.0f), baudRate(38400),
+                                 commandLoss(0), slaveMode(true), lastSequence(0),
+                                 lastUpdate(0), lastStats(0), lastFlush(0), byteBudget(0.0),
+                                 verbose(false), outSize(0), inSize(0), binaryCommand(false)
+{
+    for (int i=0; i<GROUP_MAX_INDEX; ++i)
+    {
+        groups[i].interval = defaultIntervals[i];
+        groups[i].fixed = false;
+        groups[i].next = 0;
+    }
+}
+
+CRP6Generator::~CRP6Generator()
+{
+    if (!linkName.empty())
+        unlink(linkName.c_str());
+    if (slave != -1)
+        close(slave);
+    if (master != -1)
+        close(master);
+}
+
+uint64_t CRP6Generator::getTimeUS()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (static_cast<uint64_t>(ts.tv_sec) * 1000000) + (ts.tv_nsec / 1000);
+}
+
+int CRP6Generator::getGroup(const char *name)
+{
+    for (int i=0; i<GROUP_MAX_INDEX; ++i)
+    {
+        if (!strcmp(name, groupNames[i]))
+            return i;
+    }
+    return -1;
+}
+
+const char *CRP6Generator::getGroupName(int group)
+{
+    return ((group >= 0) && (group < GROUP_MAX_INDEX)) ? groupNames[group] : "unknown";
+}
+
+bool CRP6Generator::open(const std::string &link)
+{
+    master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if ((master == -1) || (grantpt(master) == -1) || (unlockpt(master) == -1))
+    {
+        perror("Failed to create pseudo terminal");
+        return false;
+    }
+
+    // Raw mode on both sides, the server sets its own options when opening
+    termios tio;
+    tcgetattr(master, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(master, TCSANOW, &tio);
+
+    // Keep the slave side open, so the master doesn't get hangups while the
+    // server isn't connected
+    slave = ::open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave == -1)
+    {
+        perror("Failed to open pseudo terminal slave");
+        return false;
+    }
+    tcsetattr(slave, TCSANOW, &tio);
+
+    if (!link.empty())
+    {
+        unlink(link.c_str());
+        if (symlink(ptsname(master), link.c_str()) == -1)
+        {
+            perror("Failed to create link");
+            return false;
+        }
+        linkName = link;
+    }
+
+    return true;
+}
+
+const char *CRP6Generator::getSlaveName() const
+{
+    return (master != -1) ? ptsname(master) : "";
+}
+
+void CRP6Generator::addFrame(ESerialMessage msg, const uint8_t *data, int size)
+{
+    if ((outSize + size + 3) > OUTPUT_BUFFER_SIZE)
+    {
+        ++stats.framesDropped; // Reader (or emulated baud rate) too slow
+        return;
+    }
+
+    outBuffer[outSize++] = SERIAL_MSG_START;
+    outBuffer[outSize++] = size + 1;
+    outBuffer[outSize++] = msg;
+    memcpy(&outBuffer[outSize], data, size);
+    outSize += size;
+    ++stats.framesSent;
+}
+
+void CRP6Generator::addByteFrame(ESerialMessage msg, uint8_t data)
+{
+    addFrame(msg, &data, 1);
+}
+
+void CRP6Generator::addWordFrame(ESerialMessage msg, uint16_t data)
+{
+    const uint8_t d[2] = { static_cast<uint8_t>(data & 0xFF), static_cast<uint8_t>(data >> 8) };
+    addFrame(msg, d, 2);
+}
+
+void CRP6Generator::sendGroup(int group)
+{
+    const float t = getTimeUS() / 1000000.0f;
+
+    // Same messages and order as sendSlaveData() on the m32
+    switch (group)
+    {
+    case SLAVE_DELAY_LED:
+        addByteFrame(SERIAL_BASE_LEDS, robot.baseLEDs);
+        addByteFrame(SERIAL_M32_LEDS, robot.m32LEDs);
+        break;
+    case SLAVE_DELAY_LIGHT:
+        addWordFrame(SERIAL_LIGHT_LEFT, 500 + 200 * sinf(t * 0.5f) + (rand() % 10));
+        addWordFrame(SERIAL_LIGHT_RIGHT, 500 + 200 * cosf(t * 0.5f) + (rand() % 10));
+        break;
+    case SLAVE_DELAY_MOTOR:
+    {
+        SMotorDirections dirs;
+        dirs.left = dirs.destLeft = robot.dirLeft;
+        dirs.right = dirs.destRight = robot.dirRight;
+        addByteFrame(SERIAL_MOTOR_SPEED_LEFT, robot.speedLeft);
+        addByteFrame(SERIAL_MOTOR_SPEED_RIGHT, robot.speedRight);
+        addByteFrame(SERIAL_MOTOR_DESTSPEED_LEFT, robot.destSpeedLeft);
+        addByteFrame(SERIAL_MOTOR_DESTSPEED_RIGHT, robot.destSpeedRight);
+        addWordFrame(SERIAL_MOTOR_DIST_LEFT, static_cast<uint16_t>(robot.distLeft));
+        addWordFrame(SERIAL_MOTOR_DIST_RIGHT, static_cast<uint16_t>(robot.distRight));
+        addWordFrame(SERIAL_MOTOR_DESTDIST_LEFT, robot.destDistLeft);
+        addWordFrame(SERIAL_MOTOR_DESTDIST_RIGHT, robot.destDistRight);
+        addWordFrame(SERIAL_MOTOR_CURRENT_LEFT, (robot.speedLeft) ? (60 + robot.speedLeft / 2 + rand() % 10) : 0);
+        addWordFrame(SERIAL_MOTOR_CURRENT_RIGHT, (robot.speedRight) ? (60 + robot.speedRight / 2 + rand() % 10) : 0);
+        addByteFrame(SERIAL_MOTOR_DIRECTIONS, dirs.byte);
+        break;
+    }
+    case SLAVE_DELAY_BATTERY:
+        addWordFrame(SERIAL_BATTERY, robot.battery + (rand() % 5));
+        break;
+    case SLAVE_DELAY_ACS:
+        addByteFrame(SERIAL_ACS_POWER, robot.ACSPower);
+        break;
+    case SLAVE_DELAY_MIC:
+        addWordFrame(SERIAL_MIC, rand() % 100);
+        break;
+    case SLAVE_DELAY_RC5:
+        addWordFrame(SERIAL_LASTRC5, robot.lastRC5);
+        break;
+    case SLAVE_DELAY_SHARPIR:
+        addByteFrame(SERIAL_SHARPIR, robot.sharpIR);
+        break;
+    case GROUP_STATE:
+        addByteFrame(SERIAL_STATE_SENSORS, robot.state.byte);
+        break;
+    }
+}
+
+void CRP6Generator::flushOutput(uint64_t now)
+{
+    int size = outSize;
+
+    if (baudRate)
+    {
+        // 8N1: 10 bits per byte. Don't save up more than a few ms worth.
+        byteBudget += (now - lastFlush) * (baudRate / 10.0) / 1000000.0;
+        const double maxbudget = baudRate / 10.0 / 200.0 + 16.0;
+        if (byteBudget > maxbudget)
+            byteBudget = maxbudget;
+        if (size > static_cast<int>(byteBudget))
+            size = static_cast<int>(byteBudget);
+    }
+    lastFlush = now;
+
+    if (size <= 0)
+        return;
+
+    const ssize_t written = write(master, outBuffer, size);
+    if (written <= 0)
+    {
+        if ((written == -1) && (errno != EAGAIN))
+            perror("Failed to write to pseudo terminal");
+        return;
+    }
+
+    memmove(outBuffer, outBuffer + written, outSize - written);
+    outSize -= written;
+    byteBudget -= written;
+    stats.bytesSent += written;
+}
+
+void CRP6Generator::updateRobot(uint64_t now)
+{
+    const float dt = (now - lastUpdate) / 1000000.0f;
+    lastUpdate = now;
+
+    // Speed follows destination speed, like the base's speed control
+    const int step = static_cast<int>(dt * 200.0f) + 1;
+    int *speeds[2][2] = { { &robot.speedLeft, &robot.destSpeedLeft },
+                          { &robot.speedRight, &robot.destSpeedRight } };
+    for (int i=0; i<2; ++i)
+    {
+        int &speed = *speeds[i][0];
+        const int dest = *speeds[i][1];
+        if (speed < dest)
+            speed = (speed + step > dest) ? dest : (speed + step);
+        else if (speed > dest)
+            speed = (speed - step < dest) ? dest : (speed - step);
+    }
+
+    // Speed is in encoder counts per 200 ms
+    robot.distLeft += robot.speedLeft * 5.0f * dt;
+    robot.distRight += robot.speedRight * 5.0f * dt;
+
+    const uint8_t oldstate = robot.state.byte;
+
+    if (robot.moving && (robot.distLeft >= robot.destDistLeft) &&
+        (robot.distRight >= robot.destDistRight))
+    {
+        stop();
+        robot.state.movementComplete = true;
+    }
+
+    // Some noise for the other sensors
+    if (!(rand() % 2000))
+        robot.battery = (robot.battery > 600) ? (robot.battery - 1) : 780;
+    if (!(rand() % 50))
+    {
+        robot.sharpIR += (rand() % 11) - 5;
+        robot.sharpIR = (robot.sharpIR < 20) ? 20 : (robot.sharpIR > 150) ? 150 : robot.sharpIR;
+    }
+    if (!(rand() % 5000))
+        robot.lastRC5 = rand() & 0x7FF;
+    if (robot.ACSPower != ACS_POWER_OFF)
+    {
+        robot.state.ACSLeft = (robot.sharpIR < 35);
+        robot.state.ACSRight = (robot.sharpIR < 30);
+    }
+
+    if (slaveMode && (robot.state.byte != oldstate))
+        sendGroup(GROUP_STATE);
+}
+
+void CRP6Generator::setSlaveDelay(int group, uint16_t delay)
+{
+    if ((group < 0) || (group >= SLAVE_DELAY_MAX_INDEX) || groups[group].fixed)
+        return;
+    groups[group].interval = delay;
+}
+
+void CRP6Generator::move(uint8_t speed, uint8_t dir, uint16_t dist)
+{
+    robot.dirLeft = robot.dirRight = dir;
+    robot.destSpeedLeft = robot.destSpeedRight = speed;
+    robot.destDistLeft = static_cast<uint16_t>(robot.distLeft) + dist;
+    robot.destDistRight = static_cast<uint16_t>(robot.distRight) + dist;
+    robot.moving = true;
+    robot.state.movementComplete = false;
+}
+
+void CRP6Generator::stop()
+{
+    robot.destSpeedLeft = robot.destSpeedRight = 0;
+    robot.moving = false;
+}
+
+void CRP6Generator::handleBinaryCommand(const uint8_t *frame)
+{
+    // Mirrors handleBinaryCommand() from the m32
+    const uint8_t size = frame[0], opcode = frame[1], seq = frame[2];
+    uint8_t checksum = 0;
+
+    for (int i=0; i<=size; ++i)
+        checksum ^= frame[i];
+
+    if (checksum != frame[size+1])
+    {
+        ++stats.badCommands;
+        const char *err = "Error: binary command checksum mismatch\n";
+        if ((outSize + static_cast<int>(strlen(err))) <= OUTPUT_BUFFER_SIZE)
+        {
+            memcpy(&outBuffer[outSize], err, strlen(err));
+            outSize += strlen(err);
+        }
+        return;
+    }
+
+    if (commandLoss && ((rand() % 100) < commandLoss))
+    {
+        ++stats.lostCommands; // Pretend it never arrived
+        return;
+    }
+
+    if (seq && (seq != ((lastSequence == 255) ? 1 : (lastSequence + 1))))
+    {
+        ++stats.outOfOrder;
+        addByteFrame(SERIAL_CMD_ACK, lastSequence);
+        ++stats.acksSent;
+        return;
+    }
+
+    lastSequence = seq;
+    ++stats.binaryCommands;
+
+    if ((opcode >= SERIAL_CMD_MAX_INDEX) || (commandArgSize[opcode] != (size - 2)))
+        ++stats.badCommands;
+    else
+    {
+        const uint8_t *args = &frame[3];
+        switch (opcode)
+        {
+        case SERIAL_CMD_BASE_LEDS: robot.baseLEDs = args[0]; break;
+        case SERIAL_CMD_M32_LEDS: robot.m32LEDs = args[0]; break;
+        case SERIAL_CMD_ACS_POWER: robot.ACSPower = args[0]; break;
+        case SERIAL_CMD_SPEED:
+            robot.destSpeedLeft = args[0];
+            robot.destSpeedRight = args[1];
+            robot.moving = false;
+            break;
+        case SERIAL_CMD_DIR: robot.dirLeft = robot.dirRight = args[0]; break;
+        case SERIAL_CMD_SLAVE: slaveMode = args[0]; break;
+        case SERIAL_CMD_SLAVE_DELAY: setSlaveDelay(args[0], getWordArg(&args[1])); break;
+        case SERIAL_CMD_MOVE: move(args[0], args[1], getWordArg(&args[2])); break;
+        case SERIAL_CMD_ROTATE: move(args[0], args[1], getWordArg(&args[2]) / 2); break;
+        case SERIAL_CMD_STOP: stop(); break;
+        default: break; // Power, servo and sound: nothing to simulate
+        }
+
+        if (verbose)
+            fprintf(stderr, "Binary command: opcode %d, seq %d\n", opcode, seq);
+    }
+
+    addByteFrame(SERIAL_CMD_ACK, seq);
+    ++stats.acksSent;
+}
+
+void CRP6Generator::handleTextCommand(char *line)
+{
+    ++stats.textCommands;
+    if (verbose)
+        fprintf(stderr, "Text command: %s\n", line);
+
+    if (commandLoss && ((rand() % 100) < commandLoss))
+    {
+        ++stats.lostCommands;
+        return;
+    }
+
+    char *args[5];
+    int count = 0;
+    for (char *tok = strtok(line, " "); tok && (count < 5); tok = strtok(NULL, " "))
+        args[count++] = tok;
+
+    // Only the commands that change generated data
+    if ((count == 1) && !strcmp(args[0], "stop"))
+        stop();
+    else if ((count >= 3) && !strcmp(args[0], "set") && !strcmp(args[1], "slave"))
+        slaveMode = atoi(args[2]);
+    else if ((count >= 4) && !strcmp(args[0], "set") && !strcmp(args[1], "slavedelay"))
+        setSlaveDelay(getGroup(args[2]), atoi(args[3]));
+    else if ((count >= 4) && !strcmp(args[0], "set") && !strcmp(args[1], "speed"))
+    {
+        robot.destSpeedLeft = atoi(args[2]);
+        robot.destSpeedRight = atoi(args[3]);
+        robot.moving = false;
+    }
+}
+
+void CRP6Generator::readCommands()
+{
+    uint8_t buf[256];
+    const ssize_t bytes = read(master, buf, sizeof(buf));
+    if (bytes <= 0)
+        return;
+
+    // Same parsing as checkCommands() from the m32
+    for (ssize_t i=0; i<bytes; ++i)
+    {
+        const char c = buf[i];
+
+        if (binaryCommand)
+        {
+            inBuffer[inSize++] = c;
+            const uint8_t size = inBuffer[0];
+            if ((inSize == 1) && (!size || (size > SERIAL_CMD_MAX_SIZE)))
+            {
+                ++stats.badCommands;
+                binaryCommand = false;
+                inSize = 0;
+            }
+            else if ((inSize > 1) && (inSize == (size + 2)))
+            {
+                handleBinaryCommand(reinterpret_cast<const uint8_t *>(inBuffer));
+                binaryCommand = false;
+                inSize = 0;
+            }
+        }
+        else if ((inSize == 0) && (c == SERIAL_MSG_START))
+            binaryCommand = true;
+        else if ((c == '\n') || (c == '\r'))
+        {
+            if (inSize)
+            {
+                inBuffer[inSize] = 0;
+                handleTextCommand(inBuffer);
+                inSize = 0;
+            }
+        }
+        else if (inSize < (INPUT_BUFFER_SIZE - 1))
+            inBuffer[inSize++] = c;
+    }
+}
+
+void CRP6Generator::printStats(uint64_t now)
+{
+    const double secs = (now - lastStats) / 1000000.0;
+    const SStats &o = lastStatsSnapshot;
+
+    fprintf(stderr, "%.0f frames/s, %.0f bytes/s, %llu dropped, cmds: %u text %u binary "
+            "%u bad %u lost, acks: %u (%u out of order)\n",
+            (stats.framesSent - o.framesSent) / secs, (stats.bytesSent - o.bytesSent) / secs,
+            static_cast<unsigned long long>(stats.framesDropped - o.framesDropped),
+            stats.textCommands - o.textCommands, stats.binaryCommands - o.binaryCommands,
+            stats.badCommands - o.badCommands, stats.lostCommands - o.lostCommands,
+            stats.acksSent - o.acksSent, stats.outOfOrder - o.outOfOrder);
+
+    lastStatsSnapshot = stats;
+    lastStats = now;
+}
+
+void CRP6Generator::run(int duration)
+{
+    const uint64_t start = getTimeUS();
+    lastUpdate = lastStats = lastFlush = start;
+    for (int i=0; i<GROUP_MAX_INDEX; ++i)
+        groups[i].next = start;
+
+    while (!duration || ((getTimeUS() - start) < (duration * 1000000ull)))
+    {
+        uint64_t now = getTimeUS();
+
+        updateRobot(now);
+
+        uint64_t nextdue = now + 10000; // Update the robot at least every 10 ms
+        if (slaveMode)
+        {
+            for (int i=0; i<GROUP_MAX_INDEX; ++i)
+            {
+                SGroup &g = groups[i];
+                if (g.interval <= 0)
+                    continue;
+
+                const uint64_t interval = static_cast<uint64_t>(g.interval * 1000 / rateScale);
+                if (now >= g.next)
+                {
+                    sendGroup(i);
+                    g.next += (interval) ? interval : 1;
+                    if (g.next < now) // Way behind, don't try to catch up
+                        g.next = now + interval;
+                }
+
+                if (g.next < nextdue)
+                    nextdue = g.next;
+            }
+        }
+
+        flushOutput(now);
+
+        // Wake up for pending output when the baud rate is limited
+        if (outSize && baudRate)
+        {
+            const uint64_t t = now + (10000000ull / baudRate) * outSize;
+            if (t < nextdue)
+                nextdue = t;
+        }
+
+        now = getTimeUS();
+        if (now >= (lastStats + 1000000))
+            printStats(now);
+
+        pollfd pfd;
+        pfd.fd = master;
+        pfd.events = POLLIN;
+        if (outSize && !baudRate)
+            pfd.events |= POLLOUT;
+        pfd.revents = 0;
+
+        timespec timeout;
+        const uint64_t wait = (nextdue > now) ? (nextdue - now) : 0;
+        timeout.tv_sec = wait / 1000000;
+        timeout.tv_nsec = (wait % 1000000) * 1000;
+
+        if ((ppoll(&pfd, 1, &timeout, NULL) > 0) && (pfd.revents & POLLIN))
+            readCommands();
+    }
+}
@@ -0,0 +1,119 @@
+#ifndef GENERATOR_H
+#define GENERATOR_H
+
+#include <stdint.h>
+
+#include <string>
+
+#include "shared.h"
+
+// Pretends to be an RP6 with m32 in slave mode on the master side of a
+// pseudo terminal: sends robot data frames (ESerialMessage) at configurable
+// rates and parses/acknowledges commands, both text and binary. Point the
+// server at the slave side (or the link created for it) to test and profile
+// it without hardware.
+class CRP6Generator
+{
+public:
+    // Update groups: one per slave delay, plus the state sensors, which the
+    // m32 sends when they change.
+    enum { GROUP_STATE = SLAVE_DELAY_MAX_INDEX, GROUP_MAX_INDEX };
+
+    struct SStats
+    {
+        uint64_t bytesSent, framesSent, framesDropped;
+        uint32_t textCommands, binaryCommands, badCommands, lostCommands;
+        uint32_t acksSent, outOfOrder;
+        SStats(void) : bytesSent(0), framesSent(0), framesDropped(0), textCommands(0),
+                       binaryCommands(0), badCommands(0), lostCommands(0), acksSent(0),
+                       outOfOrder(0) { }
+    };
+
+private:
+    enum { OUTPUT_BUFFER_SIZE = 4096, INPUT_BUFFER_SIZE = 256 };
+
+    struct SGroup
+    {
+        int interval; // ms, 0 == disabled
+        bool fixed; // Set from the command line, ignore slave delay commands
+        uint64_t next; // usec
+    };
+
+    // Simulated robot, kept as simple as possible: just enough to produce
+    // plausible data that reacts to commands.
+    struct SRobot
+    {
+        uint8_t baseLEDs, m32LEDs;
+        int speedLeft, speedRight, destSpeedLeft, destSpeedRight;
+        uint8_t dirLeft, dirRight;
+        float distLeft, distRight;
+        uint16_t destDistLeft, destDistRight;
+        uint16_t battery;
+        uint8_t ACSPower;
+        uint16_t lastRC5;
+        int sharpIR;
+        SStateSensors state;
+        bool moving; // Moving to destDist
+        SRobot(void);
+    };
+
+    int master, slave;
+    std::string linkName;
+    SGroup groups[GROUP_MAX_INDEX];
+    float rateScale;
+    uint32_t baudRate; // 0 == unlimited
+    int commandLoss; // Percentage of commands to ignore
+    bool slaveMode;
+    SRobot robot;
+    uint8_t lastSequence;
+    uint64_t lastUpdate, lastStats, lastFlush; // usec
+    double byteBudget;
+    SStats stats, lastStatsSnapshot;
+    bool verbose;
+
+    char outBuffer[OUTPUT_BUFFER_SIZE];
+    int outSize;
+    char inBuffer[INPUT_BUFFER_SIZE];
+    int inSize;
+    bool binaryCommand; // Parsing a binary command
+
+    static uint64_t getTimeUS(void);
+    void addFrame(ESerialMessage msg, const uint8_t *data, int size);
+    void addByteFrame(ESerialMessage msg, uint8_t data);
+    void addWordFrame(ESerialMessage msg, uint16_t data);
+    void sendGroup(int group);
+    void flushOutput(uint64_t now);
+    void updateRobot(uint64_t now);
+    void setSlaveDelay(int group, uint16_t delay);
+    void move(uint8_t speed, uint8_t dir, uint16_t dist);
+    void stop(void);
+    void handleBinaryCommand(const uint8_t *frame);
+    void handleTextCommand(char *line);
+    void readCommands(void);
+    void printStats(uint64_t now);
+
+public:
+    CRP6Generator(void);
+    ~CRP6Generator(void);
+
+    static int getGroup(const char *name);
+    static const char *getGroupName(int group);
+
+    bool open(const std::string &link);
+    const char *getSlaveName(void) const;
+
+    // Update interval for a group, overrides slave delay commands
+    void setInterval(int group, int ms) { groups[group].interval = ms; groups[group].fixed = true; }
+    // Multiplies all update rates
+    void setRateScale(float s) { rateScale = s; }
+    void setBaudRate(uint32_t b) { baudRate = b; }
+    void setCommandLoss(int l) { commandLoss = l; }
+    void setVerbose(bool v) { verbose = v; }
+
+    // Runs until duration (seconds) passed, forever if 0
+    void run(int duration);
+
+    const SStats &getStats(void) const { return stats; }
+};
+
+#endif
@@ -0,0 +1,96 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "generator.h"
+
+namespace {
+
+CRP6Generator *generator = NULL;
+
+void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+            "Emulates an RP6 (with m32 in slave mode) on a pseudo terminal.\n"
+            "  -l <link>        Create a symlink to the pseudo terminal (e.g. /tmp/rp6)\n"
+            "  -r <group>=<ms>  Fixed update interval, ignores slave delay commands.\n"
+            "                   Groups: led, light, motor, battery, acs, mic, rc5,\n"
+            "                   sharpir, state. Can be given multiple times.\n"
+            "  -s <factor>      Multiply all update rates\n"
+            "  -b <baud>        Emulated baud rate, 0 for unlimited (default 38400)\n"
+            "  -x <percent>     Ignore a percentage of received commands\n"
+            "  -t <secs>        Stop after this time\n"
+            "  -v               Print received commands\n", name);
+}
+
+void quit(int)
+{
+    // Removes the link
+    delete generator;
+    _exit(0);
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    generator = new CRP6Generator;
+    std::string link;
+    int duration = 0, opt;
+
+    while ((opt = getopt(argc, argv, "l:r:s:b:x:t:vh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'l':
+            link = optarg;
+            break;
+        case 'r':
+        {
+            char *eq = strchr(optarg, '=');
+            const int group = (eq) ? (*eq = 0, CRP6Generator::getGroup(optarg)) : -1;
+            if (group == -1)
+            {
+                fprintf(stderr, "Invalid rate: %s\n", optarg);
+                return 1;
+            }
+            generator->setInterval(group, atoi(eq + 1));
+            break;
+        }
+        case 's':
+            generator->setRateScale(atof(optarg));
+            break;
+        case 'b':
+            generator->setBaudRate(atoi(optarg));
+            break;
+        case 'x':
+            generator->setCommandLoss(atoi(optarg));
+            break;
+        case 't':
+            duration = atoi(optarg);
+            break;
+        case 'v':
+            generator->setVerbose(true);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!generator->open(link))
+        return 1;
+
+    signal(SIGINT, quit);
+    signal(SIGTERM, quit);
+
+    fprintf(stderr, "Emulating RP6 on %s\n", (link.empty()) ? generator->getSlaveName() : link.c_str());
+    generator->run(duration);
+
+    delete generator;
+    return 0;
+}
@@ -0,0 +1,11 @@
+TEMPLATE = app
+TARGET = rp6gen
+CONFIG += console
+CONFIG -= qt
+HEADERS += generator.h \
+    shared.h
+SOURCES += generator.cpp \
+    main.cpp
+INCLUDEPATH += ../../shared
+DEPENDPATH += ../../shared
+OBJECTS_DIR = obj
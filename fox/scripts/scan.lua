@@ -30,21 +30,15 @@ function run()
     local prevhit
 	for servopos = 0, 180, 10 do
 		robot.setservo(servopos)
-		local wait = gettimems() + 500
-		while wait > gettimems() do
-		    coroutine.yield()
-		end
+		sleep(500)
 		
 		local stime = gettimems() + 1000
 		local scandata = { }
 		while stime > gettimems() do
-			if wait < gettimems() then
-				wait = gettimems() + 50
-				local angle = robot.servoangle(servopos)
-				scandata[angle] = scandata[angle] or { }
-				table.insert(scandata[angle], robot.sensors.sharpir())
-			end
-			coroutine.yield()
+			local angle = robot.servoangle(servopos)
+			scandata[angle] = scandata[angle] or { }
+			table.insert(scandata[angle], robot.sensors.sharpir())
+			sleep(50)
 		end
 		
         -- NOTE: not ipairs because scanarray indices have 'gaps' or equal 0 and are
@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <QtCore>
+
+#include "logger.h"
+
+CLogger *CLogger::instance = NULL;
+
+CLogger::CLogger(QObject *parent, const QString &file, qint64 maxsize, int backups)
+    : QThread(parent), queue(QUEUE_SIZE), queueStart(0), queueCount(0), droppedMsgs(0),
+      totalDroppedMsgs(0), quit(false), flushRequested(false), logFile(file),
+      maxFileSize(maxsize), maxBackups(backups), defaultLevel(typeLevel(QtDebugMsg))
+{
+    openLogFile();
+}
+
+CLogger::~CLogger()
+{
+    uninstall();
+
+    mutex.lock();
+    quit = true;
+    queueCondition.wakeOne();
+    mutex.unlock();
+
+    wait();
+    flush(); // Write anything left if the thread was never started
+}
+
+int CLogger::typeLevel(QtMsgType type)
+{
+    switch (type)
+    {
+    case QtDebugMsg: return 0;
+    case QtWarningMsg: return 1;
+    case QtCriticalMsg: return 2;
+    case QtFatalMsg: return 3;
+    }
+    return 0;
+}
+
+QByteArray CLogger::getCategory(const char *msg)
+{
+    if (msg[0] != '[')
+        return QByteArray();
+
+    const char *end = strchr(msg, ']');
+    if (!end || ((end - msg) > 16))
+        return QByteArray();
+
+    return QByteArray(msg + 1, end - msg - 1);
+}
+
+void CLogger::msgHandler(QtMsgType type, const char *msg)
+{
+    instance->enqueue(type, msg);
+
+    if (type == QtFatalMsg)
+    {
+        instance->flush();
+        abort();
+    }
+}
+
+bool CLogger::openLogFile()
+{
+    if (!logFile.open(QFile::WriteOnly | QFile::Append))
+    {
+        fprintf(stderr, "Failed to open log file %s\n", qPrintable(logFile.fileName()));
+        return false;
+    }
+    return true;
+}
+
+void CLogger::rotate()
+{
+    const QString name(logFile.fileName());
+
+    logFile.close();
+
+    QFile::remove(QString("%1.%2").arg(name).arg(maxBackups));
+    for (int i=maxBackups-1; i>0; --i)
+        QFile::rename(QString("%1.%2").arg(name).arg(i), QString("%1.%2").arg(name).arg(i+1));
+
+    if (maxBackups > 0)
+        QFile::rename(name, name + ".1");
+    else
+        QFile::remove(name);
+
+    openLogFile();
+}
+
+void CLogger::writeEntry(const SEntry &entry)
+{
+    const char *typestr = "";
+    switch (entry.type)
+    {
+    case QtDebugMsg: typestr = " - [Debug]: "; break;
+    case QtWarningMsg: typestr = " - [Warning]: "; break;
+    case QtCriticalMsg: typestr = " - [Critical]: "; break;
+    case QtFatalMsg: typestr = " - [Fatal]: "; break;
+    }
+
+    logFile.write(entry.time.toString().toLatin1());
+    logFile.write(typestr);
+    logFile.write(entry.msg);
+    logFile.write("\n", 1);
+}
+
+void CLogger::enqueue(QtMsgType type, const char *msg)
+{
+    if (type != QtFatalMsg)
+    {
+        const QByteArray cat(getCategory(msg));
+        const int level = (!cat.isEmpty() && categoryLevels.contains(cat)) ?
+                    categoryLevels[cat] : defaultLevel;
+        if (typeLevel(type) < level)
+            return;
+    }
+
+    QMutexLocker lock(&mutex);
+
+    if (queueCount == QUEUE_SIZE)
+    {
+        ++droppedMsgs;
+        ++totalDroppedMsgs;
+        return;
+    }
+
+    SEntry &entry = queue[(queueStart + queueCount) % QUEUE_SIZE];
+    const int len = strlen(msg);
+    entry.type = type;
+    entry.time = QDateTime::currentDateTime();
+    entry.msg.resize(len); // Keeps previous allocation when possible
+    memcpy(entry.msg.data(), msg, len);
+    ++queueCount;
+
+    queueCondition.wakeOne();
+}
+
+void CLogger::flush()
+{
+    QMutexLocker lock(&mutex);
+
+    if (isRunning())
+    {
+        flushRequested = true;
+        queueCondition.wakeOne();
+        while (flushRequested && isRunning())
+            flushedCondition.wait(&mutex, FLUSH_INTERVAL);
+        return;
+    }
+
+    // No writer thread (yet): write from the calling thread
+    for (; queueCount; --queueCount, queueStart = (queueStart + 1) % QUEUE_SIZE)
+        writeEntry(queue[queueStart]);
+    logFile.flush();
+}
+
+void CLogger::run()
+{
+    // Messages are swapped in and out of this batch, so buffers are
+    // recycled between the queue and the writer.
+    QVector<SEntry> batch(QUEUE_SIZE);
+
+    forever
+    {
+        int count;
+        uint32_t dropped, totaldropped;
+        bool flushing;
+
+        mutex.lock();
+
+        if (!queueCount && !quit && !flushRequested)
+            queueCondition.wait(&mutex, FLUSH_INTERVAL);
+
+        count = queueCount;
+        for (int i=0; i<count; ++i)
+        {
+            SEntry &entry = queue[(queueStart + i) % QUEUE_SIZE];
+            batch[i].type = entry.type;
+            batch[i].time = entry.time;
+            qSwap(batch[i].msg, entry.msg);
+        }
+        queueStart = (queueStart + count) % QUEUE_SIZE;
+        queueCount = 0;
+
+        dropped = droppedMsgs;
+        droppedMsgs = 0;
+        totaldropped = totalDroppedMsgs;
+        flushing = flushRequested;
+        const bool done = quit;
+
+        mutex.unlock();
+
+        if (dropped)
+        {
+            SEntry entry;
+            entry.type = QtWarningMsg;
+            entry.time = QDateTime::currentDateTime();
+            entry.msg = QString("Log queue full, dropped %1 message(s) (%2 total)")
+                    .arg(dropped).arg(totaldropped).toLatin1();
+            writeEntry(entry);
+        }
+
+        for (int i=0; i<count; ++i)
+            writeEntry(batch[i]);
+
+        if (count || dropped)
+        {
+            logFile.flush();
+            if (logFile.size() > maxFileSize)
+                rotate();
+        }
+
+        if (flushing)
+        {
+            mutex.lock();
+            flushRequested = false;
+            flushedCondition.wakeAll();
+            mutex.unlock();
+        }
+
+        if (done)
+            break;
+    }
+}
+
+bool CLogger::setLevel(const QByteArray &category, const QByteArray &level)
+{
+    int l;
+    if (level == "debug")
+        l = typeLevel(QtDebugMsg);
+    else if (level == "warning")
+        l = typeLevel(QtWarningMsg);
+    else if (level == "critical")
+        l = typeLevel(QtCriticalMsg);
+    else if (level == "fatal")
+        l = typeLevel(QtFatalMsg);
+    else
+        return false;
+
+    if (category.isEmpty())
+        defaultLevel = l;
+    else
+        categoryLevels[category] = l;
+
+    return true;
+}
+
+void CLogger::parseLevels(const QString &levels)
+{
+    foreach(QString l, levels.split(",", QString::SkipEmptyParts))
+    {
+        QStringList catlevel(l.split("="));
+        bool ok;
+
+        if (catlevel.size() == 1)
+            ok = setLevel(QByteArray(), catlevel[0].trimmed().toLatin1());
+        else
+            ok = setLevel(catlevel[0].trimmed().toLatin1(), catlevel[1].trimmed().toLatin1());
+
+        if (!ok)
+            qWarning() << "Invalid log level:" << l;
+    }
+}
+
+void CLogger::install()
+{
+    instance = this;
+    qInstallMsgHandler(msgHandler);
+}
+
+void CLogger::uninstall()
+{
+    if (instance == this)
+    {
+        qInstallMsgHandler(0);
+        instance = NULL;
+    }
+}
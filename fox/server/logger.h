@@ -0,0 +1,77 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+
+#include <QDateTime>
+#include <QFile>
+#include <QMap>
+#include <QMutex>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+// Buffered log writer used when the server runs as a daemon.
+// Messages are queued by the Qt message handler and written to disk by a
+// background thread, so logging never blocks the event loop on file I/O.
+// A message may start with a category tag (e.g. "[tcp] ..."), which is used
+// to filter messages per category before they are queued.
+class CLogger: public QThread
+{
+    struct SEntry
+    {
+        QtMsgType type;
+        QDateTime time;
+        QByteArray msg;
+    };
+
+    enum { QUEUE_SIZE = 1024, FLUSH_INTERVAL = 1000 };
+
+    // Ring buffer: all entries are allocated once
+    QVector<SEntry> queue;
+    int queueStart, queueCount;
+    uint32_t droppedMsgs, totalDroppedMsgs;
+    bool quit;
+    QMutex mutex;
+    QWaitCondition queueCondition, flushedCondition;
+    bool flushRequested;
+
+    QFile logFile;
+    qint64 maxFileSize;
+    int maxBackups;
+
+    int defaultLevel;
+    QMap<QByteArray, int> categoryLevels;
+
+    static CLogger *instance;
+
+    static int typeLevel(QtMsgType type);
+    static QByteArray getCategory(const char *msg);
+    static void msgHandler(QtMsgType type, const char *msg);
+
+    bool openLogFile(void);
+    void rotate(void);
+    void writeEntry(const SEntry &entry);
+    void enqueue(QtMsgType type, const char *msg);
+    void flush(void);
+
+protected:
+    virtual void run(void);
+
+public:
+    CLogger(QObject *parent, const QString &file, qint64 maxsize=1024*1024,
+            int backups=3);
+    ~CLogger(void);
+
+    // Levels: "debug", "warning", "critical", "fatal". An empty category
+    // sets the level for untagged messages and unknown categories.
+    bool setLevel(const QByteArray &category, const QByteArray &level);
+    void parseLevels(const QString &levels); // e.g. "warning,tcp=debug"
+
+    void install(void);
+    void uninstall(void);
+
+    uint32_t getDroppedMsgs(void) const { return totalDroppedMsgs; }
+};
+
+#endif
@@ -3,10 +3,11 @@
 #include <QCoreApplication>
 #include <QDebug>
 #include <QStringList>
-#include <QTimer>
-#include <QVariant>
 
 #include "lua.h"
+#include "luamsg.h"
+#include "luaalloc.h"
+#include "luascheduler.h"
 
 namespace {
 
@@ -32,38 +33,112 @@ void luaError(lua_State *l, bool fatal)
         qFatal("Lua error: %s\n", errmsg);
 }
 
+int luaPanic(lua_State *l)
+{
+    qFatal("Unprotected Lua error: %s\n", lua_tostring(l, -1));
+    return 0;
 }
 
-namespace NLua {
+enum { MAX_ENCODE_DEPTH = 32 };
+
+bool isLuaArray(lua_State *l, int index, int &count)
+{
+    const size_t len = lua_objlen(l, index);
+    bool array = true;
+    count = 0;
 
-CLuaInterface luaInterface;
+    lua_pushnil(l);
+    while (lua_next(l, index))
+    {
+        if (array)
+        {
+            // Only keys 1..len, counting them tells whether all are there
+            const lua_Number key = lua_tonumber(l, -2);
+            array = (lua_type(l, -2) == LUA_TNUMBER) && (key >= 1) && (key <= len) &&
+                    (key == static_cast<size_t>(key));
+        }
+        ++count;
+        lua_pop(l, 1);
+    }
 
+    return array && (static_cast<size_t>(count) == len);
+}
 
-void CLuaThinker::timeOut()
+void encodeValue(lua_State *l, int index, CLuaMsgEncoder &encoder, int depth)
 {
-    lua_getglobal(luaState, "think");
-    if (lua_pcall(luaState, 0, 0, 0))
+    size_t len;
+    const char *s;
+
+    switch (lua_type(l, index))
+    {
+    case LUA_TNIL: encoder.writeNil(); break;
+    case LUA_TBOOLEAN: encoder.writeBool(lua_toboolean(l, index)); break;
+    case LUA_TNUMBER: encoder.writeNumber(lua_tonumber(l, index)); break;
+    case LUA_TSTRING:
+        s = lua_tolstring(l, index, &len);
+        encoder.writeString(s, len);
+        break;
+    case LUA_TTABLE:
     {
-        luaError(luaState, false);
-        execScriptCmd("abortcurrentscript");
+        if (depth >= MAX_ENCODE_DEPTH)
+            luaL_error(l, "Table nested too deep (recursive?)");
+        luaL_checkstack(l, 3, "Table nested too deep");
+
+        int count;
+        if (isLuaArray(l, index, count))
+        {
+            encoder.writeArray(count);
+            for (int i=1; i<=count; ++i)
+            {
+                lua_rawgeti(l, index, i);
+                encodeValue(l, lua_gettop(l), encoder, depth + 1);
+                lua_pop(l, 1);
+            }
+        }
+        else
+        {
+            encoder.writeMap(count);
+            lua_pushnil(l);
+            while (lua_next(l, index))
+            {
+                const int key = lua_gettop(l) - 1;
+                if (lua_type(l, key) == LUA_TSTRING)
+                {
+                    // Lua strings are interned, so the pointer identifies the key
+                    s = lua_tolstring(l, key, &len);
+                    encoder.writeKey(s, s, len);
+                }
+                else
+                    encodeValue(l, key, encoder, depth + 1);
+
+                encodeValue(l, key + 1, encoder, depth + 1);
+                lua_pop(l, 1);
+            }
+        }
+        break;
+    }
+    default:
+        qWarning() << "Cannot send values of type" << luaL_typename(l, index) <<
+                ", sending nil instead";
+        encoder.writeNil();
+        break;
     }
 }
 
-void CLuaThinker::start()
-{
-    QTimer *timer = new QTimer(this);
-    connect(timer, SIGNAL(timeout()), this, SLOT(timeOut()));
-    timer->start(5);
 }
 
+namespace NLua {
 
-CLuaInterface::CLuaInterface()
+CLuaInterface::CLuaInterface(size_t memlimit)
 {
     // Initialize lua
-    luaState = lua_open();
+    allocator = new CLuaAllocator(memlimit);
+    luaState = lua_newstate(CLuaAllocator::alloc, allocator);
     
     if (!luaState)
         qFatal("Could not open lua VM\n");
+
+    lua_atpanic(luaState, luaPanic);
     
     const luaL_Reg *lib = libTable;
     for (; lib->func; lib++)
@@ -74,11 +149,16 @@ CLuaInterface::CLuaInterface()
         lua_settop(luaState, 0);  // Clear stack
     }
 
-    luaThinker = new CLuaThinker(luaState);
+    allocator->registerBindings(luaState);
+
+    scheduler = new CLuaScheduler(luaState, allocator);
+    scheduler->registerBindings();
 }
 
 CLuaInterface::~CLuaInterface()
 {   
+    delete scheduler;
+
     if (luaState)
     {
         // Debug
@@ -89,15 +169,13 @@ CLuaInterface::~CLuaInterface()
         luaState = NULL;
     }
 
-    delete luaThinker;
+    delete allocator;
 }
 
 void CLuaInterface::exec()
 {
-    if (luaL_dofile(luaState, "main.lua"))
+    if (luaL_loadfile(luaState, "main.lua") || callProtected(luaState, 0, 0))
         luaError(luaState, true);
-
-    luaThinker->start();
 }
 
 
@@ -144,58 +222,59 @@ void getClassMT(lua_State *l, const char *type)
     // MT left on stack
 }
 
-void registerFunction(lua_CFunction func, const char *name, void *d)
+void registerFunction(lua_State *l, lua_CFunction func, const char *name, void *d)
 {
     if (d)
     {
-        lua_pushlightuserdata(luaInterface, d);
-        lua_pushcclosure(luaInterface, func, 1);
+        lua_pushlightuserdata(l, d);
+        lua_pushcclosure(l, func, 1);
     }
     else
-        lua_pushcfunction(luaInterface, func);
-    lua_setglobal(luaInterface, name);
+        lua_pushcfunction(l, func);
+    lua_setglobal(l, name);
 }
 
-void registerFunction(lua_CFunction func, const char *name, const char *tab, void *d)
+void registerFunction(lua_State *l, lua_CFunction func, const char *name, const char *tab,
+                      void *d)
 {
-    lua_getglobal(luaInterface, tab);
+    lua_getglobal(l, tab);
 
-    if (lua_isnil(luaInterface, -1))
+    if (lua_isnil(l, -1))
     {
-        lua_pop(luaInterface, 1);
-        lua_newtable(luaInterface);
+        lua_pop(l, 1);
+        lua_newtable(l);
     }
 
     if (d)
     {
-        lua_pushlightuserdata(luaInterface, d);
-        lua_pushcclosure(luaInterface, func, 1);
+        lua_pushlightuserdata(l, d);
+        lua_pushcclosure(l, func, 1);
     }
     else
-        lua_pushcfunction(luaInterface, func);
+        lua_pushcfunction(l, func);
 
-    lua_setfield(luaInterface, -2, name);
-    lua_setglobal(luaInterface, tab);
+    lua_setfield(l, -2, name);
+    lua_setglobal(l, tab);
 }
 
-void registerClassFunction(lua_CFunction func, const char *name,
+void registerClassFunction(lua_State *l, lua_CFunction func, const char *name,
                            const char *type, void *d)
 {
-    getClassMT(type);
-    const int mt = lua_gettop(luaInterface);
+    getClassMT(l, type);
+    const int mt = lua_gettop(l);
 
-    lua_pushstring(luaInterface, name);
+    lua_pushstring(l, name);
 
     if (d)
     {
-        lua_pushlightuserdata(luaInterface, d);
-        lua_pushcclosure(luaInterface, func, 1);
+        lua_pushlightuserdata(l, d);
+        lua_pushcclosure(l, func, 1);
     }
     else
-        lua_pushcfunction(luaInterface, func);
+        lua_pushcfunction(l, func);
 
-    lua_settable(luaInterface, mt);
-    lua_remove(luaInterface, mt);
+    lua_settable(l, mt);
+    lua_remove(l, mt);
 }
 
 void createClass(lua_State *l, void *data, const char *type, lua_CFunction destr)
@@ -222,64 +301,68 @@ void createClass(lua_State *l, void *data, const char *type, lua_CFunction destr
     // New userdata is left on stack
 }
 
-void runScript(const QByteArray &s)
+void runScript(lua_State *l, const QByteArray &s, const QString &name, int priority)
 {
-    lua_getglobal(luaInterface, "runscript");
-    lua_pushstring(luaInterface, s.constData());
+    lua_getglobal(l, "runscript");
+    lua_pushlstring(l, s.constData(), s.size()); // May be bytecode
+
+    if (name.isEmpty())
+        lua_pushnil(l);
+    else
+        lua_pushstring(l, name.toLatin1().data());
+
+    if (priority > 0)
+        lua_pushinteger(l, priority);
+    else
+        lua_pushnil(l);
 
-    if (lua_pcall(luaInterface, 1, 0, 0))
-        luaError(luaInterface, false);
+    if (callProtected(l, 3, 0))
+        luaError(l, false);
 }
 
-void execScriptCmd(const QString &cmd, const QStringList &args)
+void execScriptCmd(lua_State *l, const QString &cmd, const QStringList &args,
+                   const QString &script)
 {
-    lua_getglobal(luaInterface, "execcmd");
-    lua_pushstring(luaInterface, cmd.toLatin1().data());
+    lua_getglobal(l, "execcmd");
+
+    if (script.isEmpty())
+        lua_pushnil(l);
+    else
+        lua_pushstring(l, script.toLatin1().data());
+
+    lua_pushstring(l, cmd.toLatin1().data());
     foreach(QString a, args)
     {
-        lua_pushstring(luaInterface, a.toLatin1().data());
+        lua_pushstring(l, a.toLatin1().data());
     }
 
-    if (lua_pcall(luaInterface, 1 + args.size(), 0, 0))
-        luaError(luaInterface, false);
+    if (callProtected(l, 2 + args.size(), 0))
+        luaError(l, false);
 }
 
-void scriptInitClient()
+void scriptInitClient(lua_State *l)
 {
-    lua_getglobal(luaInterface, "initclient");
-    if (lua_pcall(luaInterface, 0, 0, 0))
-        luaError(luaInterface, false);
+    lua_getglobal(l, "initclient");
+    if (callProtected(l, 0, 0))
+        luaError(l, false);
 }
 
-QMap<QString, QVariant> convertLuaTable(lua_State *l, int index)
+int callProtected(lua_State *l, int nargs, int nresults)
 {
-    QMap<QString, QVariant> ret;
-    const int tabind = luaAbsIndex(l, index);
-
-    stackDump(l);
-
-    lua_pushnil(l);
-    while (lua_next(l, tabind))
-    {
-        QVariant v;
-        switch (lua_type(l, -1))
-        {
-        case LUA_TBOOLEAN: v.setValue(static_cast<bool>(lua_toboolean(l, -1))); break;
-        case LUA_TNUMBER: v.setValue(static_cast<float>(lua_tonumber(l, -1))); break;
-        default:
-        case LUA_TSTRING: v.setValue(QString(lua_tostring(l, -1))); break;
-        case LUA_TTABLE: v.setValue(convertLuaTable(l, -1)); break;
-        }
-
-        // According to manual we cannot use tostring directly on keys.
-        // Therefore duplicate the key first
-        lua_pushvalue(l, -2);
-        ret[lua_tostring(l, -1)] = v;
-
-        lua_pop(l, 2); // Remove duplicate key and value, keep original key
-    }
-
+    void *ud;
+    lua_getallocf(l, &ud);
+    CLuaAllocator *allocator = static_cast<CLuaAllocator *>(ud);
+
+    const bool waslimited = allocator->isLimited();
+    allocator->setLimited(true);
+    const int ret = lua_pcall(l, nargs, nresults, 0);
+    allocator->setLimited(waslimited);
     return ret;
 }
 
+void encodeLuaValue(lua_State *l, int index, CLuaMsgEncoder &encoder)
+{
+    encodeValue(l, luaAbsIndex(l, index), encoder, 0);
+}
+
 }
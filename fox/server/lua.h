@@ -2,57 +2,57 @@
 #define LUA_H
 
 #include <QByteArray>
-#include <QMap>
-#include <QObject>
 #include <QString>
 #include <QStringList>
 
 #include <lua.hpp>
 
-namespace NLua
-{
+class CLuaMsgEncoder;
 
-class CLuaThinker: public QObject
+namespace NLua
 {
-    Q_OBJECT
-
-    lua_State *luaState;
 
-private slots:
-    void timeOut(void);
-
-public:
-    CLuaThinker(lua_State *l) : luaState(l) { }
-    void start(void);
-};
+class CLuaAllocator;
+class CLuaScheduler;
 
+// Every robot has its own interface, which may only be used from the thread
+// that created it.
 class CLuaInterface
 {
     lua_State *luaState;
-    CLuaThinker *luaThinker;
+    CLuaAllocator *allocator;
+    CLuaScheduler *scheduler;
 
 public:
-    CLuaInterface(void);
+    // memlimit: bytes Lua may allocate, 0 for no limit
+    CLuaInterface(size_t memlimit=0);
     ~CLuaInterface(void);
 
     void exec(void);
 
+    CLuaAllocator *getAllocator(void) { return allocator; }
+    CLuaScheduler *getScheduler(void) { return scheduler; }
+
     operator lua_State*(void) { return luaState; }
 };
 
-extern CLuaInterface luaInterface;
-
 void stackDump(lua_State *l);
 void getClassMT(lua_State *l, const char *type);
-inline void getClassMT(const char *type) { getClassMT(luaInterface, type); }
-void registerFunction(lua_CFunction func, const char *name, void *d=NULL);
-void registerFunction(lua_CFunction func, const char *name, const char *tab, void *d=NULL);
-void registerClassFunction(lua_CFunction func, const char *name, const char *type,
-                           void *d=NULL);
+void registerFunction(lua_State *l, lua_CFunction func, const char *name, void *d=NULL);
+void registerFunction(lua_State *l, lua_CFunction func, const char *name, const char *tab,
+                      void *d=NULL);
+void registerClassFunction(lua_State *l, lua_CFunction func, const char *name,
+                           const char *type, void *d=NULL);
 void createClass(lua_State *l, void *data, const char *type, lua_CFunction destr = NULL);
-void runScript(const QByteArray &s);
-void execScriptCmd(const QString &cmd, const QStringList &args=QStringList());
-void scriptInitClient(void);
+// name: empty for the main script, priority: 0 for the default
+void runScript(lua_State *l, const QByteArray &s, const QString &name=QString(),
+               int priority=0);
+// script: name of the script receiving the command, empty for the main script
+void execScriptCmd(lua_State *l, const QString &cmd, const QStringList &args=QStringList(),
+                   const QString &script=QString());
+void scriptInitClient(lua_State *l);
+// lua_pcall() with the memory limits of the allocator enforced
+int callProtected(lua_State *l, int nargs, int nresults);
 
 inline int luaAbsIndex(lua_State *l, int i)
 { return ((i < 0) && (i > LUA_REGISTRYINDEX)) ? (lua_gettop(l)+1)+i : i; }
@@ -63,7 +63,9 @@ template <typename C> C *checkClassData(lua_State *l, int index, const char *typ
     return static_cast <C*>(*p);
 }
 
-QMap<QString, QVariant> convertLuaTable(lua_State *l, int index);
+// Tables without keys other than 1..n are written as arrays (so are empty
+// tables), others as maps. Types that can't be sent are written as nil.
+void encodeLuaValue(lua_State *l, int index, CLuaMsgEncoder &encoder);
 
 }
 
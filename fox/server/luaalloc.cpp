@@ -0,0 +1,253 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+#include "luaalloc.h"
+#include "timeutil.h"
+
+namespace NLua {
+
+CLuaAllocator::CLuaAllocator(size_t limit)
+    : currentAccount(MAIN_ACCOUNT), limited(false), currentBytes(0), peakBytes(0),
+      totalLimit(limit), reservedBytes(0), allocatedBytes(0), allocations(0),
+      failedAllocations(0), rateTime(getTimeMS()), rateAllocations(0), allocationsPerSec(0)
+{
+    memset(freeLists, 0, sizeof(freeLists));
+    accounts.resize(1);
+    accounts[MAIN_ACCOUNT].open = true;
+}
+
+CLuaAllocator::~CLuaAllocator()
+{
+    foreach(char *c, chunks)
+    {
+        free(c);
+    }
+}
+
+int CLuaAllocator::getPool(size_t size)
+{
+    int pool = 0;
+    for (size_t s=MIN_BLOCK_SIZE; s<size; s<<=1)
+        ++pool;
+    return pool;
+}
+
+void *CLuaAllocator::allocBlock(size_t size)
+{
+    if (size > MAX_POOLED_SIZE)
+        return malloc(size);
+
+    const int pool = getPool(size);
+    if (!freeLists[pool] && !addChunk(pool))
+        return NULL;
+
+    SFreeBlock *block = freeLists[pool];
+    freeLists[pool] = block->next;
+    return block;
+}
+
+void CLuaAllocator::freeBlock(void *p, size_t size)
+{
+    if (size > MAX_POOLED_SIZE)
+    {
+        free(p);
+        return;
+    }
+
+    const int pool = getPool(size);
+    SFreeBlock *block = static_cast<SFreeBlock *>(p);
+    block->next = freeLists[pool];
+    freeLists[pool] = block;
+}
+
+bool CLuaAllocator::addChunk(int pool)
+{
+    char *chunk = static_cast<char *>(malloc(CHUNK_SIZE));
+    if (!chunk)
+        return false;
+
+    chunks << chunk;
+    reservedBytes += CHUNK_SIZE;
+
+    const size_t blocksize = MIN_BLOCK_SIZE << pool;
+    for (size_t offset=0; (offset + blocksize) <= CHUNK_SIZE; offset += blocksize)
+    {
+        SFreeBlock *block = reinterpret_cast<SFreeBlock *>(chunk + offset);
+        block->next = freeLists[pool];
+        freeLists[pool] = block;
+    }
+
+    return true;
+}
+
+void CLuaAllocator::account(int account, ptrdiff_t delta)
+{
+    SAccount &acc = accounts[account];
+    acc.stats.bytes += delta;
+    currentBytes += delta;
+
+    if (delta > 0)
+    {
+        allocatedBytes += delta;
+        if (acc.stats.bytes > acc.stats.peakBytes)
+            acc.stats.peakBytes = acc.stats.bytes;
+        if (currentBytes > peakBytes)
+            peakBytes = currentBytes;
+    }
+    else if ((delta < 0) && !acc.open && !acc.stats.bytes)
+        freeAccounts << account;
+}
+
+void *CLuaAllocator::alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    CLuaAllocator *allocator = static_cast<CLuaAllocator *>(ud);
+    SBlockHeader *block = (ptr) ? static_cast<SBlockHeader *>(ptr) - 1 : NULL;
+
+    if (!block)
+        osize = 0;
+
+    if (nsize == 0)
+    {
+        if (block)
+        {
+            const int acc = block->account;
+            allocator->freeBlock(block, osize + sizeof(SBlockHeader));
+            allocator->account(acc, -static_cast<ptrdiff_t>(osize));
+        }
+        return NULL;
+    }
+
+    // Blocks stay with the account they were allocated for
+    const int acc = (block) ? static_cast<int>(block->account) : allocator->currentAccount;
+
+    if (allocator->limited && (nsize > osize)) // Lua assumes shrinking never fails
+    {
+        const size_t grow = nsize - osize;
+        SAccountStats &stats = allocator->accounts[acc].stats;
+        if ((allocator->totalLimit && ((allocator->currentBytes + grow) > allocator->totalLimit)) ||
+            (stats.limit && ((stats.bytes + grow) > stats.limit)))
+        {
+            ++allocator->failedAllocations;
+            ++stats.failedAllocations;
+            return NULL;
+        }
+    }
+
+    const size_t oblocksize = osize + sizeof(SBlockHeader);
+    const size_t nblocksize = nsize + sizeof(SBlockHeader);
+    SBlockHeader *newblock;
+
+    if (block && (oblocksize <= MAX_POOLED_SIZE) && (nblocksize <= MAX_POOLED_SIZE) &&
+        (getPool(oblocksize) == getPool(nblocksize)))
+        newblock = block; // Still fits
+    else if (block && (oblocksize > MAX_POOLED_SIZE) && (nblocksize > MAX_POOLED_SIZE))
+    {
+        newblock = static_cast<SBlockHeader *>(realloc(block, nblocksize));
+        if (!newblock)
+            return NULL;
+    }
+    else
+    {
+        newblock = static_cast<SBlockHeader *>(allocator->allocBlock(nblocksize));
+        if (!newblock)
+            return NULL;
+
+        if (block)
+        {
+            memcpy(newblock, block, qMin(oblocksize, nblocksize)); // Includes header
+            allocator->freeBlock(block, oblocksize);
+        }
+        else
+        {
+            newblock->account = acc;
+            ++allocator->allocations;
+        }
+    }
+
+    allocator->account(acc, static_cast<ptrdiff_t>(nsize) - static_cast<ptrdiff_t>(osize));
+    return newblock + 1;
+}
+
+void CLuaAllocator::registerBindings(lua_State *l)
+{
+    registerFunction(l, luaMemStats, "memstats", this);
+}
+
+int CLuaAllocator::createAccount(size_t limit)
+{
+    int acc;
+    if (!freeAccounts.isEmpty())
+        acc = freeAccounts.takeFirst();
+    else
+    {
+        acc = accounts.size();
+        accounts.resize(acc + 1);
+    }
+
+    accounts[acc] = SAccount();
+    accounts[acc].open = true;
+    accounts[acc].stats.limit = limit;
+    return acc;
+}
+
+void CLuaAllocator::releaseAccount(int account)
+{
+    if (account == MAIN_ACCOUNT)
+        return;
+
+    accounts[account].open = false;
+    if (!accounts[account].stats.bytes)
+        freeAccounts << account;
+}
+
+CLuaAllocator::SStats CLuaAllocator::getStats()
+{
+    const uint32_t now = getTimeMS();
+    if ((now - rateTime) >= 1000)
+    {
+        allocationsPerSec = static_cast<uint64_t>(allocations - rateAllocations) * 1000 /
+                (now - rateTime);
+        rateTime = now;
+        rateAllocations = allocations;
+    }
+
+    SStats ret;
+    ret.currentBytes = currentBytes;
+    ret.peakBytes = peakBytes;
+    ret.limit = totalLimit;
+    ret.reservedBytes = reservedBytes;
+    ret.allocations = allocations;
+    ret.failedAllocations = failedAllocations;
+    ret.allocationsPerSec = allocationsPerSec;
+    return ret;
+}
+
+int CLuaAllocator::luaMemStats(lua_State *l)
+{
+    // memstats(): table with current, peak, limit and reserved (bytes),
+    // allocations, failed and allocspersec (since the previous call, at
+    // least one second ago)
+    CLuaAllocator *allocator = static_cast<CLuaAllocator *>(lua_touserdata(l, lua_upvalueindex(1)));
+    const SStats stats(allocator->getStats());
+
+    lua_createtable(l, 0, 7);
+    lua_pushnumber(l, stats.currentBytes);
+    lua_setfield(l, -2, "current");
+    lua_pushnumber(l, stats.peakBytes);
+    lua_setfield(l, -2, "peak");
+    lua_pushnumber(l, stats.limit);
+    lua_setfield(l, -2, "limit");
+    lua_pushnumber(l, stats.reservedBytes);
+    lua_setfield(l, -2, "reserved");
+    lua_pushnumber(l, stats.allocations);
+    lua_setfield(l, -2, "allocations");
+    lua_pushnumber(l, stats.failedAllocations);
+    lua_setfield(l, -2, "failed");
+    lua_pushnumber(l, stats.allocationsPerSec);
+    lua_setfield(l, -2, "allocspersec");
+
+    return 1;
+}
+
+}
@@ -0,0 +1,110 @@
+#ifndef LUAALLOC_H
+#define LUAALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <QList>
+#include <QVector>
+
+#include <lua.hpp>
+
+namespace NLua
+{
+
+// lua_Alloc for the Lua state of a robot. Blocks up to MAX_POOLED_SIZE are
+// taken from free lists per size class, which are filled from CHUNK_SIZE
+// chunks that are kept until the state is closed.
+// Every block starts with a small header that tells the account (script) it
+// was allocated for, so memory stays accounted to the script that allocated
+// it until freed, no matter which script runs the garbage collector.
+// Growing a block fails above the total limit or the limit of its account,
+// which raises a "not enough memory" error in the Lua code that allocated.
+// Limits only apply while Lua code runs (see callProtected()). Allocations
+// of the host, e.g. for pushed arguments, happen outside of any protected
+// call, failing them would end in the panic function.
+class CLuaAllocator
+{
+public:
+    enum { MAIN_ACCOUNT = 0 }; // Anything allocated outside of tasks
+
+    struct SStats
+    {
+        size_t currentBytes, peakBytes, limit;
+        size_t reservedBytes; // Allocated by pools, used or not
+        uint32_t allocations, failedAllocations, allocationsPerSec;
+    };
+
+    struct SAccountStats
+    {
+        size_t bytes, peakBytes, limit;
+        uint32_t failedAllocations;
+        SAccountStats(void) : bytes(0), peakBytes(0), limit(0), failedAllocations(0) { }
+    };
+
+private:
+    enum { MIN_BLOCK_SIZE = 16, MAX_POOLED_SIZE = 256, POOL_COUNT = 5, CHUNK_SIZE = 16 * 1024 };
+
+    struct SBlockHeader
+    {
+        uint32_t account;
+        uint32_t padding; // Keeps the data 8 byte aligned
+    };
+
+    struct SFreeBlock { SFreeBlock *next; };
+
+    struct SAccount
+    {
+        SAccountStats stats;
+        bool open; // Released accounts are reused once all their memory is freed
+        SAccount(void) : open(false) { }
+    };
+
+    SFreeBlock *freeLists[POOL_COUNT];
+    QList<char *> chunks;
+    QVector<SAccount> accounts;
+    QList<int> freeAccounts;
+    int currentAccount;
+    bool limited;
+    size_t currentBytes, peakBytes, totalLimit, reservedBytes;
+    uint64_t allocatedBytes; // Allocated and grown, never decreases
+    uint32_t allocations, failedAllocations;
+    uint32_t rateTime, rateAllocations, allocationsPerSec;
+
+    static int getPool(size_t size);
+    void *allocBlock(size_t size);
+    void freeBlock(void *p, size_t size);
+    bool addChunk(int pool);
+    void account(int account, ptrdiff_t delta);
+
+    static int luaMemStats(lua_State *l);
+
+public:
+    // limit: bytes for all accounts, 0 for none
+    CLuaAllocator(size_t limit);
+    ~CLuaAllocator(void);
+
+    static void *alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
+    void registerBindings(lua_State *l);
+
+    // limit: 0 for none
+    int createAccount(size_t limit);
+    // No further allocations may be done for the account
+    void releaseAccount(int account);
+    // Account for allocations from now on
+    void setAccount(int account) { currentAccount = account; }
+    int getAccount(void) const { return currentAccount; }
+    // Enforce limits from now on
+    void setLimited(bool l) { limited = l; }
+    bool isLimited(void) const { return limited; }
+    void setAccountLimit(int account, size_t limit) { accounts[account].stats.limit = limit; }
+    SAccountStats getAccountStats(int account) const { return accounts[account].stats; }
+
+    SStats getStats(void);
+    uint64_t getAllocatedBytes(void) const { return allocatedBytes; }
+};
+
+}
+
+#endif
@@ -254,32 +254,32 @@ int pathECalcPath(lua_State *l)
 }
 
 
-void registerBindings()
+void registerBindings(lua_State *l)
 {
     // Vector
-    NLua::registerFunction(vecNew, "newvector", "nav");
-    NLua::registerClassFunction(vecGetX, "x", "vector");
-    NLua::registerClassFunction(vecSetX, "setx", "vector");
-    NLua::registerClassFunction(vecGetY, "y", "vector");
-    NLua::registerClassFunction(vecSetY, "sety", "vector");
-    NLua::registerClassFunction(vecSet, "set", "vector");
-    NLua::registerClassFunction(vecOperator, "__add", "vector", (void *)"+");
-    NLua::registerClassFunction(vecOperator, "__sub", "vector", (void *)"-");
-    NLua::registerClassFunction(vecOperator, "__mul", "vector", (void *)"*");
-    NLua::registerClassFunction(vecOperator, "__div", "vector", (void *)"/");
-    NLua::registerClassFunction(vecEqual, "__eq", "vector");
-    NLua::registerClassFunction(vecLength, "__len", "vector");
-    NLua::registerClassFunction(vecNormalize, "normalize", "vector");
-    NLua::registerClassFunction(vecRotate, "rotate", "vector");
-    NLua::registerClassFunction(vecToString, "__tostring", "vector");
+    NLua::registerFunction(l, vecNew, "newvector", "nav");
+    NLua::registerClassFunction(l, vecGetX, "x", "vector");
+    NLua::registerClassFunction(l, vecSetX, "setx", "vector");
+    NLua::registerClassFunction(l, vecGetY, "y", "vector");
+    NLua::registerClassFunction(l, vecSetY, "sety", "vector");
+    NLua::registerClassFunction(l, vecSet, "set", "vector");
+    NLua::registerClassFunction(l, vecOperator, "__add", "vector", (void *)"+");
+    NLua::registerClassFunction(l, vecOperator, "__sub", "vector", (void *)"-");
+    NLua::registerClassFunction(l, vecOperator, "__mul", "vector", (void *)"*");
+    NLua::registerClassFunction(l, vecOperator, "__div", "vector", (void *)"/");
+    NLua::registerClassFunction(l, vecEqual, "__eq", "vector");
+    NLua::registerClassFunction(l, vecLength, "__len", "vector");
+    NLua::registerClassFunction(l, vecNormalize, "normalize", "vector");
+    NLua::registerClassFunction(l, vecRotate, "rotate", "vector");
+    NLua::registerClassFunction(l, vecToString, "__tostring", "vector");
 
     // Path engine
-    NLua::registerFunction(pathENew, "newpathengine", "nav");
-    NLua::registerClassFunction(pathESetGrid, "setgrid", "pathengine");
-    NLua::registerClassFunction(pathEExpandGrid, "expandgrid", "pathengine");
-    NLua::registerClassFunction(pathESetObstacle, "setobstacle", "pathengine");
-    NLua::registerClassFunction(pathEInitPath, "init", "pathengine");
-    NLua::registerClassFunction(pathECalcPath, "calc", "pathengine");
+    NLua::registerFunction(l, pathENew, "newpathengine", "nav");
+    NLua::registerClassFunction(l, pathESetGrid, "setgrid", "pathengine");
+    NLua::registerClassFunction(l, pathEExpandGrid, "expandgrid", "pathengine");
+    NLua::registerClassFunction(l, pathESetObstacle, "setobstacle", "pathengine");
+    NLua::registerClassFunction(l, pathEInitPath, "init", "pathengine");
+    NLua::registerClassFunction(l, pathECalcPath, "calc", "pathengine");
 }
 
 }
@@ -6,7 +6,7 @@
 namespace NLuaNav
 {
 
-void registerBindings(void);
+void registerBindings(lua_State *l);
 
 }
 
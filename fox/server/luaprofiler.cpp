@@ -0,0 +1,99 @@
+#include <string.h>
+
+#include "luaprofiler.h"
+#include "timeutil.h"
+
+namespace NLua {
+
+void CLuaProfiler::start()
+{
+    entries.clear();
+    totalSamples = 0;
+    startTime = getTimeUS();
+    active = true;
+}
+
+void CLuaProfiler::stop()
+{
+    if (!active)
+        return;
+
+    duration = getDuration();
+    active = false;
+}
+
+void CLuaProfiler::sample(lua_State *l, uint64_t time, uint64_t allocbytes)
+{
+    // C functions (e.g. a yielding sleep()) are attributed to the line
+    // calling them
+    lua_Debug ar;
+    int level = 0;
+    bool found = false;
+    while (lua_getstack(l, level, &ar))
+    {
+        lua_getinfo(l, "Sl", &ar);
+        if (*ar.what != 'C')
+        {
+            found = true;
+            break;
+        }
+        ++level;
+    }
+
+    if (found)
+    {
+        // Only copied for new entries
+        const TKey key(QByteArray::fromRawData(ar.source, strlen(ar.source)), ar.currentline);
+        QHash<TKey, SEntry>::iterator it = entries.find(key);
+        if (it == entries.end())
+        {
+            SEntry entry;
+            lua_getinfo(l, "n", &ar);
+            if (ar.name)
+                entry.function = ar.name;
+            else
+                entry.function = (*ar.what == 'm') ? "(main chunk)" : "?";
+            entry.source = ar.short_src;
+            entry.line = ar.currentline;
+            it = entries.insert(TKey(QByteArray(ar.source), ar.currentline), entry);
+        }
+
+        ++it.value().samples;
+        it.value().timeUS += time - lastTime;
+        it.value().allocBytes += allocbytes - lastAllocBytes;
+        ++totalSamples;
+    }
+
+    lastTime = time;
+    lastAllocBytes = allocbytes;
+}
+
+uint32_t CLuaProfiler::getDuration() const
+{
+    if (!active)
+        return duration;
+    return (getTimeUS() - startTime) / 1000;
+}
+
+QList<SLuaProfileEntry> CLuaProfiler::getProfile(int max) const
+{
+    QList<SEntry> sorted(entries.values());
+    qSort(sorted.begin(), sorted.end(), timeGreaterThan);
+
+    QList<SLuaProfileEntry> ret;
+    for (int i=0; (i<sorted.size()) && (i<max); ++i)
+    {
+        SLuaProfileEntry entry;
+        entry.function = sorted[i].function;
+        entry.source = sorted[i].source;
+        entry.line = sorted[i].line;
+        entry.samples = sorted[i].samples;
+        entry.timeUS = sorted[i].timeUS;
+        entry.allocBytes = sorted[i].allocBytes;
+        ret << entry;
+    }
+
+    return ret;
+}
+
+}
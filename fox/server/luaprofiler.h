@@ -0,0 +1,67 @@
+#ifndef LUAPROFILER_H
+#define LUAPROFILER_H
+
+#include <stdint.h>
+
+#include <QHash>
+#include <QList>
+#include <QPair>
+
+#include <lua.hpp>
+
+#include "tcputil.h"
+
+namespace NLua
+{
+
+// Sampling profiler for scheduler tasks. The count hook of the scheduler
+// calls sample() every thousand instructions, which attributes the time
+// and memory allocated since the previous sample to the current line. Only
+// time spent in tasks is seen, code called from C (init, handlecmd, event
+// predicates) is not.
+class CLuaProfiler
+{
+    struct SEntry
+    {
+        QByteArray function, source;
+        int line;
+        uint32_t samples;
+        uint64_t timeUS, allocBytes;
+        SEntry(void) : line(0), samples(0), timeUS(0), allocBytes(0) { }
+    };
+
+    // Source (contents, the pointer of lua_getinfo may be reused by another
+    // chunk once the old one is collected) and line
+    typedef QPair<QByteArray, int> TKey;
+
+    QHash<TKey, SEntry> entries;
+    bool active;
+    uint64_t startTime, lastTime, lastAllocBytes;
+    uint32_t totalSamples, duration;
+
+    static bool timeGreaterThan(const SEntry &e1, const SEntry &e2)
+    { return e1.timeUS > e2.timeUS; }
+
+public:
+    CLuaProfiler(void) : active(false), startTime(0), lastTime(0), lastAllocBytes(0),
+                         totalSamples(0), duration(0) { }
+
+    void start(void);
+    void stop(void);
+    bool isActive(void) const { return active; }
+
+    // Called when a task is resumed, so time and memory before aren't
+    // attributed. allocbytes: total allocated so far (see CLuaAllocator).
+    void resetSample(uint64_t time, uint64_t allocbytes)
+    { lastTime = time; lastAllocBytes = allocbytes; }
+    void sample(lua_State *l, uint64_t time, uint64_t allocbytes);
+
+    uint32_t getDuration(void) const; // ms
+    uint32_t getSamples(void) const { return totalSamples; }
+    // At most max entries, most time first
+    QList<SLuaProfileEntry> getProfile(int max) const;
+};
+
+}
+
+#endif
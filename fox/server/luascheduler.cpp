@@ -0,0 +1,714 @@
+#include <QDebug>
+#include <QPair>
+#include <QTimer>
+
+#include "lua.h"
+#include "luaalloc.h"
+#include "luascheduler.h"
+#include "timeutil.h"
+
+namespace NLua {
+
+char CLuaScheduler::hookKey = 0;
+
+const char *CLuaScheduler::stateNames[TASK_DEAD + 1] =
+{
+    "ready", "woken", "running", "sleeping", "waitmsg", "waitevent", "dead"
+};
+
+CLuaScheduler::CLuaScheduler(lua_State *l, CLuaAllocator *a)
+    : luaState(l), allocator(a), nextTaskID(1), resumeDepth(0), passPending(false),
+      minVRuntime(0), resumeStart(0), preempted(false)
+{
+    lua_pushlightuserdata(l, &hookKey);
+    lua_pushlightuserdata(l, this);
+    lua_rawset(l, LUA_REGISTRYINDEX);
+
+    tickTimer = new QTimer(this);
+    connect(tickTimer, SIGNAL(timeout()), this, SLOT(tick()));
+
+    wakeTimer = new QTimer(this);
+    wakeTimer->setSingleShot(true);
+    connect(wakeTimer, SIGNAL(timeout()), this, SLOT(wakeTimeout()));
+}
+
+CLuaScheduler::STask *CLuaScheduler::getCurrentTask(lua_State *l)
+{
+    TTaskMap::iterator it = tasks.find(threadTasks.value(l, -1));
+    if (it == tasks.end())
+        return NULL;
+    return &it.value();
+}
+
+void CLuaScheduler::block(STask &task, ETaskState state, uint32_t timeout)
+{
+    task.state = task.blockState = state;
+    task.timedOut = false;
+
+    if (timeout)
+    {
+        task.wakeTime = getTimeMS() + timeout;
+        timers.insert(task.wakeTime, task.id);
+        updateTimers();
+    }
+}
+
+void CLuaScheduler::unblock(STask &task)
+{
+    if (task.wakeTime)
+    {
+        timers.remove(task.wakeTime, task.id);
+        task.wakeTime = 0;
+        updateTimers();
+    }
+
+    if (task.event != -1)
+    {
+        eventWaiters.remove(task.event, task.id);
+        task.event = -1;
+    }
+
+    if (task.predicateRef != LUA_NOREF)
+    {
+        luaL_unref(luaState, LUA_REGISTRYINDEX, task.predicateRef);
+        task.predicateRef = LUA_NOREF;
+    }
+}
+
+void CLuaScheduler::wake(STask &task)
+{
+    unblock(task);
+    task.state = TASK_WOKEN;
+    task.vruntime = qMax(task.vruntime, minVRuntime);
+    schedulePass();
+}
+
+void CLuaScheduler::resume(STask &task)
+{
+    lua_State *thread = task.thread;
+    int nargs = 0;
+
+    if (!task.started) // Function and arguments are on the stack
+    {
+        nargs = lua_gettop(thread) - 1;
+        task.started = true;
+    }
+    else if (task.blockState == TASK_WAITMSG)
+    {
+        if (!task.messages.isEmpty())
+        {
+            const QStringList msg(task.messages.takeFirst());
+            foreach(QString s, msg)
+            {
+                lua_pushstring(thread, qPrintable(s));
+            }
+            nargs = msg.size();
+        }
+        else // Timeout
+        {
+            lua_pushnil(thread);
+            nargs = 1;
+        }
+    }
+    else if (task.blockState == TASK_WAITEVENT)
+    {
+        if (task.timedOut)
+            lua_pushnil(thread);
+        else
+            lua_pushinteger(thread, task.eventValue);
+        nargs = 1;
+    }
+
+    const int id = task.id;
+    task.state = TASK_RUNNING;
+    task.blockState = TASK_READY;
+
+    resumeStart = getTimeUS();
+    preempted = false;
+    const int prevaccount = allocator->getAccount();
+    const bool waslimited = allocator->isLimited();
+    allocator->setAccount(task.memoryAccount);
+    allocator->setLimited(true);
+    if (profiler.isActive())
+        profiler.resetSample(resumeStart, allocator->getAllocatedBytes());
+    ++resumeDepth;
+    const int ret = lua_resume(thread, nargs);
+    --resumeDepth;
+    allocator->setAccount(prevaccount);
+    allocator->setLimited(waslimited);
+    if (profiler.isActive() && (ret == LUA_YIELD) && !preempted) // Up to the yield
+        profiler.sample(thread, getTimeUS(), allocator->getAllocatedBytes());
+    const uint32_t slice = getTimeUS() - resumeStart;
+    const bool waspreempted = preempted;
+    preempted = false;
+
+    // Tasks may have been started or stopped meanwhile
+    TTaskMap::iterator it = tasks.find(id);
+    if (it == tasks.end())
+        return;
+
+    STask &t = it.value();
+
+    t.stats.cpuTimeUS += slice;
+    ++t.stats.resumes;
+    t.stats.maxSliceUS = qMax(t.stats.maxSliceUS, slice);
+    t.vruntime += static_cast<uint64_t>(slice) * PRIORITY_NORMAL / t.stats.priority;
+
+    if ((ret == LUA_YIELD) && !t.stopRequested)
+    {
+        if (waspreempted)
+        {
+            // Continue after the event loop had its turn
+            ++t.stats.preemptions;
+            ++t.unreportedPreemptions;
+            t.state = TASK_WOKEN;
+            schedulePass();
+            reportPreemptions(t);
+        }
+        else if (t.state == TASK_RUNNING) // Plain coroutine.yield()
+        {
+            t.state = TASK_READY;
+            if (!tickTimer->isActive())
+                tickTimer->start(TICK_TIME);
+        }
+        return;
+    }
+
+    QByteArray err;
+    if ((ret != LUA_YIELD) && (ret != 0))
+    {
+        if (ret == LUA_ERRMEM)
+        {
+            const CLuaAllocator::SAccountStats mem(allocator->getAccountStats(t.memoryAccount));
+            err = QString("out of memory (task uses %1 kB)").arg(mem.bytes / 1024).toLatin1();
+        }
+        else
+            err = lua_tostring(thread, -1);
+        qCritical() << "Lua error in task" << id << ":" << err;
+    }
+
+    const bool stopped = t.stopRequested;
+    removeTask(id);
+
+    if (!stopped)
+    {
+        lua_getglobal(luaState, "taskfinished");
+        lua_pushinteger(luaState, id);
+        if (err.isNull())
+            lua_pushnil(luaState);
+        else
+            lua_pushstring(luaState, err.constData());
+        if (callProtected(luaState, 2, 0))
+        {
+            qCritical() << "Lua error in taskfinished:" << lua_tostring(luaState, -1);
+            lua_pop(luaState, 1);
+        }
+    }
+}
+
+void CLuaScheduler::reportPreemptions(STask &task)
+{
+    const uint32_t now = getTimeMS();
+    if (task.preemptReportTime && ((now - task.preemptReportTime) < PREEMPT_REPORT_INTERVAL))
+        return;
+
+    const int id = task.id;
+    const int count = task.unreportedPreemptions;
+    task.preemptReportTime = now;
+    task.unreportedPreemptions = 0;
+
+    // NOTE: task may be removed after this
+    lua_getglobal(luaState, "taskpreempted");
+    if (lua_isnil(luaState, -1))
+    {
+        lua_pop(luaState, 1);
+        qWarning() << "Task" << id << "was preempted" << count << "times";
+        return;
+    }
+
+    lua_pushinteger(luaState, id);
+    lua_pushinteger(luaState, count);
+    if (callProtected(luaState, 2, 0))
+    {
+        qCritical() << "Lua error in taskpreempted:" << lua_tostring(luaState, -1);
+        lua_pop(luaState, 1);
+    }
+}
+
+bool CLuaScheduler::canPreempt(lua_State *l) const
+{
+    // Coroutines of the task inherit the hook, yielding them would return to
+    // the task instead of the scheduler
+    if (!threadTasks.contains(l))
+        return false;
+
+    // Yielding across C functions (pcall, table.sort, ...) or metamethods
+    // raises an error. Functions called by anything but a call instruction
+    // have no name, these, tail calls and generic for iterators are avoided.
+    lua_Debug ar, caller;
+    for (int level=0; lua_getstack(l, level, &ar); ++level)
+    {
+        lua_getinfo(l, "Sn", &ar);
+        if (*ar.what == 'C')
+            return false;
+        if (!lua_getstack(l, level + 1, &caller))
+            break; // The task function, called by lua_resume()
+        if (!*ar.namewhat || (ar.name && (*ar.name == '(')))
+            return false;
+    }
+
+    return true;
+}
+
+void CLuaScheduler::hook(lua_State *l, lua_Debug *)
+{
+    lua_pushlightuserdata(l, &hookKey);
+    lua_rawget(l, LUA_REGISTRYINDEX);
+    CLuaScheduler *sched = static_cast<CLuaScheduler *>(lua_touserdata(l, -1));
+    lua_pop(l, 1);
+
+    if (!sched || !sched->resumeDepth)
+        return;
+
+    const uint64_t now = getTimeUS();
+    if (sched->profiler.isActive())
+        sched->profiler.sample(l, now, sched->allocator->getAllocatedBytes());
+
+    const uint64_t elapsed = now - sched->resumeStart;
+    if (elapsed > (MAX_RESUME_TIME * 1000))
+    {
+        luaL_error(l, "task did not yield for %d ms, aborted",
+                   static_cast<int>(elapsed / 1000));
+    }
+    else if ((elapsed > (SLICE_BUDGET * 1000)) && sched->canPreempt(l))
+    {
+        sched->preempted = true;
+        lua_yield(l, 0);
+    }
+}
+
+void CLuaScheduler::removeTask(int id)
+{
+    TTaskMap::iterator it = tasks.find(id);
+    if (it == tasks.end())
+        return;
+
+    unblock(it.value());
+    allocator->releaseAccount(it.value().memoryAccount);
+    threadTasks.remove(it.value().thread);
+    luaL_unref(luaState, LUA_REGISTRYINDEX, it.value().threadRef);
+    tasks.erase(it);
+}
+
+void CLuaScheduler::updateTimers()
+{
+    if (timers.isEmpty())
+    {
+        wakeTimer->stop();
+        return;
+    }
+
+    const uint32_t now = getTimeMS(), next = timers.begin().key();
+    wakeTimer->start((next > now) ? (next - now) : 0);
+}
+
+void CLuaScheduler::schedulePass()
+{
+    // Always from the event loop: callers may be in the middle of Lua code
+    // that expects tasks not to run yet (e.g. sched.start)
+    if (!passPending)
+    {
+        passPending = true;
+        QTimer::singleShot(0, this, SLOT(runPass()));
+    }
+}
+
+void CLuaScheduler::runTasks(bool polled)
+{
+    // Woken tasks always run, ready (yielded) ones only when polled by tick
+    QList<QPair<uint64_t, int> > runnable;
+    for (TTaskMap::iterator it=tasks.begin(); it!=tasks.end(); ++it)
+    {
+        const ETaskState st = it.value().state;
+        if ((st == TASK_WOKEN) || (polled && (st == TASK_READY)))
+            runnable << qMakePair(it.value().vruntime, it.key());
+    }
+
+    if (runnable.isEmpty())
+        return;
+
+    qSort(runnable);
+    minVRuntime = qMax(minVRuntime, runnable.first().first);
+
+    const uint64_t passstart = getTimeUS();
+    for (int i=0; i<runnable.size(); ++i)
+    {
+        if ((getTimeUS() - passstart) > (PASS_BUDGET * 1000))
+        {
+            // Woken tasks need another pass, ready ones wait for the next tick
+            schedulePass();
+            break;
+        }
+
+        TTaskMap::iterator it = tasks.find(runnable[i].second);
+        if (it == tasks.end())
+            continue;
+
+        const ETaskState st = it.value().state;
+        if ((st == TASK_WOKEN) || (polled && (st == TASK_READY)))
+            resume(it.value());
+    }
+}
+
+void CLuaScheduler::tick()
+{
+    runTasks(true);
+
+    for (TTaskMap::iterator it=tasks.begin(); it!=tasks.end(); ++it)
+    {
+        if (it.value().state == TASK_READY)
+            return;
+    }
+
+    tickTimer->stop(); // Nothing to poll
+}
+
+void CLuaScheduler::wakeTimeout()
+{
+    const uint32_t now = getTimeMS();
+
+    while (!timers.isEmpty() && (timers.begin().key() <= now))
+    {
+        QMultiMap<uint32_t, int>::iterator tit = timers.begin();
+        TTaskMap::iterator it = tasks.find(tit.value());
+        timers.erase(tit);
+
+        if (it != tasks.end())
+        {
+            it.value().wakeTime = 0;
+            it.value().timedOut = true;
+            wake(it.value());
+        }
+    }
+
+    updateTimers();
+}
+
+void CLuaScheduler::runPass()
+{
+    passPending = false;
+    runTasks(false);
+}
+
+void CLuaScheduler::registerBindings()
+{
+    registerFunction(luaState, luaStart, "start", "sched", this);
+    registerFunction(luaState, luaStop, "stop", "sched", this);
+    registerFunction(luaState, luaPost, "post", "sched", this);
+    registerFunction(luaState, luaStatus, "status", "sched", this);
+    registerFunction(luaState, luaSetPriority, "setpriority", "sched", this);
+    registerFunction(luaState, luaSetMemLimit, "setmemlimit", "sched", this);
+    registerFunction(luaState, luaTasks, "tasks", "sched", this);
+    registerFunction(luaState, luaInfo, "info", "sched", this);
+    registerFunction(luaState, luaSleep, "sleep", this);
+    registerFunction(luaState, luaWaitMsg, "waitmsg", this);
+    registerFunction(luaState, luaWaitEvent, "waitevent", this);
+}
+
+int CLuaScheduler::start(lua_State *l, int funcindex, int nargs)
+{
+    funcindex = luaAbsIndex(l, funcindex);
+
+    STask task;
+    task.id = nextTaskID++;
+    task.thread = lua_newthread(l);
+    task.threadRef = luaL_ref(l, LUA_REGISTRYINDEX); // Pops thread
+    task.vruntime = minVRuntime;
+    task.memoryAccount = allocator->createAccount(TASK_MEMORY_LIMIT);
+    lua_sethook(task.thread, hook, LUA_MASKCOUNT, HOOK_COUNT);
+
+    for (int i=0; i<=nargs; ++i)
+        lua_pushvalue(l, funcindex + i);
+    lua_xmove(l, task.thread, nargs + 1);
+
+    tasks[task.id] = task;
+    threadTasks[task.thread] = task.id;
+    schedulePass();
+
+    return task.id;
+}
+
+void CLuaScheduler::stop(int id)
+{
+    TTaskMap::iterator it = tasks.find(id);
+    if (it == tasks.end())
+        return;
+
+    if (it.value().state == TASK_RUNNING) // Stopping itself
+        it.value().stopRequested = true;
+    else
+        removeTask(id);
+}
+
+void CLuaScheduler::post(int id, const QStringList &msg)
+{
+    TTaskMap::iterator it = tasks.find(id);
+    if (it == tasks.end())
+        return;
+
+    STask &task = it.value();
+
+    // Tasks that never call waitmsg() would otherwise collect every message
+    if (task.messages.size() >= MAX_MESSAGES)
+    {
+        if (!task.droppedMessages)
+        {
+            qWarning() << "Message queue of task" << id << "is full, dropping old messages";
+            task.droppedMessages = true;
+        }
+        task.messages.removeFirst();
+    }
+
+    task.messages << msg;
+    if (task.state == TASK_WAITMSG)
+        wake(task);
+}
+
+CLuaScheduler::ETaskState CLuaScheduler::getState(int id) const
+{
+    TTaskMap::const_iterator it = tasks.find(id);
+    return (it == tasks.end()) ? TASK_DEAD : it.value().state;
+}
+
+void CLuaScheduler::setPriority(int id, int priority)
+{
+    TTaskMap::iterator it = tasks.find(id);
+    if (it != tasks.end())
+        it.value().stats.priority = qBound(static_cast<int>(PRIORITY_MIN), priority,
+                                           static_cast<int>(PRIORITY_MAX));
+}
+
+void CLuaScheduler::setMemoryLimit(int id, size_t limit)
+{
+    TTaskMap::iterator it = tasks.find(id);
+    if (it != tasks.end())
+        allocator->setAccountLimit(it.value().memoryAccount, limit);
+}
+
+CLuaScheduler::STaskStats CLuaScheduler::getStats(int id) const
+{
+    TTaskMap::const_iterator it = tasks.find(id);
+    if (it == tasks.end())
+        return STaskStats();
+
+    STaskStats ret(it.value().stats);
+    const CLuaAllocator::SAccountStats mem(allocator->getAccountStats(it.value().memoryAccount));
+    ret.memory = mem.bytes;
+    ret.memoryPeak = mem.peakBytes;
+    ret.memoryLimit = mem.limit;
+    return ret;
+}
+
+int CLuaScheduler::waitEvent(lua_State *l, int event, int predindex, uint32_t timeout)
+{
+    STask *task = getCurrentTask(l);
+    if (!task)
+        return luaL_error(l, "Can only wait from a task (see sched.start)");
+
+    if (!lua_isnoneornil(l, predindex))
+    {
+        luaL_checktype(l, predindex, LUA_TFUNCTION);
+        lua_pushvalue(l, predindex);
+        task->predicateRef = luaL_ref(l, LUA_REGISTRYINDEX);
+    }
+
+    task->event = event;
+    eventWaiters.insert(event, task->id);
+    block(*task, TASK_WAITEVENT, timeout);
+
+    return lua_yield(l, 0);
+}
+
+void CLuaScheduler::signalEvent(int event, int value)
+{
+    if (!eventWaiters.contains(event))
+        return;
+
+    const QList<int> ids(eventWaiters.values(event));
+    foreach(int id, ids)
+    {
+        TTaskMap::iterator it = tasks.find(id);
+        if ((it == tasks.end()) || (it.value().state != TASK_WAITEVENT))
+            continue;
+
+        if (it.value().predicateRef != LUA_NOREF)
+        {
+            lua_rawgeti(luaState, LUA_REGISTRYINDEX, it.value().predicateRef);
+            lua_pushinteger(luaState, value);
+            if (callProtected(luaState, 1, 1))
+            {
+                qCritical() << "Lua error in waitevent predicate:" <<
+                        lua_tostring(luaState, -1);
+                lua_pop(luaState, 1);
+                continue;
+            }
+
+            const bool accepted = lua_toboolean(luaState, -1);
+            lua_pop(luaState, 1);
+
+            // The predicate may have started or stopped tasks
+            it = tasks.find(id);
+            if (!accepted || (it == tasks.end()) || (it.value().state != TASK_WAITEVENT))
+                continue;
+        }
+
+        it.value().eventValue = value;
+        wake(it.value());
+    }
+}
+
+int CLuaScheduler::luaStart(lua_State *l)
+{
+    CLuaScheduler *sched = static_cast<CLuaScheduler *>(lua_touserdata(l, lua_upvalueindex(1)));
+    luaL_checktype(l, 1, LUA_TFUNCTION);
+    lua_pushinteger(l, sched->start(l, 1, lua_gettop(l) - 1));
+    return 1;
+}
+
+int CLuaScheduler::luaStop(lua_State *l)
+{
+    CLuaScheduler *sched = static_cast<CLuaScheduler *>(lua_touserdata(l, lua_upvalueindex(1)));
+    sched->stop(luaL_checkint(l, 1));
+    return 0;
+}
+
+int CLuaScheduler::luaPost(lua_State *l)
+{
+    CLuaScheduler *sched = static_cast<CLuaScheduler *>(lua_touserdata(l, lua_upvalueindex(1)));
+    const int id = luaL_checkint(l, 1);
+    const int nargs = lua_gettop(l);
+    QStringList msg;
+
+    for (int i=2; i<=nargs; ++i)
+        msg << luaL_checkstring(l, i);
+
+    sched->post(id, msg);
+    return 0;
+}
+
+int CLuaScheduler::luaStatus(lua_State *l)
+{
+    CLuaScheduler *sched = static_cast<CLuaScheduler *>(lua_touserdata(l, lua_upvalueindex(1)));
+    lua_pushstring(l, getStateName(sched->getState(luaL_checkint(l, 1))));
+    return 1;
+}
+
+int CLuaScheduler::luaSetPriority(lua_State *l)
+{
+    CLuaScheduler *sched = static_cast<CLuaScheduler *>(lua_touserdata(l, lua_upvalueindex(1)));
+    sched->setPriority(luaL_checkint(l, 1), luaL_checkint(l, 2));
+    return 0;
+}
+
+int CLuaScheduler::luaSetMemLimit(lua_State *l)
+{
+    CLuaScheduler *sched = static_cast<CLuaScheduler *>(lua_touserdata(l, lua_upvalueindex(1)));
+    sched->setMemoryLimit(luaL_checkint(l, 1), static_cast<size_t>(luaL_checknumber(l, 2)));
+    return 0;
+}
+
+int CLuaScheduler::luaTasks(lua_State *l)
+{
+    CLuaScheduler *sched = static_cast<CLuaScheduler *>(lua_touserdata(l, lua_upvalueindex(1)));
+    const QList<int> ids(sched->getTasks());
+
+    lua_createtable(l, ids.size(), 0);
+    for (int i=0; i<ids.size(); ++i)
+    {
+        lua_pushinteger(l, ids[i]);
+        lua_rawseti(l, -2, i + 1);
+    }
+
+    return 1;
+}
+
+int CLuaScheduler::luaInfo(lua_State *l)
+{
+    CLuaScheduler *sched = static_cast<CLuaScheduler *>(lua_touserdata(l, lua_upvalueindex(1)));
+    const int id = luaL_checkint(l, 1);
+    const ETaskState state = sched->getState(id);
+
+    if (state == TASK_DEAD)
+    {
+        lua_pushnil(l);
+        return 1;
+    }
+
+    const STaskStats stats(sched->getStats(id));
+
+    lua_createtable(l, 0, 9);
+    lua_pushstring(l, getStateName(state));
+    lua_setfield(l, -2, "state");
+    lua_pushinteger(l, stats.priority);
+    lua_setfield(l, -2, "priority");
+    lua_pushnumber(l, stats.cpuTimeUS / 1000.0);
+    lua_setfield(l, -2, "cputime");
+    lua_pushinteger(l, stats.resumes);
+    lua_setfield(l, -2, "resumes");
+    lua_pushnumber(l, stats.maxSliceUS / 1000.0);
+    lua_setfield(l, -2, "maxslice");
+    lua_pushinteger(l, stats.preemptions);
+    lua_setfield(l, -2, "preemptions");
+    lua_pushnumber(l, stats.memory);
+    lua_setfield(l, -2, "memory");
+    lua_pushnumber(l, stats.memoryPeak);
+    lua_setfield(l, -2, "memorypeak");
+    lua_pushnumber(l, stats.memoryLimit);
+    lua_setfield(l, -2, "memlimit");
+
+    return 1;
+}
+
+int CLuaScheduler::luaSleep(lua_State *l)
+{
+    CLuaScheduler *sched = static_cast<CLuaScheduler *>(lua_touserdata(l, lua_upvalueindex(1)));
+    STask *task = sched->getCurrentTask(l);
+    if (!task)
+        return luaL_error(l, "Can only sleep from a task (see sched.start)");
+
+    const int ms = luaL_checkint(l, 1);
+    if (ms > 0)
+        sched->block(*task, TASK_SLEEPING, ms);
+    // else: same as coroutine.yield()
+
+    return lua_yield(l, 0);
+}
+
+int CLuaScheduler::luaWaitMsg(lua_State *l)
+{
+    CLuaScheduler *sched = static_cast<CLuaScheduler *>(lua_touserdata(l, lua_upvalueindex(1)));
+    STask *task = sched->getCurrentTask(l);
+    if (!task)
+        return luaL_error(l, "Can only wait from a task (see sched.start)");
+
+    if (!task->messages.isEmpty())
+    {
+        const QStringList msg(task->messages.takeFirst());
+        foreach(QString s, msg)
+        {
+            lua_pushstring(l, qPrintable(s));
+        }
+        return msg.size();
+    }
+
+    sched->block(*task, TASK_WAITMSG, luaL_optint(l, 1, 0));
+    return lua_yield(l, 0);
+}
+
+int CLuaScheduler::luaWaitEvent(lua_State *l)
+{
+    CLuaScheduler *sched = static_cast<CLuaScheduler *>(lua_touserdata(l, lua_upvalueindex(1)));
+    return sched->waitEvent(l, luaL_checkint(l, 1), 2, luaL_optint(l, 3, 0));
+}
+
+}
@@ -0,0 +1,183 @@
+#ifndef LUASCHEDULER_H
+#define LUASCHEDULER_H
+
+#include <stdint.h>
+
+#include <QHash>
+#include <QMap>
+#include <QMultiHash>
+#include <QMultiMap>
+#include <QObject>
+#include <QStringList>
+
+#include <lua.hpp>
+
+#include "luaprofiler.h"
+
+class QTimer;
+
+namespace NLua
+{
+
+class CLuaAllocator;
+
+// Runs script coroutines (tasks) and only resumes them when they have
+// something to do. Tasks block with:
+//  sleep(ms)
+//  waitmsg([timeout]): returns the next message (cmd, args...) posted to
+//                      the task, nil on timeout. Only the newest
+//                      MAX_MESSAGES are queued, older ones are dropped.
+//  waitevent(event, [predicate], [timeout]): returns the new value of the
+//                      event once predicate(value) is true, nil on timeout
+// A plain coroutine.yield() resumes the task on the next tick (TICK_TIME),
+// the tick timer only runs while such tasks exist. So an idle or blocked
+// task costs no wakeups and a sleeping one exactly one.
+// Tasks are cooperative, but the CPU time used by every resume is accounted.
+// Runnable tasks are resumed in order of their CPU time weighted by priority
+// (as in CFS), so a busy task with priority 10 gets twice the time of one with
+// the default priority. A pass stops resuming tasks after PASS_BUDGET, the
+// remaining ones go first in the next pass, after the event loop had its turn.
+// A count hook bounds the time of a single resume: after SLICE_BUDGET the task
+// is preempted (yielded and rescheduled) as soon as it runs no C function or
+// metamethod, which can't be yielded across. A task that still runs after
+// MAX_RESUME_TIME is aborted with an error. The global
+// taskpreempted(id, count) reports preemptions, at most once per
+// PREEMPT_REPORT_INTERVAL for every task.
+// Lua interface (sched table):
+//  sched.start(func, ...): returns task id
+//  sched.stop(id), sched.post(id, cmd, ...), sched.status(id)
+//  sched.setpriority(id, priority), sched.tasks(): list of task ids
+//  sched.setmemlimit(id, bytes): 0 for no limit, TASK_MEMORY_LIMIT by default
+//  sched.info(id): table with state, priority, cputime (ms), resumes,
+//                  maxslice (longest resume, ms), preemptions, memory,
+//                  memorypeak and memlimit (bytes)
+// Memory allocated by a task is accounted to it until freed, see
+// CLuaAllocator. A task exceeding its limit is aborted with an error.
+// The global taskfinished(id, err) is called when a task returns or fails
+// (err is nil if the task returned).
+class CLuaScheduler: public QObject
+{
+    Q_OBJECT
+
+public:
+    enum ETaskState { TASK_READY, TASK_WOKEN, TASK_RUNNING, TASK_SLEEPING,
+                      TASK_WAITMSG, TASK_WAITEVENT, TASK_DEAD };
+    enum { PRIORITY_MIN = 1, PRIORITY_NORMAL = 5, PRIORITY_MAX = 10 };
+
+    struct STaskStats
+    {
+        int priority;
+        uint64_t cpuTimeUS;
+        uint32_t resumes, maxSliceUS, preemptions;
+        size_t memory, memoryPeak, memoryLimit; // Bytes
+        STaskStats(void) : priority(PRIORITY_NORMAL), cpuTimeUS(0), resumes(0),
+                           maxSliceUS(0), preemptions(0), memory(0), memoryPeak(0),
+                           memoryLimit(0) { }
+    };
+
+private:
+    enum { TICK_TIME = 5, PASS_BUDGET = 10, SLICE_BUDGET = 10, MAX_RESUME_TIME = 1000,
+           HOOK_COUNT = 1000, PREEMPT_REPORT_INTERVAL = 1000,
+           TASK_MEMORY_LIMIT = 16 * 1024 * 1024, MAX_MESSAGES = 32 };
+
+    struct STask
+    {
+        int id;
+        lua_State *thread;
+        int threadRef, predicateRef;
+        ETaskState state, blockState; // blockState: what a woken task waited for
+        bool started, stopRequested, droppedMessages;
+        uint32_t wakeTime; // Sleeping or timeout, 0 if none
+        int event, eventValue;
+        bool timedOut;
+        QList<QStringList> messages;
+        STaskStats stats;
+        uint64_t vruntime; // CPU time (us) weighted by priority
+        uint32_t preemptReportTime, unreportedPreemptions;
+        int memoryAccount;
+        STask(void) : id(0), thread(0), threadRef(LUA_NOREF), predicateRef(LUA_NOREF),
+                      state(TASK_WOKEN), blockState(TASK_READY), started(false),
+                      stopRequested(false), droppedMessages(false), wakeTime(0), event(-1),
+                      eventValue(0), timedOut(false), vruntime(0), preemptReportTime(0),
+                      unreportedPreemptions(0), memoryAccount(0) { }
+    };
+
+    typedef QMap<int, STask> TTaskMap;
+
+    lua_State *luaState;
+    CLuaAllocator *allocator;
+    TTaskMap tasks;
+    QHash<lua_State *, int> threadTasks;
+    QMultiMap<uint32_t, int> timers; // Wake time -> task
+    QMultiHash<int, int> eventWaiters; // Event -> task
+    QTimer *tickTimer, *wakeTimer;
+    int nextTaskID;
+    int resumeDepth; // > 0 while a task runs
+    bool passPending;
+    uint64_t minVRuntime; // Given to new and woken tasks, so they can't monopolize
+    uint64_t resumeStart; // getTimeUS() of the running resume
+    CLuaProfiler profiler; // Samples from the hook
+    bool preempted; // Set by the hook when it yielded the running task
+
+    static char hookKey; // Address is the registry key of the scheduler
+
+    static const char *stateNames[TASK_DEAD + 1];
+
+    STask *getCurrentTask(lua_State *l);
+    void block(STask &task, ETaskState state, uint32_t timeout);
+    void unblock(STask &task);
+    void wake(STask &task);
+    void resume(STask &task);
+    void removeTask(int id);
+    void updateTimers(void);
+    void schedulePass(void);
+    void runTasks(bool polled);
+    void reportPreemptions(STask &task);
+    bool canPreempt(lua_State *l) const;
+
+    static void hook(lua_State *l, lua_Debug *ar);
+
+    static int luaStart(lua_State *l);
+    static int luaStop(lua_State *l);
+    static int luaPost(lua_State *l);
+    static int luaStatus(lua_State *l);
+    static int luaSetPriority(lua_State *l);
+    static int luaSetMemLimit(lua_State *l);
+    static int luaTasks(lua_State *l);
+    static int luaInfo(lua_State *l);
+    static int luaSleep(lua_State *l);
+    static int luaWaitMsg(lua_State *l);
+    static int luaWaitEvent(lua_State *l);
+
+private slots:
+    void tick(void);
+    void wakeTimeout(void);
+    void runPass(void);
+
+public:
+    CLuaScheduler(lua_State *l, CLuaAllocator *a);
+
+    void registerBindings(void);
+
+    int start(lua_State *l, int funcindex, int nargs);
+    void stop(int id);
+    void post(int id, const QStringList &msg);
+    ETaskState getState(int id) const;
+    void setPriority(int id, int priority);
+    void setMemoryLimit(int id, size_t limit);
+    STaskStats getStats(int id) const;
+    QList<int> getTasks(void) const { return tasks.keys(); }
+    CLuaProfiler &getProfiler(void) { return profiler; }
+    static const char *getStateName(ETaskState s) { return stateNames[s]; }
+
+    // For C functions that block the calling task until event changes
+    // (see waitevent). Must be returned by the C function.
+    int waitEvent(lua_State *l, int event, int predindex, uint32_t timeout);
+    // Wakes up tasks waiting for event, if their predicate accepts value
+    void signalEvent(int event, int value);
+    bool hasEventWaiters(int event) const { return eventWaiters.contains(event); }
+};
+
+}
+
+#endif
@@ -9,6 +9,6 @@ int main(int argc, char **argv)
     QCoreApplication::setApplicationName("FoxServer");
     
     QCoreApplication app(argc, argv);
-    new CControl(&app);
+    new CServer(&app);
     return app.exec();
 }
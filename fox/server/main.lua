@@ -3,8 +3,10 @@ dofile "utils.lua"
 require "robot"
 require "nav"
 
--- External script functions
-local curscript = nil
+-- External script functions, by name. Scripts started without a name are
+-- called "main": only one may run and its state is shown by clients.
+local scripts = { }
+local MAINSCRIPT = "main"
 
 -- Default delay times (ms). Restored when scripts finish. Zero == disabled
 local defaultserialdelays =
@@ -20,9 +22,9 @@ local defaultserialdelays =
 }
     
 
-local function calloptscriptfunc(f, ...)
+local function calloptscriptfunc(script, f, ...)
     -- Use rawget to avoid obtaining data from global environment
-    local func = rawget(curscript, f)
+    local func = rawget(script, f)
     if func then
         func(...)
     end
@@ -34,47 +36,114 @@ local function restoreserialdelays()
     end
 end
 
-function runscript(s)
+local function endscript(name)
+    local script = scripts[name]
+    calloptscriptfunc(script, "finish")
+    scripts[name] = nil
+    
+    if name == MAINSCRIPT then
+        scriptrunning(false)
+    end
+    
+    -- Scripts change serial delays for their own needs
+    if not next(scripts) then
+        restoreserialdelays()
+    end
+end
+
+local function stopscript(name)
+    if scripts[name] then
+        sched.stop(scripts[name].task)
+        endscript(name)
+    end
+end
+
+function runscript(s, name, priority)
+    -- s is source or bytecode (see CScriptStore)
     local stat, ret = pcall(assert(loadstring(s)))
 
-    if stat then
-        curscript = ret
-    else
+    if not stat then
         print("Failed to run script:", ret)
         return
     end
     
-    curscript.corun = coroutine.create(curscript.run)
+    name = name or MAINSCRIPT
+    
+    if scripts[name] then
+        sched.stop(scripts[name].task)
+        scripts[name] = nil
+    end
+
+    scripts[name] = ret
+    
+    calloptscriptfunc(ret, "init")
     
-    calloptscriptfunc("init")
+    -- Runs from the scheduler, see sched.start
+    ret.task = sched.start(ret.run)
+    if priority then
+        sched.setpriority(ret.task, priority)
+    end
 
-    scriptrunning(true)
+    if name == MAINSCRIPT then
+        scriptrunning(true)
+    end
 end
 
-function think()
-    if curscript then
-        assert(coroutine.resume(curscript.corun))
-        if coroutine.status(curscript.corun) == "dead" then
-            calloptscriptfunc("finish")
-            curscript = nil
-            restoreserialdelays()
-            scriptrunning(false)
+local function getscriptname(id)
+    for name, script in pairs(scripts) do
+        if script.task == id then
+            return name
         end
-    end 
+    end
+end
+
+-- Called by the scheduler when a task returned or failed
+function taskfinished(id, err)
+    if err then
+        print("Script error:", err)
+    end
+    
+    local name = getscriptname(id)
+    if name then
+        endscript(name)
+    end
+end
+
+-- Called by the scheduler when a task used up its time slice
+function taskpreempted(id, count)
+    print(string.format("Script %s was preempted %d times for not yielding",
+                        getscriptname(id) or tostring(id), count))
+end
+
+local function listscripts()
+    for name, script in pairs(scripts) do
+        local info = sched.info(script.task)
+        print(string.format("%s: %s, priority %d, %.1f ms CPU in %d resumes " ..
+                            "(max %.1f ms, %d preempted), %d kB (peak %d kB)",
+                            name, info.state, info.priority, info.cputime,
+                            info.resumes, info.maxslice, info.preemptions,
+                            info.memory / 1024, info.memorypeak / 1024))
+    end
+    
+    local mem = memstats()
+    print(string.format("Total: %d kB (peak %d kB, limit %d kB), %d allocations/s",
+                        mem.current / 1024, mem.peak / 1024, mem.limit / 1024,
+                        mem.allocspersec))
 end
 
-function execcmd(cmd, ...)
+function execcmd(name, cmd, ...)
     print("Executing script cmd:", cmd)
     
+    name = name or MAINSCRIPT
+    local script = scripts[name]
+    
     if cmd == "abortcurrentscript" then
-        if curscript then
-            calloptscriptfunc("finish")
-            curscript = nil
-            restoreserialdelays()
-            scriptrunning(false)
-        end
-    elseif curscript then
-        calloptscriptfunc("handlecmd", cmd, ...)
+        stopscript(name)
+    elseif cmd == "listscripts" then
+        listscripts()
+    elseif script then
+        calloptscriptfunc(script, "handlecmd", cmd, ...)
+        sched.post(script.task, cmd, ...) -- For waitmsg()
     end
 end
 
@@ -83,10 +152,12 @@ function setserialdelay(var, delay)
 end
 
 function initclient()
-    print("initclient:", tostring(curscript ~= nil))
-    scriptrunning(curscript ~= nil)
-    if curscript then
-        calloptscriptfunc("initclient")
+    print("initclient:", tostring(scripts[MAINSCRIPT] ~= nil))
+    scriptrunning(scripts[MAINSCRIPT] ~= nil)
+    if next(scripts) then
+        for _, script in pairs(scripts) do
+            calloptscriptfunc(script, "initclient")
+        end
     else
         restoreserialdelays()
     end
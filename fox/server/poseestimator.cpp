@@ -0,0 +1,190 @@
+#include <math.h>
+#include <string.h>
+
+#include "poseestimator.h"
+
+namespace {
+
+// Derived from the RP6 library defaults: ROTATION_FACTOR (688 counts per
+// 100 degrees) at ENCODER_RESOLUTION (0.23 mm). Slip of the tracks makes
+// this larger than the real distance between them.
+const float defaultWheelBase = 181.3f, defaultEncoderResolution = 0.23f;
+const float defaultErrorFactor = 0.1f; // ~4 degrees angle error per meter
+
+inline double radToDeg(double r) { return r * 180.0 / M_PI; }
+inline double degToRad(double d) { return d * M_PI / 180.0; }
+
+}
+
+CPoseEstimator::CPoseEstimator() : wheelBase(defaultWheelBase),
+                                   encoderResolution(defaultEncoderResolution),
+                                   errorFactor(defaultErrorFactor), pendingWheels(0),
+                                   updateTime(0), updates(0)
+{
+    for (int i=0; i<WHEEL_COUNT; ++i)
+    {
+        lastCount[i] = pendingCount[i] = 0;
+        lastDestDist[i] = destDist[i] = 0;
+        hasCount[i] = false;
+        forward[i] = true;
+    }
+
+    reset();
+}
+
+void CPoseEstimator::addMotorDist(int wheel, uint16_t count, uint32_t time)
+{
+    // Directions of the previous update never came
+    if (pendingWheels & (1 << wheel))
+        integratePending();
+
+    pendingCount[wheel] = count;
+    pendingWheels |= (1 << wheel);
+    updateTime = time;
+}
+
+void CPoseEstimator::integratePending()
+{
+    double dist[WHEEL_COUNT] = { 0.0, 0.0 };
+
+    for (int i=0; i<WHEEL_COUNT; ++i)
+    {
+        if (!(pendingWheels & (1 << i)))
+            continue;
+
+        const uint16_t count = pendingCount[i];
+        if (hasCount[i])
+        {
+            uint16_t delta = count - lastCount[i]; // Handles wrap around
+            // Reset by a new movement, counts from 0
+            if ((destDist[i] != lastDestDist[i]) || (delta > MAX_COUNT_JUMP))
+                delta = count;
+            dist[i] = delta * encoderResolution;
+            if (!forward[i])
+                dist[i] = -dist[i];
+        }
+
+        lastCount[i] = count;
+        hasCount[i] = true;
+    }
+
+    for (int i=0; i<WHEEL_COUNT; ++i)
+        lastDestDist[i] = destDist[i];
+    pendingWheels = 0;
+
+    integrate(dist[WHEEL_LEFT], dist[WHEEL_RIGHT]);
+}
+
+void CPoseEstimator::integrate(double dl, double dr)
+{
+    if ((dl == 0.0) && (dr == 0.0))
+        return;
+
+    ++updates;
+
+    // Midpoint integration. Clockwise rotation when the left wheel travels
+    // further, y points downwards.
+    const double ds = (dl + dr) / 2.0, da = (dl - dr) / wheelBase;
+    const double mida = angle + da / 2.0;
+    const double s = sin(mida), c = cos(mida);
+
+    x += ds * s;
+    y -= ds * c;
+    angle = fmod(angle + da, 2.0 * M_PI);
+    if (angle < 0.0)
+        angle += 2.0 * M_PI;
+
+    // P = Fp * P * Fp' + Fd * Q * Fd', Q = diag(k * |dl|, k * |dr|)
+    const double Fp[3][3] = { { 1.0, 0.0, ds * c },
+                              { 0.0, 1.0, ds * s },
+                              { 0.0, 0.0, 1.0 } };
+    const double hb = 0.5 / wheelBase;
+    const double Fd[3][2] = { { 0.5 * s + ds * c * hb, 0.5 * s - ds * c * hb },
+                              { -0.5 * c + ds * s * hb, -0.5 * c - ds * s * hb },
+                              { 1.0 / wheelBase, -1.0 / wheelBase } };
+    const double Q[2] = { errorFactor * fabs(dl), errorFactor * fabs(dr) };
+
+    double tmp[3][3], P[3][3];
+    for (int i=0; i<3; ++i)
+    {
+        for (int j=0; j<3; ++j)
+        {
+            tmp[i][j] = 0.0;
+            for (int k=0; k<3; ++k)
+                tmp[i][j] += Fp[i][k] * covariance[k][j];
+        }
+    }
+
+    for (int i=0; i<3; ++i)
+    {
+        for (int j=0; j<3; ++j)
+        {
+            P[i][j] = 0.0;
+            for (int k=0; k<3; ++k)
+                P[i][j] += tmp[i][k] * Fp[j][k];
+            for (int k=0; k<2; ++k)
+                P[i][j] += Fd[i][k] * Q[k] * Fd[j][k];
+        }
+    }
+
+    memcpy(covariance, P, sizeof(covariance));
+}
+
+void CPoseEstimator::setConfig(float wheelbase, float resolution, float error)
+{
+    wheelBase = wheelbase;
+    encoderResolution = resolution;
+    errorFactor = error;
+}
+
+void CPoseEstimator::reset(float px, float py, float pa)
+{
+    x = px * 10.0;
+    y = py * 10.0;
+    angle = degToRad(pa);
+    memset(covariance, 0, sizeof(covariance));
+
+    // Counters up to now are part of the old pose
+    for (int i=0; i<WHEEL_COUNT; ++i)
+    {
+        if (pendingWheels & (1 << i))
+        {
+            lastCount[i] = pendingCount[i];
+            hasCount[i] = true;
+        }
+        lastDestDist[i] = destDist[i];
+    }
+    pendingWheels = 0;
+    updateTime = 0;
+    ++updates;
+}
+
+void CPoseEstimator::setMotorDirections(const SMotorDirections &dir)
+{
+    forward[WHEEL_LEFT] = (dir.left != BWD);
+    forward[WHEEL_RIGHT] = (dir.right != BWD);
+
+    // Last frame of an update, the counters before it moved this way
+    if (pendingWheels)
+        integratePending();
+}
+
+SRobotPose CPoseEstimator::getPose() const
+{
+    SRobotPose ret;
+    ret.time = updateTime;
+    ret.x = x / 10.0;
+    ret.y = y / 10.0;
+    ret.angle = radToDeg(angle);
+
+    // mm -> cm, radians -> degrees
+    const double scale[3] = { 0.1, 0.1, radToDeg(1.0) };
+    ret.covariance[SRobotPose::COV_XX] = covariance[0][0] * scale[0] * scale[0];
+    ret.covariance[SRobotPose::COV_XY] = covariance[0][1] * scale[0] * scale[1];
+    ret.covariance[SRobotPose::COV_XA] = covariance[0][2] * scale[0] * scale[2];
+    ret.covariance[SRobotPose::COV_YY] = covariance[1][1] * scale[1] * scale[1];
+    ret.covariance[SRobotPose::COV_YA] = covariance[1][2] * scale[1] * scale[2];
+    ret.covariance[SRobotPose::COV_AA] = covariance[2][2] * scale[2] * scale[2];
+
+    return ret;
+}
@@ -0,0 +1,64 @@
+#ifndef POSEESTIMATOR_H
+#define POSEESTIMATOR_H
+
+#include <stdint.h>
+
+#include "tcputil.h"
+
+// Dead reckoning from the wheel encoder counters sent by the m32
+// (SERIAL_MOTOR_DIST_*). The counters count up regardless of direction,
+// directions are taken from SERIAL_MOTOR_DIRECTIONS. The m32 sends these
+// after the counters of the same update, so counters are integrated once the
+// directions arrived (or when the next counters arrive without them).
+// Every move or rotate resets the counters and sets a new destination
+// distance (SERIAL_MOTOR_DESTDIST_*), a changed destination or a counter
+// that went back marks a reset.
+// The covariance grows with the usual differential drive error model: the
+// variance of each wheel distance is proportional to the distance travelled.
+class CPoseEstimator
+{
+    enum { WHEEL_LEFT=0, WHEEL_RIGHT, WHEEL_COUNT };
+    // Larger jumps can only be a reset counter that went back (~1 m with
+    // default resolution)
+    enum { MAX_COUNT_JUMP = 4096 };
+
+    float wheelBase, encoderResolution, errorFactor; // mm, mm/count, mm
+    double x, y, angle; // mm, mm, radians (clockwise, 0 == up)
+    double covariance[3][3];
+    uint16_t lastCount[WHEEL_COUNT], pendingCount[WHEEL_COUNT]; // Not integrated yet
+    uint16_t lastDestDist[WHEEL_COUNT], destDist[WHEEL_COUNT];
+    bool hasCount[WHEEL_COUNT];
+    bool forward[WHEEL_COUNT];
+    int pendingWheels; // Bit mask
+    uint32_t updateTime;
+    uint32_t updates;
+
+    void addMotorDist(int wheel, uint16_t count, uint32_t time);
+    void integratePending(void);
+    void integrate(double dl, double dr);
+
+public:
+    CPoseEstimator(void);
+
+    // wheelbase: mm, resolution: mm per encoder count, error: variance
+    // (mm^2) per mm a wheel travelled
+    void setConfig(float wheelbase, float resolution, float error);
+    float getWheelBase(void) const { return wheelBase; }
+    float getEncoderResolution(void) const { return encoderResolution; }
+    float getErrorFactor(void) const { return errorFactor; }
+
+    // x, y in cm, angle in degrees (see SRobotPose). Clears the covariance.
+    void reset(float x=0.0f, float y=0.0f, float angle=0.0f);
+
+    void addMotorDistLeft(uint16_t count, uint32_t time) { addMotorDist(WHEEL_LEFT, count, time); }
+    void addMotorDistRight(uint16_t count, uint32_t time) { addMotorDist(WHEEL_RIGHT, count, time); }
+    void setMotorDestDistLeft(uint16_t dist) { destDist[WHEEL_LEFT] = dist; }
+    void setMotorDestDistRight(uint16_t dist) { destDist[WHEEL_RIGHT] = dist; }
+    void setMotorDirections(const SMotorDirections &dir);
+
+    SRobotPose getPose(void) const;
+    // Increased whenever the pose changed, to check for new data cheaply
+    uint32_t getUpdates(void) const { return updates; }
+};
+
+#endif
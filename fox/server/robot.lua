@@ -41,11 +41,11 @@ function driverotatetime(angle, speed)
 end
 
 function motor.setspeed(left, right)
-    exec(string.format("set speed %d %d", left, right))
+    exec(string.format("set speed %d %d", left, right), "speed")
 end
 
 function motor.setdir(dir)
-    exec("set dir " .. dir)
+    exec("set dir " .. dir, "dir")
 end
 
 function motor.stop()
@@ -53,19 +53,19 @@ function motor.stop()
 end
 
 function setbaseleds(s)
-    exec(string.format("set leds1 %s", s))
+    exec(string.format("set leds1 %s", s), "leds1")
 end
 
 function setm32leds(s)
-    exec(string.format("set leds2 %s", s))
+    exec(string.format("set leds2 %s", s), "leds2")
 end
 
 function setacs(s)
-    exec(string.format("set acs %s", s))
+    exec(string.format("set acs %s", s), "acs")
 end
 
 function setservo(angle)
-    exec(string.format("set servo %d", angle))
+    exec(string.format("set servo %d", angle), "servo")
 end
 
 function beep(pitch, time)
@@ -0,0 +1,276 @@
+#include <QtCore>
+
+#include "scriptstore.h"
+
+CScriptStore::CScriptStore(const QString &dir) : directory(dir), indexLoaded(false)
+{
+}
+
+QString CScriptStore::getScriptPath(const QByteArray &hash) const
+{
+    return QString("%1/%2.lua").arg(directory).arg(QString(hash));
+}
+
+QString CScriptStore::getBytecodePath(const QByteArray &hash) const
+{
+    return QString("%1/cache/%2.luac").arg(directory).arg(QString(hash));
+}
+
+void CScriptStore::loadIndex()
+{
+    if (indexLoaded)
+        return;
+
+    indexLoaded = true;
+
+    if (!QDir().mkpath(directory + "/cache"))
+        qWarning() << "Failed to create script directory" << directory;
+
+    QFile file(directory + "/index");
+    if (file.open(QFile::ReadOnly))
+    {
+        // Every line: <hash> <name>
+        while (!file.atEnd())
+        {
+            const QByteArray line(file.readLine().trimmed());
+            const int sep = line.indexOf(' ');
+            if (sep == -1)
+                continue;
+            index[QString::fromUtf8(line.mid(sep + 1))] = line.left(sep);
+        }
+    }
+
+    importSettings();
+}
+
+void CScriptStore::saveIndex()
+{
+    // Replace the index at once, so a crash can't leave half of it
+    const QString path(directory + "/index"), tmppath(path + ".tmp");
+    QFile file(tmppath);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate))
+    {
+        qWarning() << "Failed to write script index" << tmppath;
+        return;
+    }
+
+    for (TIndex::iterator it=index.begin(); it!=index.end(); ++it)
+        file.write(it.value() + ' ' + it.key().toUtf8() + '\n');
+    file.close();
+
+    QFile::remove(path);
+    if (!QFile::rename(tmppath, path))
+        qWarning() << "Failed to replace script index" << path;
+}
+
+void CScriptStore::importSettings()
+{
+    // Scripts used to be stored as one settings value
+    QSettings settings;
+    if (!settings.contains("scripts"))
+        return;
+
+    const QMap<QString, QVariant> scripts(settings.value("scripts").toMap());
+    for (QMap<QString, QVariant>::const_iterator it=scripts.begin(); it!=scripts.end(); ++it)
+        storeScript(it.key(), it.value().toByteArray());
+
+    saveIndex();
+    settings.remove("scripts");
+
+    qDebug() << "Imported" << scripts.size() << "scripts from settings";
+}
+
+void CScriptStore::storeScript(const QString &name, const QByteArray &script)
+{
+    const QByteArray hash(getHash(script));
+    const QString path(getScriptPath(hash));
+
+    if (!QFile::exists(path)) // Otherwise another name has the same script
+    {
+        QFile file(path);
+        if (!file.open(QFile::WriteOnly | QFile::Truncate) ||
+            (file.write(script) != script.size()))
+        {
+            qWarning() << "Failed to write script" << path;
+            return;
+        }
+    }
+
+    const QByteArray oldhash(index.value(name));
+    index[name] = hash;
+    if (!oldhash.isEmpty() && (oldhash != hash))
+        removeUnusedFiles(oldhash);
+}
+
+void CScriptStore::removeUnusedFiles(const QByteArray &hash)
+{
+    if (index.values().contains(hash))
+        return;
+
+    QFile::remove(getScriptPath(hash));
+    QFile::remove(getBytecodePath(hash));
+    bytecodeCache.remove(hash);
+}
+
+int CScriptStore::dumpWriter(lua_State *, const void *p, size_t size, void *ud)
+{
+    static_cast<QByteArray *>(ud)->append(static_cast<const char *>(p), size);
+    return 0;
+}
+
+bool CScriptStore::loadBytecodeCache(const QByteArray &hash, lua_State *l, QByteArray &bytecode)
+{
+    QFile file(getBytecodePath(hash));
+    if (!file.open(QFile::ReadOnly))
+        return false;
+
+    bytecode = file.readAll();
+    file.close();
+
+    // Check that the cache is complete and fits this Lua version. An empty
+    // or cut off file would otherwise be loaded as (empty) source.
+    bool valid = bytecode.startsWith(LUA_SIGNATURE);
+    if (valid)
+    {
+        valid = !luaL_loadbuffer(l, bytecode.constData(), bytecode.size(), "=cache");
+        lua_pop(l, 1); // Function or error
+    }
+
+    if (!valid)
+    {
+        qWarning() << "Bytecode cache" << file.fileName() << "is invalid, recompiling";
+        QFile::remove(file.fileName());
+        bytecode.clear();
+    }
+
+    return valid;
+}
+
+void CScriptStore::saveBytecodeCache(const QByteArray &hash, const QByteArray &bytecode)
+{
+    // Replace the file at once, like the index, so a crash can't leave a
+    // truncated cache
+    const QString path(getBytecodePath(hash)), tmppath(path + ".tmp");
+    QFile file(tmppath);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate) ||
+        (file.write(bytecode) != bytecode.size()))
+    {
+        qWarning() << "Failed to write bytecode cache" << tmppath;
+        file.close();
+        QFile::remove(tmppath);
+        return;
+    }
+    file.close();
+
+    QFile::remove(path);
+    if (!QFile::rename(tmppath, path))
+        qWarning() << "Failed to replace bytecode cache" << path;
+}
+
+QByteArray CScriptStore::getHash(const QByteArray &script)
+{
+    return QCryptographicHash::hash(script, QCryptographicHash::Sha1).toHex();
+}
+
+CScriptStore::TIndex CScriptStore::getIndex()
+{
+    QMutexLocker lock(&mutex);
+    loadIndex();
+    return index;
+}
+
+bool CScriptStore::contains(const QString &name)
+{
+    QMutexLocker lock(&mutex);
+    loadIndex();
+    return index.contains(name);
+}
+
+QByteArray CScriptStore::getScript(const QString &name)
+{
+    QMutexLocker lock(&mutex);
+    loadIndex();
+
+    if (!index.contains(name))
+        return QByteArray();
+
+    QFile file(getScriptPath(index[name]));
+    if (!file.open(QFile::ReadOnly))
+    {
+        qWarning() << "Failed to read script" << file.fileName();
+        return QByteArray();
+    }
+
+    return file.readAll();
+}
+
+QByteArray CScriptStore::getBytecode(const QString &name, lua_State *l)
+{
+    QMutexLocker lock(&mutex);
+    loadIndex();
+
+    if (!index.contains(name))
+        return QByteArray();
+
+    const QByteArray hash(index[name]);
+    QHash<QByteArray, QByteArray>::const_iterator it = bytecodeCache.find(hash);
+    if (it != bytecodeCache.end())
+        return it.value();
+
+    QByteArray bytecode;
+    if (loadBytecodeCache(hash, l, bytecode))
+    {
+        bytecodeCache[hash] = bytecode;
+        return bytecode;
+    }
+
+    QFile file(getScriptPath(hash));
+    if (!file.open(QFile::ReadOnly))
+    {
+        qWarning() << "Failed to read script" << file.fileName();
+        return QByteArray();
+    }
+
+    const QByteArray script(file.readAll());
+    const QByteArray chunkname("=" + name.toUtf8()); // Used in error messages
+
+    if (luaL_loadbuffer(l, script.constData(), script.size(), chunkname.constData()))
+    {
+        lua_pop(l, 1); // Error is reported when the script is run
+        return script;
+    }
+
+    lua_dump(l, dumpWriter, &bytecode);
+    lua_pop(l, 1);
+
+    saveBytecodeCache(hash, bytecode);
+    bytecodeCache[hash] = bytecode;
+    return bytecode;
+}
+
+void CScriptStore::setScript(const QString &name, const QByteArray &script)
+{
+    if (name.isEmpty() || name.contains('\n'))
+    {
+        qWarning() << "Invalid script name" << name;
+        return;
+    }
+
+    QMutexLocker lock(&mutex);
+    loadIndex();
+    storeScript(name, script);
+    saveIndex();
+}
+
+void CScriptStore::removeScript(const QString &name)
+{
+    QMutexLocker lock(&mutex);
+    loadIndex();
+
+    if (!index.contains(name))
+        return;
+
+    const QByteArray hash(index.take(name));
+    removeUnusedFiles(hash);
+    saveIndex();
+}
@@ -0,0 +1,57 @@
+#ifndef SCRIPTSTORE_H
+#define SCRIPTSTORE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QMap>
+#include <QMutex>
+#include <QString>
+
+#include <lua.hpp>
+
+// Scripts uploaded by clients. Every script is stored in its own file, named
+// after the SHA-1 hash of its contents, an index maps script names to hashes.
+// Nothing is read before the store is used and scripts themselves are only
+// read when requested. Compiled bytecode is cached on disk by hash, so a
+// script is only parsed once after it changed.
+// The store is shared by all robots, all functions are thread safe.
+class CScriptStore
+{
+public:
+    typedef QMap<QString, QByteArray> TIndex; // Name -> hash (hex)
+
+private:
+    QString directory;
+    TIndex index;
+    bool indexLoaded;
+    QHash<QByteArray, QByteArray> bytecodeCache; // Hash -> bytecode
+    mutable QMutex mutex;
+
+    QString getScriptPath(const QByteArray &hash) const;
+    QString getBytecodePath(const QByteArray &hash) const;
+    void loadIndex(void);
+    void saveIndex(void);
+    void importSettings(void);
+    void storeScript(const QString &name, const QByteArray &script);
+    void removeUnusedFiles(const QByteArray &hash);
+    bool loadBytecodeCache(const QByteArray &hash, lua_State *l, QByteArray &bytecode);
+    void saveBytecodeCache(const QByteArray &hash, const QByteArray &bytecode);
+
+    static int dumpWriter(lua_State *l, const void *p, size_t size, void *ud);
+
+public:
+    CScriptStore(const QString &dir);
+
+    static QByteArray getHash(const QByteArray &script);
+
+    TIndex getIndex(void);
+    bool contains(const QString &name);
+    QByteArray getScript(const QString &name);
+    // Compiles the script with l unless it's cached. Returns the source if it
+    // doesn't compile, so that running it reports the error.
+    QByteArray getBytecode(const QString &name, lua_State *l);
+    void setScript(const QString &name, const QByteArray &script);
+    void removeScript(const QString &name);
+};
+
+#endif
@@ -1,132 +1,585 @@
 #include <assert.h>
+#include <string.h>
+#include <sys/time.h>
 
 #include <QtCore>
 
 #include "qextserialport.h"
 #include "serial.h"
+#include "serialcommand.h"
+#include "timeutil.h"
 
-CSerialPort::CSerialPort(QObject *parent, const QString &port) : QObject(parent)
+void CSerialWorker::SCommandLatency::add(uint32_t l)
 {
-    serialPort = new QextSerialPort(port, QextSerialPort::EventDriven);
-    serialPort->setParent(this);
-    serialPort->setBaudRate(BAUD38400);
-    serialPort->setFlowControl(FLOW_OFF);
-    serialPort->setParity(PAR_NONE);
-    serialPort->setDataBits(DATA_8);
-    serialPort->setStopBits(STOP_1);
-    
-    if (serialPort->open(QIODevice::ReadWrite) == true)
+    if (!count || (l < min))
+        min = l;
+    if (l > max)
+        max = l;
+    last = l;
+    total += l;
+    ++count;
+}
+
+CSerialWorker::CSerialWorker(CSerialPort *s, const QString &p, bool lowlat)
+    : serialPort(s), portName(p), lowLatency(lowlat), port(0), commandProcessTimer(0),
+      retransmitTimer(0), statsTimer(0), lastFrameCount(0), framesPerSec(0), parseTimeUS(0),
+      wakeups(0), lastWakeups(0), framesPerWakeup(0.0f), droppedFrames(0),
+      droppedLines(0), receiveSequence(0), inFlightStart(0), inFlightCount(0), pendingStart(0),
+      pendingCount(0), preemptedCommands(0), nextSequence(0), textCommandDelay(false),
+      commandsSent(0), retransmits(0), droppedCommands(0)
+{
+    memset(coalescedCommands, 0, sizeof(coalescedCommands));
+}
+
+uint8_t CSerialWorker::getNextSequence()
+{
+    // 0 is only used to (re)start the sequence
+    const uint8_t ret = nextSequence;
+    nextSequence = (ret == 255) ? 1 : (ret + 1);
+    return ret;
+}
+
+void CSerialWorker::sendInFlight(SInFlightCommand &command)
+{
+    command.sendTime = getTimeUS();
+    port->write(command.data, command.size);
+
+    if (!retransmitTimer->isActive())
+        retransmitTimer->start(COMMAND_TIMEOUT / 4);
+}
+
+void CSerialWorker::handleAck(uint8_t seq)
+{
+    int acked = 0;
+    while ((acked < inFlightCount) && (getInFlight(acked).sequence != seq))
+        ++acked;
+
+    if (acked == inFlightCount)
+        return; // Old or unknown sequence
+
+    // Acks are cumulative
+    const uint64_t time = getTimeUS();
+    for (; acked >= 0; --acked)
     {
-        connect(serialPort, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+        const SInFlightCommand &command = getInFlight(0);
+        commandLatency[getSerialCommandOpcode(command.data)].add(time - command.sendTime);
+        popInFlight();
+    }
+
+    if (!inFlightCount)
+        retransmitTimer->stop();
+
+    processCommandQueue();
+}
+
+void CSerialWorker::open()
+{
+    // Called from the serial thread, so all port notifications end up there
+    port = new QextSerialPort(portName, QextSerialPort::EventDriven);
+    port->setParent(this);
+    port->setBaudRate(BAUD38400);
+    port->setFlowControl(FLOW_OFF);
+    port->setParity(PAR_NONE);
+    port->setDataBits(DATA_8);
+    port->setStopBits(STOP_1);
+    port->setLowLatency(lowLatency);
+
+    // Unbuffered: read straight from the port's buffer into the parser
+    if (port->open(QIODevice::ReadWrite | QIODevice::Unbuffered) == true)
+    {
+        connect(port, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
         //        connect(port, SIGNAL(dsrChanged(bool)), this, SLOT(onDsrChanged(bool)));
-        if (!(serialPort->lineStatus() & LS_DSR))
+        if (!(port->lineStatus() & LS_DSR))
             qDebug() << "warning: device is not turned on";
-        qDebug() << "listening for data on" << serialPort->portName();
+        qDebug() << "listening for data on" << port->portName();
     }
     else
-        qDebug() << "device failed to open:" << serialPort->errorString();
-    
-    serialPort->setDtr(false);
-    serialPort->setRts(false);
+        qDebug() << "device failed to open:" << port->errorString();
+
+    port->setDtr(false);
+    port->setRts(false);
 
     commandProcessTimer = new QTimer(this);
+    commandProcessTimer->setSingleShot(true);
     connect(commandProcessTimer, SIGNAL(timeout()), this,
-            SLOT(processCommandQueue()));
+            SLOT(textCommandDelayDone()));
+
+    retransmitTimer = new QTimer(this);
+    connect(retransmitTimer, SIGNAL(timeout()), this, SLOT(checkRetransmit()));
+
+    statsTimer = new QTimer(this);
+    connect(statsTimer, SIGNAL(timeout()), this, SLOT(updateStats()));
+    statsTimer->start(1000);
 }
 
-void CSerialPort::onReadyRead()
+void CSerialWorker::close()
 {
-    QByteArray bytes;
-    int a = serialPort->bytesAvailable();
-    bytes.resize(a);
-    if (serialPort->read(bytes.data(), bytes.size()) == -1)
-        return;
+    // Port and timers have to be destroyed in the thread they live in
+    delete port;
+    delete commandProcessTimer;
+    delete retransmitTimer;
+    delete statsTimer;
+    port = 0;
+    commandProcessTimer = retransmitTimer = statsTimer = 0;
+}
 
-    // For easy msg parsing
-    msgBuffer += bytes;
+void CSerialWorker::onReadyRead()
+{
+    timeval start, end;
+    gettimeofday(&start, NULL);
 
-    // Format:
-    //  0: Start marker
-    //  1: Msg size
-    //  2: Msg type
-    //  n: Data
-    int index = msgBuffer.indexOf(SERIAL_MSG_START);
+    bool pushed = false;
+    ++wakeups;
 
-    if (index == -1)
+    forever
     {
-        qDebug() << "raw" << msgBuffer;
-        // Only raw text
-        textBuffer += msgBuffer;
-        msgBuffer.clear();
-    }
-    else
-    {
-        while (index != -1)
+        int space;
+        char *buf = parser.getWriteBuffer(space);
+        const qint64 bytes = (space > 0) ? port->read(buf, space) : 0;
+
+        if (bytes > 0)
+            parser.commit(bytes);
+
+        const uint32_t time = getTimeMS();
+        CSerialParser::SToken token;
+        while (parser.next(token))
         {
-            if (index > 0) // Text in between?
+            if ((token.type == CSerialParser::TOKEN_FRAME) && (token.msg == SERIAL_CMD_ACK))
             {
-                // Raw text
-                textBuffer += msgBuffer.left(index);
-                msgBuffer.remove(0, index);
+                if (token.size > 0)
+                    handleAck(token.data[0]);
+                continue;
             }
+            else if (token.type == CSerialParser::TOKEN_FRAME)
+            {
+                CSerialPort::SFrame *frame = serialPort->frameQueue.getWriteSlot();
+                if (!frame)
+                {
+                    ++droppedFrames;
+                    continue;
+                }
 
-            int nextbytes = msgBuffer.size() - 1;
-            if (nextbytes < 1)
-                break; // Wait for more bytes
-                
-            int msgsize = msgBuffer[1];
-            
-            if ((nextbytes-1) < msgsize)
-                break; // Wait for more bytes
-
-            emit msgAvailable(static_cast<ESerialMessage>((int)msgBuffer[2]),
-                              msgBuffer.mid(3, msgsize));
-            msgBuffer.remove(0, 2 + msgsize);
-            
-            index = msgBuffer.indexOf(SERIAL_MSG_START);
-
-            // Add any remaining text to raw text buffer
-            if (index == -1)
+                frame->sequence = receiveSequence++;
+                frame->msg = token.msg;
+                frame->time = time;
+                frame->size = token.size;
+                memcpy(frame->data, token.data, token.size);
+                serialPort->frameQueue.push();
+            }
+            else
             {
-                textBuffer += msgBuffer;
-                msgBuffer.clear();
+                CSerialPort::SText *text = serialPort->textQueue.getWriteSlot();
+                if (!text)
+                {
+                    ++droppedLines;
+                    continue;
+                }
+
+                text->sequence = receiveSequence++;
+                text->size = token.size;
+                memcpy(text->data, token.data, token.size);
+                serialPort->textQueue.push();
             }
+
+            pushed = true;
+        }
+
+        // Less than requested: nothing left
+        if ((bytes <= 0) || (bytes < space))
+            break;
+    }
+
+    // Only notify if the control loop didn't get a notification yet
+    if (pushed && serialPort->dataPending.testAndSetOrdered(0, 1))
+        QMetaObject::invokeMethod(serialPort, "processSerialData", Qt::QueuedConnection);
+
+    gettimeofday(&end, NULL);
+    parseTimeUS += ((end.tv_sec - start.tv_sec) * 1000000) + (end.tv_usec - start.tv_usec);
+}
+
+void CSerialWorker::updateStats()
+{
+    const uint32_t frames = parser.getStats().frames;
+    framesPerSec = frames - lastFrameCount;
+    lastFrameCount = frames;
+    const uint32_t w = wakeups - lastWakeups;
+    framesPerWakeup = (w) ? (static_cast<float>(framesPerSec) / w) : 0.0f;
+    lastWakeups = wakeups;
+
+    QMutexLocker lock(&statsMutex);
+    stats.parser = parser.getStats();
+    stats.framesPerSec = framesPerSec;
+    stats.parseTimeUS = parseTimeUS;
+    stats.wakeups = wakeups;
+    stats.readCalls = (port) ? port->readStats().reads : 0;
+    stats.framesPerWakeup = framesPerWakeup;
+    stats.droppedFrames = droppedFrames;
+    stats.droppedLines = droppedLines;
+    stats.commandsSent = commandsSent;
+    stats.retransmits = retransmits;
+    stats.droppedCommands = droppedCommands;
+    for (int i=0; i<SERIAL_CMD_MAX_INDEX; ++i)
+        stats.commandLatency[i] = commandLatency[i];
+    for (int i=0; i<SSerialCommand::MAX_KEYS; ++i)
+        stats.coalescedCommands[i] = coalescedCommands[i];
+    stats.priorityLatency = priorityLatency;
+    stats.preemptedCommands = preemptedCommands;
+}
+
+void CSerialWorker::disableRTS()
+{
+    port->setRts(false);
+}
+
+void CSerialWorker::popInFlight()
+{
+    inFlightStart = (inFlightStart + 1) % (COMMAND_WINDOW + 1);
+    --inFlightCount;
+}
+
+void CSerialWorker::popPending()
+{
+    pendingStart = (pendingStart + 1) % MAX_PENDING_COMMANDS;
+    --pendingCount;
+}
+
+void CSerialWorker::takeQueuedCommands()
+{
+    while (SSerialCommand *command = serialPort->commandQueue.front())
+    {
+        // Find a pending command with the same key. Commands without a key
+        // (e.g. stop or move) act as barriers, so that commands don't get
+        // reordered around them.
+        int i = pendingCount;
+        if (command->key != -1)
+        {
+            for (int j=pendingCount-1; (j >= 0) && (getPending(j).key != -1); --j)
+            {
+                if (getPending(j).key == command->key)
+                {
+                    i = j;
+                    break;
+                }
+            }
+        }
+
+        if (i < pendingCount)
+            ++coalescedCommands[command->key]; // Replace in place
+        else if (pendingCount < MAX_PENDING_COMMANDS)
+            ++pendingCount;
+        else
+            break; // Full, leave the rest in the queue
+
+        SSerialCommand &pending = getPending(i);
+        pending.size = command->size;
+        pending.key = command->key;
+        pending.queueTime = command->queueTime;
+        memcpy(pending.data, command->data, command->size);
+        serialPort->commandQueue.pop();
+    }
+}
+
+void CSerialWorker::preemptMotionCommands(uint64_t time)
+{
+    // Remove motion commands queued before time, keeping the rest in order
+    int kept = 0;
+    for (int i=0; i<pendingCount; ++i)
+    {
+        SSerialCommand &command = getPending(i);
+        if ((command.queueTime <= time) && isMotionSerialCommand(command.data))
+        {
+            ++preemptedCommands;
+            continue;
+        }
+
+        if (kept != i)
+        {
+            SSerialCommand &dest = getPending(kept);
+            dest.size = command.size;
+            dest.key = command.key;
+            dest.queueTime = command.queueTime;
+            memcpy(dest.data, command.data, command.size);
+        }
+        ++kept;
+    }
+    pendingCount = kept;
+}
+
+void CSerialWorker::sendBinaryCommand(const SSerialCommand &command)
+{
+    SInFlightCommand &inf = getInFlight(inFlightCount++);
+    inf.size = command.size;
+    memcpy(inf.data, command.data, command.size);
+    inf.sequence = getNextSequence();
+    inf.retries = 0;
+    setSerialCommandSequence(inf.data, inf.sequence);
+
+    sendInFlight(inf);
+    ++commandsSent;
+}
+
+void CSerialWorker::processPriorityCommands()
+{
+    while (const SSerialCommand *command = serialPort->priorityQueue.front())
+    {
+        // Motion commands queued before this one are obsolete
+        takeQueuedCommands();
+        preemptMotionCommands(command->queueTime);
+
+        if (!isBinarySerialCommand(command->data))
+        {
+            // Text only mode: can't be acknowledged, just send it
+            port->write(command->data, command->size);
+            ++commandsSent;
         }
+        else if (inFlightCount <= COMMAND_WINDOW) // May use the extra slot
+            sendBinaryCommand(*command);
+        else
+            break; // Try again when acknowledged
+
+        const uint32_t latency = getTimeUS() - command->queueTime;
+        priorityLatency.add(latency);
+        if (latency > (PRIORITY_LATENCY_TARGET * 1000))
+            qWarning() << "[serial] Priority command took" << latency / 1000.0 << "ms to send";
+        serialPort->priorityQueue.pop();
     }
+}
+
+void CSerialWorker::processCommandQueue()
+{
+    processPriorityCommands();
+    takeQueuedCommands();
 
-    index = textBuffer.indexOf('\n');
-    while (index != -1)
+    while (!textCommandDelay && pendingCount)
     {
-        emit textAvailable(textBuffer.left(index)); // Emit without newline
-        textBuffer.remove(0, index+1);
-        index = textBuffer.indexOf('\n');
+        const SSerialCommand *command = &getPending(0);
+
+        if (!isBinarySerialCommand(command->data))
+        {
+            if (inFlightCount)
+                break; // Wait until all binary commands are acknowledged
+
+            port->write(command->data, command->size);
+            popPending();
+            ++commandsSent;
+            textCommandDelay = true;
+            commandProcessTimer->start(TEXT_COMMAND_DELAY);
+            break;
+        }
+
+        if (inFlightCount >= COMMAND_WINDOW)
+            break;
+
+        sendBinaryCommand(*command);
+        popPending();
+
+        takeQueuedCommands(); // Room for more?
     }
 }
 
-void CSerialPort::disableRTS()
+void CSerialWorker::textCommandDelayDone()
 {
-    serialPort->setRts(false);
+    textCommandDelay = false;
+    processCommandQueue();
 }
 
-void CSerialPort::processCommandQueue()
+void CSerialWorker::checkRetransmit()
 {
-    QString command = commandQueue.dequeue();
-    serialPort->write((command + "\n").toLatin1());
+    if (!inFlightCount)
+    {
+        retransmitTimer->stop();
+        return;
+    }
 
-    if (commandQueue.isEmpty())
-        commandProcessTimer->stop();
+    SInFlightCommand &oldest = getInFlight(0);
+    if ((getTimeUS() - oldest.sendTime) < (COMMAND_TIMEOUT * 1000))
+        return;
+
+    if (++oldest.retries > COMMAND_RETRIES)
+    {
+        qWarning() << "Dropping unacknowledged serial command:" <<
+                      getSerialCommandName(getSerialCommandOpcode(oldest.data));
+        ++droppedCommands;
+        popInFlight();
+
+        // The m32 still waits for the dropped command: restart the sequence
+        nextSequence = 0;
+        for (int i=0; i<inFlightCount; ++i)
+        {
+            SInFlightCommand &command = getInFlight(i);
+            command.sequence = getNextSequence();
+            setSerialCommandSequence(command.data, command.sequence);
+        }
+    }
+
+    // Go back N: send all unacknowledged commands again, in order
+    for (int i=0; i<inFlightCount; ++i)
+    {
+        sendInFlight(getInFlight(i));
+        ++retransmits;
+    }
+
+    if (!inFlightCount)
+    {
+        retransmitTimer->stop();
+        processCommandQueue();
+    }
+}
+
+void CSerialWorker::commandsQueued()
+{
+    processCommandQueue();
+}
+
+void CSerialWorker::restartCommands()
+{
+    if (inFlightCount)
+    {
+        qWarning() << "Dropping" << inFlightCount << "unacknowledged serial commands after restart";
+        droppedCommands += inFlightCount;
+        inFlightStart = inFlightCount = 0;
+    }
+
+    // Pending commands get their sequence when they are sent
+    nextSequence = 0;
+    if (retransmitTimer)
+        retransmitTimer->stop();
+    processCommandQueue();
+}
+
+void CSerialWorker::resetRP6()
+{
+    restartCommands();
+    port->setRts(true);
+    QTimer::singleShot(100, this, SLOT(disableRTS()));
+}
+
+CSerialWorker::SStats CSerialWorker::getStats() const
+{
+    QMutexLocker lock(&statsMutex);
+    return stats;
+}
+
+
+CSerialPort::CSerialPort(QObject *parent, const QString &port, bool lowlatency)
+    : QObject(parent), dataPending(0), binaryCommands(true)
+{
+    thread = new QThread(this);
+    worker = new CSerialWorker(this, port, lowlatency);
+    worker->moveToThread(thread);
+    thread->start(QThread::HighPriority);
+    QMetaObject::invokeMethod(worker, "open", Qt::QueuedConnection);
+}
+
+CSerialPort::~CSerialPort()
+{
+    QMetaObject::invokeMethod(worker, "close", Qt::BlockingQueuedConnection);
+    thread->quit();
+    thread->wait();
+    delete worker;
+}
+
+void CSerialPort::processSerialData()
+{
+    // Clear first: anything pushed from now on will notify again
+    dataPending.fetchAndStoreOrdered(0);
+
+    // Merge both queues in the order the items were received
+    while (true)
+    {
+        SText *text = textQueue.front();
+        SFrame *frame = frameQueue.front();
+
+        // Text pushed before this frame may have arrived after the text
+        // queue was checked. Items are pushed in order, so a frame can't
+        // be missed this way.
+        if (!text && frame)
+            text = textQueue.front();
+
+        if (text && (!frame || (static_cast<int32_t>(text->sequence - frame->sequence) < 0)))
+        {
+            emit textAvailable(QByteArray(text->data, text->size));
+            textQueue.pop();
+        }
+        else if (frame)
+        {
+            emit msgAvailable(frame->msg, QByteArray::fromRawData(frame->data, frame->size),
+                              frame->time);
+            frameQueue.pop();
+        }
+        else
+            break;
+    }
 }
 
 void CSerialPort::resetRP6()
 {
-    serialPort->setRts(true);
-    QTimer::singleShot(100, this, SLOT(disableRTS));
+    QMetaObject::invokeMethod(worker, "resetRP6", Qt::QueuedConnection);
+}
+
+void CSerialPort::restartCommands()
+{
+    QMetaObject::invokeMethod(worker, "restartCommands", Qt::QueuedConnection);
 }
 
-void CSerialPort::sendCommand(const QString &command)
+void CSerialPort::sendCommand(const QString &command, const QString &key, uint64_t time)
 {
-    commandQueue.enqueue(command);
+    const QByteArray cmd(command.toLatin1());
+
+    // Leave room for the newline
+    if (cmd.size() >= SSerialCommand::MAX_SIZE)
+    {
+        qWarning() << "Dropping serial command:" << command;
+        return;
+    }
+
+    SSerialCommand serialcmd;
+    serialcmd.queueTime = (time) ? time : getTimeUS();
+    serialcmd.key = -1;
+    if (!key.isEmpty())
+    {
+        QHash<QString, int>::iterator it = commandKeys.find(key);
+        if (it != commandKeys.end())
+            serialcmd.key = it.value();
+        else if (commandKeyNames.size() < SSerialCommand::MAX_KEYS)
+        {
+            serialcmd.key = commandKeyNames.size();
+            commandKeys[key] = serialcmd.key;
+            commandKeyNames << key;
+        }
+        else
+            qWarning() << "Too many command keys, not coalescing" << key;
+    }
+
+    serialcmd.size = (binaryCommands) ? encodeSerialCommand(cmd, serialcmd.data) : 0;
+    bool priority;
+    if (serialcmd.size)
+        priority = (getSerialCommandOpcode(serialcmd.data) == SERIAL_CMD_STOP);
+    else // Send as text
+    {
+        memcpy(serialcmd.data, cmd.constData(), cmd.size());
+        serialcmd.data[cmd.size()] = '\n';
+        serialcmd.size = cmd.size() + 1;
+        priority = (cmd.trimmed() == "stop");
+    }
+
+    // Stop commands skip the queue
+    SSerialCommand *slot = (priority) ? priorityQueue.getWriteSlot() : commandQueue.getWriteSlot();
+    if (!slot)
+    {
+        qWarning() << "Dropping serial command:" << command;
+        return;
+    }
+
+    slot->size = serialcmd.size;
+    slot->key = serialcmd.key;
+    slot->queueTime = serialcmd.queueTime;
+    memcpy(slot->data, serialcmd.data, serialcmd.size);
+
+    if (priority)
+        priorityQueue.push();
+    else
+        commandQueue.push();
 
-    if (!commandProcessTimer->isActive())
-        commandProcessTimer->start(25); // Execute console commands every 25 msec
+    QMetaObject::invokeMethod(worker, "commandsQueued", Qt::QueuedConnection);
 }
@@ -1,40 +1,223 @@
 #ifndef SERIAL_H
 #define SERIAL_H
 
+#include <string.h>
+
+#include <QHash>
+#include <QMutex>
 #include <QObject>
-#include <QQueue>
+#include <QStringList>
 
+#include "serialparser.h"
 #include "shared.h"
+#include "spscqueue.h"
 
+class QThread;
 class QTimer;
 
 class QextSerialPort;
 
-class CSerialPort: public QObject
+class CSerialPort;
+
+// Queued command, either text (including newline) or a binary frame
+struct SSerialCommand
+{
+    enum { MAX_SIZE = 128, MAX_KEYS = 32 };
+
+    int size;
+    int key; // Coalescing key, -1 if none
+    uint64_t queueTime; // getTimeUS()
+    char data[MAX_SIZE];
+};
+
+// Runs in its own thread: reads and parses serial data and writes queued
+// commands, so that serial I/O never waits on the control loop.
+class CSerialWorker: public QObject
 {
     Q_OBJECT
 
-    QextSerialPort *serialPort;
-    QByteArray msgBuffer, textBuffer;
-    QQueue<QString> commandQueue;
-    QTimer *commandProcessTimer;
+public:
+    // Time between sending a binary command and its acknowledgement
+    struct SCommandLatency
+    {
+        uint32_t count, min, max, last; // usec
+        uint64_t total;
+        SCommandLatency(void) : count(0), min(0), max(0), last(0), total(0) { }
+        void add(uint32_t l);
+    };
+
+    struct SStats
+    {
+        CSerialParser::SStats parser;
+        uint32_t framesPerSec, parseTimeUS; // parseTimeUS: total time spent parsing
+        // Read notifications from the port and read() calls they took
+        uint32_t wakeups, readCalls;
+        float framesPerWakeup; // During the last second
+        uint32_t droppedFrames, droppedLines;
+        uint32_t commandsSent, retransmits, droppedCommands;
+        SCommandLatency commandLatency[SERIAL_CMD_MAX_INDEX];
+        uint32_t coalescedCommands[SSerialCommand::MAX_KEYS]; // Per key
+        SCommandLatency priorityLatency; // From queueing to sending
+        uint32_t preemptedCommands;
+        SStats(void) : framesPerSec(0), parseTimeUS(0), wakeups(0), readCalls(0),
+                       framesPerWakeup(0.0f), droppedFrames(0),
+                       droppedLines(0), commandsSent(0), retransmits(0),
+                       droppedCommands(0), preemptedCommands(0)
+        { memset(coalescedCommands, 0, sizeof(coalescedCommands)); }
+    };
+
+private:
+    // Binary commands are sent without waiting for the previous one as long
+    // as no more than COMMAND_WINDOW are unacknowledged. Text commands
+    // cannot be acknowledged: they wait for the window to be empty and are
+    // followed by TEXT_COMMAND_DELAY.
+    // Priority commands (stop) are sent right away, using an extra window
+    // slot if needed, and remove pending motion commands queued before them.
+    enum { COMMAND_WINDOW = 3, COMMAND_TIMEOUT = 200, COMMAND_RETRIES = 5,
+           TEXT_COMMAND_DELAY = 25, MAX_PENDING_COMMANDS = 64,
+           PRIORITY_LATENCY_TARGET = 5 };
+
+    struct SInFlightCommand
+    {
+        int size;
+        char data[SERIAL_CMD_MAX_SIZE + 3];
+        uint8_t sequence;
+        uint64_t sendTime;
+        int retries;
+    };
+
+    CSerialPort *serialPort;
+    QString portName;
+    bool lowLatency;
+    QextSerialPort *port;
+    CSerialParser parser;
+    QTimer *commandProcessTimer, *retransmitTimer, *statsTimer;
+    uint32_t lastFrameCount, framesPerSec, parseTimeUS;
+    uint32_t wakeups, lastWakeups;
+    float framesPerWakeup;
+    uint32_t droppedFrames, droppedLines;
+    uint32_t receiveSequence; // Order of frames and text, see CSerialPort
+    SInFlightCommand inFlight[COMMAND_WINDOW + 1];
+    int inFlightStart, inFlightCount;
+    // Commands taken from the queue, but not sent yet. Commands with a key
+    // replace a pending command with the same key.
+    SSerialCommand pendingCommands[MAX_PENDING_COMMANDS];
+    int pendingStart, pendingCount;
+    uint32_t coalescedCommands[SSerialCommand::MAX_KEYS];
+    SCommandLatency priorityLatency;
+    uint32_t preemptedCommands;
+    uint8_t nextSequence;
+    bool textCommandDelay;
+    uint32_t commandsSent, retransmits, droppedCommands;
+    SCommandLatency commandLatency[SERIAL_CMD_MAX_INDEX];
+    SStats stats;
+    mutable QMutex statsMutex;
+
+    SInFlightCommand &getInFlight(int i)
+    { return inFlight[(inFlightStart + i) % (COMMAND_WINDOW + 1)]; }
+    void popInFlight(void);
+    SSerialCommand &getPending(int i)
+    { return pendingCommands[(pendingStart + i) % MAX_PENDING_COMMANDS]; }
+    void takeQueuedCommands(void);
+    void popPending(void);
+    void preemptMotionCommands(uint64_t time);
+    void sendBinaryCommand(const SSerialCommand &command);
+    void processPriorityCommands(void);
+    uint8_t getNextSequence(void);
+    void sendInFlight(SInFlightCommand &command);
+    void handleAck(uint8_t seq);
 
 private slots:
+    void open(void);
+    void close(void);
     void onReadyRead(void);
+    void updateStats(void);
     void disableRTS(void);
     void processCommandQueue(void);
+    void textCommandDelayDone(void);
+    void checkRetransmit(void);
+    void commandsQueued(void);
+    void restartCommands(void);
+    void resetRP6(void);
 
 public:
-    CSerialPort(QObject *parent, const QString &port);
+    CSerialWorker(CSerialPort *s, const QString &p, bool lowlat);
+
+    SStats getStats(void) const;
+
+    friend class CSerialPort;
+};
+
+class CSerialPort: public QObject
+{
+    Q_OBJECT
+
+public:
+    typedef CSerialWorker::SStats SStats;
+    typedef CSerialWorker::SCommandLatency SCommandLatency;
+
+private:
+    // Frames and text go through separate queues, the sequence number
+    // (shared by both) keeps them in the order they were received
+    struct SFrame
+    {
+        uint32_t sequence;
+        ESerialMessage msg;
+        uint32_t time;
+        int size;
+        char data[CSerialParser::MAX_FRAME_SIZE];
+    };
+
+    struct SText
+    {
+        uint32_t sequence;
+        int size;
+        char data[CSerialParser::MAX_LINE];
+    };
+
+    // Serial thread -> control loop
+    CSPSCQueue<SFrame, 256> frameQueue;
+    CSPSCQueue<SText, 32> textQueue;
+    QAtomicInt dataPending;
+
+    // Control loop -> serial thread
+    CSPSCQueue<SSerialCommand, 64> commandQueue;
+    CSPSCQueue<SSerialCommand, 8> priorityQueue;
+
+    QThread *thread;
+    CSerialWorker *worker;
+    bool binaryCommands;
+    QHash<QString, int> commandKeys;
+    QStringList commandKeyNames;
+
+private slots:
+    void processSerialData(void);
+
+public:
+    // lowlatency: see QextSerialPort::setLowLatency()
+    CSerialPort(QObject *parent, const QString &port, bool lowlatency=true);
+    ~CSerialPort(void);
 
     void resetRP6(void);
-    void sendCommand(const QString &command);
+    // Has to be called when the m32 (re)started: it expects a new command
+    // sequence and never acknowledges commands sent before
+    void restartCommands(void);
+    // Commands with the same key replace each other while they are queued.
+    // time: when the command was received (getTimeUS()), 0 for now.
+    void sendCommand(const QString &command, const QString &key=QString(),
+                     uint64_t time=0);
     void launchRP6(void) { sendCommand("s"); }
-    
+    // Send known commands in binary form (default), otherwise only text
+    void setBinaryCommands(bool b) { binaryCommands = b; }
+    SStats getStats(void) const { return worker->getStats(); }
+    QString getCommandKeyName(int key) const { return commandKeyNames.value(key); }
+
+    friend class CSerialWorker;
 
 signals:
     void textAvailable(const QByteArray &text);
-    void msgAvailable(ESerialMessage msg, const QByteArray &data);
+    // data is only valid during signal emission
+    void msgAvailable(ESerialMessage msg, const QByteArray &data, uint32_t time);
 };
 
 #endif
@@ -0,0 +1,298 @@
+#include <QByteArray>
+#include <QList>
+
+#include "serialcommand.h"
+
+namespace {
+
+class CFrameWriter
+{
+    char *frame;
+    int size;
+
+public:
+    CFrameWriter(char *f, ESerialCommand cmd) : frame(f), size(4)
+    {
+        frame[0] = SERIAL_MSG_START;
+        frame[2] = cmd;
+        frame[3] = 0; // Sequence, set when sending
+    }
+
+    void addByte(uint8_t b) { frame[size++] = b; }
+    void addWord(uint16_t w) { addByte(w & 0xFF); addByte(w >> 8); }
+
+    int finish(void)
+    {
+        frame[1] = size - 2; // Opcode + sequence + args
+        uint8_t checksum = 0;
+        for (int i=1; i<size; ++i)
+            checksum ^= static_cast<uint8_t>(frame[i]);
+        frame[size++] = checksum;
+        return size;
+    }
+};
+
+bool getNumber(const QByteArray &s, int max, int &ret)
+{
+    bool ok;
+    ret = s.toInt(&ok);
+    return ok && (ret >= 0) && (ret <= max);
+}
+
+bool getByte(const QByteArray &s, uint8_t &ret)
+{
+    int n;
+    if (!getNumber(s, 0xFF, n))
+        return false;
+    ret = n;
+    return true;
+}
+
+bool getWord(const QByteArray &s, uint16_t &ret)
+{
+    int n;
+    if (!getNumber(s, 0xFFFF, n))
+        return false;
+    ret = n;
+    return true;
+}
+
+// Binary string, e.g. "0101"
+bool getBits(const QByteArray &s, int bits, uint8_t &ret)
+{
+    if (s.isEmpty() || (s.size() > bits))
+        return false;
+
+    ret = 0;
+    for (int i=0; i<s.size(); ++i)
+    {
+        if ((s[i] != '0') && (s[i] != '1'))
+            return false;
+        ret = (ret << 1) | (s[i] - '0');
+    }
+    return true;
+}
+
+bool getDir(const QByteArray &s, uint8_t &ret)
+{
+    if (s == "fwd")
+        ret = FWD;
+    else if (s == "bwd")
+        ret = BWD;
+    else if (s == "left")
+        ret = LEFT;
+    else if (s == "right")
+        ret = RIGHT;
+    else
+        return false;
+    return true;
+}
+
+bool getACSPower(const QByteArray &s, uint8_t &ret)
+{
+    if (s == "off")
+        ret = ACS_POWER_OFF;
+    else if (s == "low")
+        ret = ACS_POWER_LOW;
+    else if (s == "med")
+        ret = ACS_POWER_MED;
+    else if (s == "high")
+        ret = ACS_POWER_HIGH;
+    else
+        return false;
+    return true;
+}
+
+bool getSlaveDelay(const QByteArray &s, uint8_t &ret)
+{
+    static const char *names[SLAVE_DELAY_MAX_INDEX] =
+    { "led", "light", "motor", "battery", "acs", "mic", "rc5", "sharpir" };
+
+    for (int i=0; i<SLAVE_DELAY_MAX_INDEX; ++i)
+    {
+        if (s == names[i])
+        {
+            ret = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+int encodeSetCommand(const QList<QByteArray> &args, char *frame)
+{
+    if (args.size() < 3)
+        return 0;
+
+    const QByteArray &var = args[1];
+    uint8_t b1, b2;
+    uint16_t w;
+
+    if (var == "power")
+    {
+        CFrameWriter writer(frame, SERIAL_CMD_BASE_POWER);
+        writer.addByte(args[2][0] == '1');
+        return writer.finish();
+    }
+    else if ((var == "leds1") && getBits(args[2], 6, b1))
+    {
+        CFrameWriter writer(frame, SERIAL_CMD_BASE_LEDS);
+        writer.addByte(b1);
+        return writer.finish();
+    }
+    else if ((var == "leds2") && getBits(args[2], 4, b1))
+    {
+        CFrameWriter writer(frame, SERIAL_CMD_M32_LEDS);
+        writer.addByte(b1);
+        return writer.finish();
+    }
+    else if ((var == "acs") && getACSPower(args[2], b1))
+    {
+        CFrameWriter writer(frame, SERIAL_CMD_ACS_POWER);
+        writer.addByte(b1);
+        return writer.finish();
+    }
+    else if ((var == "speed") && (args.size() > 3) && getByte(args[2], b1) &&
+             getByte(args[3], b2))
+    {
+        CFrameWriter writer(frame, SERIAL_CMD_SPEED);
+        writer.addByte(b1);
+        writer.addByte(b2);
+        return writer.finish();
+    }
+    else if ((var == "dir") && getDir(args[2], b1))
+    {
+        CFrameWriter writer(frame, SERIAL_CMD_DIR);
+        writer.addByte(b1);
+        return writer.finish();
+    }
+    else if (var == "slave")
+    {
+        CFrameWriter writer(frame, SERIAL_CMD_SLAVE);
+        writer.addByte(args[2][0] == '1');
+        return writer.finish();
+    }
+    else if ((var == "slavedelay") && (args.size() > 3) && getSlaveDelay(args[2], b1) &&
+             getWord(args[3], w))
+    {
+        CFrameWriter writer(frame, SERIAL_CMD_SLAVE_DELAY);
+        writer.addByte(b1);
+        writer.addWord(w);
+        return writer.finish();
+    }
+    else if ((var == "servo") && getByte(args[2], b1))
+    {
+        CFrameWriter writer(frame, SERIAL_CMD_SERVO);
+        writer.addByte(b1);
+        return writer.finish();
+    }
+
+    return 0;
+}
+
+// move/rotate <dist/angle> [speed] [dir]
+int encodeMoveCommand(const QList<QByteArray> &args, ESerialCommand cmd,
+                      uint8_t defaultdir, char *frame)
+{
+    uint16_t dist;
+    uint8_t speed = 80, dir = defaultdir;
+
+    if ((args.size() < 2) || !getWord(args[1], dist))
+        return 0;
+    if ((args.size() > 2) && !getByte(args[2], speed))
+        return 0;
+    if ((args.size() > 3) && !getDir(args[3], dir))
+        return 0;
+
+    CFrameWriter writer(frame, cmd);
+    writer.addByte(speed);
+    writer.addByte(dir);
+    writer.addWord(dist);
+    return writer.finish();
+}
+
+}
+
+bool isBinarySerialCommand(const char *frame)
+{
+    return frame[0] == SERIAL_MSG_START;
+}
+
+ESerialCommand getSerialCommandOpcode(const char *frame)
+{
+    return static_cast<ESerialCommand>(frame[2]);
+}
+
+bool isMotionSerialCommand(const char *frame)
+{
+    if (!isBinarySerialCommand(frame))
+        return false;
+
+    const ESerialCommand cmd = getSerialCommandOpcode(frame);
+    return ((cmd == SERIAL_CMD_SPEED) || (cmd == SERIAL_CMD_DIR) || (cmd == SERIAL_CMD_MOVE) ||
+            (cmd == SERIAL_CMD_ROTATE));
+}
+
+void setSerialCommandSequence(char *frame, uint8_t seq)
+{
+    const uint8_t size = frame[1];
+    frame[size + 2] ^= frame[3] ^ seq; // Update checksum
+    frame[3] = seq;
+}
+
+const char *getSerialCommandName(ESerialCommand cmd)
+{
+    static const char *names[SERIAL_CMD_MAX_INDEX] =
+    {
+        "power", "leds1", "leds2", "acs", "speed", "dir", "slave", "slavedelay",
+        "servo", "move", "rotate", "stop", "beep", "sound"
+    };
+
+    return ((cmd >= 0) && (cmd < SERIAL_CMD_MAX_INDEX)) ? names[cmd] : "unknown";
+}
+
+int encodeSerialCommand(const QByteArray &command, char *frame)
+{
+    const QList<QByteArray> args(command.simplified().split(' '));
+    const QByteArray &cmd = args[0];
+
+    if (cmd == "set")
+        return encodeSetCommand(args, frame);
+    else if (cmd == "move")
+        return encodeMoveCommand(args, SERIAL_CMD_MOVE, FWD, frame);
+    else if (cmd == "rotate")
+        return encodeMoveCommand(args, SERIAL_CMD_ROTATE, RIGHT, frame);
+    else if ((cmd == "stop") && (args.size() == 1))
+    {
+        CFrameWriter writer(frame, SERIAL_CMD_STOP);
+        return writer.finish();
+    }
+    else if (cmd == "beep")
+    {
+        uint8_t pitch;
+        uint16_t time;
+        if ((args.size() < 3) || !getByte(args[1], pitch) || !getWord(args[2], time))
+            return 0;
+
+        CFrameWriter writer(frame, SERIAL_CMD_BEEP);
+        writer.addByte(pitch);
+        writer.addWord(time);
+        return writer.finish();
+    }
+    else if (cmd == "sound")
+    {
+        uint8_t pitch;
+        uint16_t time, delay;
+        if ((args.size() < 4) || !getByte(args[1], pitch) || !getWord(args[2], time) ||
+            !getWord(args[3], delay))
+            return 0;
+
+        CFrameWriter writer(frame, SERIAL_CMD_SOUND);
+        writer.addByte(pitch);
+        writer.addWord(time);
+        writer.addWord(delay);
+        return writer.finish();
+    }
+
+    return 0;
+}
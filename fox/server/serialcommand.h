@@ -0,0 +1,23 @@
+#ifndef SERIALCOMMAND_H
+#define SERIALCOMMAND_H
+
+#include "shared.h"
+
+class QByteArray;
+
+enum { SERIAL_CMD_MAX_FRAME = SERIAL_CMD_MAX_SIZE + 3 }; // Start, size and checksum
+
+// Converts a text command for the m32 (e.g. "set speed 60 60") to a binary
+// command frame (see ESerialCommand). Returns the frame size, or 0 when the
+// command is unknown or its arguments don't fit, in which case it should be
+// sent as text.
+int encodeSerialCommand(const QByteArray &command, char *frame);
+
+// Helpers for encoded frames
+bool isBinarySerialCommand(const char *frame);
+ESerialCommand getSerialCommandOpcode(const char *frame);
+bool isMotionSerialCommand(const char *frame);
+void setSerialCommandSequence(char *frame, uint8_t seq);
+const char *getSerialCommandName(ESerialCommand cmd);
+
+#endif
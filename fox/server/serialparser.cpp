@@ -0,0 +1,147 @@
+#include <string.h>
+
+#include "serialparser.h"
+
+void CSerialParser::copyData(char *dest, uint32_t start, int size) const
+{
+    const uint32_t s = mask(start);
+    const int first = ((s + size) <= BUFFER_SIZE) ? size : (BUFFER_SIZE - s);
+    memcpy(dest, &buffer[s], first);
+    memcpy(dest + first, buffer, size - first);
+}
+
+const char *CSerialParser::getData(uint32_t start, int size, char *scratch, int offset)
+{
+    if (!offset && ((mask(start) + size) <= BUFFER_SIZE))
+        return &buffer[mask(start)]; // In place
+
+    // Wraps around (or has text in front of it)
+    copyData(scratch + offset, start, size);
+    return scratch;
+}
+
+void CSerialParser::storePendingText()
+{
+    // Text followed by a frame: rare, so just keep a copy
+    int size = pos - tail;
+    if ((pendingText + size) > MAX_LINE)
+        size = MAX_LINE - pendingText;
+
+    if (size > 0)
+    {
+        copyData(tokenBuffer + pendingText, tail, size);
+        pendingText += size;
+    }
+
+    tail = pos;
+}
+
+void CSerialParser::resync()
+{
+    // Skip the start marker and rescan what followed it as text
+    ++stats.resyncs;
+    state = STATE_TEXT;
+    tail = pos = tail + 1;
+}
+
+char *CSerialParser::getWriteBuffer(int &space)
+{
+    const uint32_t used = head - tail, h = mask(head);
+    space = BUFFER_SIZE - used;
+    if ((h + space) > BUFFER_SIZE)
+        space = BUFFER_SIZE - h;
+    return &buffer[h];
+}
+
+void CSerialParser::commit(int bytes)
+{
+    head += bytes;
+    stats.bytes += bytes;
+}
+
+bool CSerialParser::next(SToken &token)
+{
+    while ((pos != head) || (state == STATE_DATA))
+    {
+        const uint8_t byte = buffer[mask(pos)];
+
+        switch (state)
+        {
+        case STATE_TEXT:
+            if (byte == SERIAL_MSG_START)
+            {
+                storePendingText();
+                state = STATE_SIZE;
+                ++pos;
+            }
+            else if (byte == '\n')
+            {
+                const int size = pos - tail;
+                token.type = TOKEN_TEXT;
+                token.data = getData(tail, size, tokenBuffer, pendingText); // Without newline
+                token.size = pendingText + size;
+                pendingText = 0;
+                tail = ++pos;
+                ++stats.lines;
+                return true;
+            }
+            else if ((pendingText + static_cast<int>(pos - tail)) >= (MAX_LINE - 1))
+            {
+                // Line too long: split it
+                const int size = pos - tail + 1;
+                token.type = TOKEN_TEXT;
+                token.data = getData(tail, size, tokenBuffer, pendingText);
+                token.size = pendingText + size;
+                pendingText = 0;
+                tail = ++pos;
+                ++stats.lines;
+                return true;
+            }
+            else
+                ++pos;
+            break;
+
+        case STATE_SIZE:
+            frameSize = byte;
+            if ((frameSize == 0) || (frameSize > MAX_FRAME_SIZE))
+                resync();
+            else
+            {
+                state = STATE_TYPE;
+                ++pos;
+            }
+            break;
+
+        case STATE_TYPE:
+            if ((byte <= SERIAL_MSG_START) || (byte >= SERIAL_MAX_INDEX))
+                resync();
+            else
+            {
+                state = STATE_DATA;
+                ++pos;
+            }
+            break;
+
+        case STATE_DATA:
+        {
+            const uint32_t end = tail + 2 + frameSize;
+            if ((head - tail) < (2u + frameSize))
+            {
+                pos = head; // Wait for more bytes
+                return false;
+            }
+
+            token.type = TOKEN_FRAME;
+            token.msg = static_cast<ESerialMessage>(static_cast<uint8_t>(buffer[mask(tail + 2)]));
+            token.size = frameSize - 1;
+            token.data = getData(tail + 3, token.size, frameBuffer);
+            state = STATE_TEXT;
+            tail = pos = end;
+            ++stats.frames;
+            return true;
+        }
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,72 @@
+#ifndef SERIALPARSER_H
+#define SERIALPARSER_H
+
+#include <stdint.h>
+
+#include "shared.h"
+
+// Splits the serial byte stream into message frames and text lines.
+// Frame format:
+//  0: Start marker (SERIAL_MSG_START)
+//  1: Msg size (type + data)
+//  2: Msg type
+//  n: Data
+// Received bytes are read directly into a fixed size ring buffer and
+// parsed byte by byte, so incomplete frames and lines stay in place until
+// more data arrives. Invalid frames are skipped by resynchronising on the
+// byte after their start marker.
+class CSerialParser
+{
+public:
+    enum { BUFFER_SIZE = 1024, MAX_LINE = 256, MAX_FRAME_SIZE = 32 };
+    enum ETokenType { TOKEN_NONE, TOKEN_FRAME, TOKEN_TEXT };
+
+    struct SToken
+    {
+        ETokenType type;
+        ESerialMessage msg;
+        const char *data; // Only valid until the next call to next()
+        int size;
+        SToken(void) : type(TOKEN_NONE), msg(SERIAL_MSG_START), data(0), size(0) { }
+    };
+
+    struct SStats
+    {
+        uint32_t bytes, frames, lines, resyncs;
+        SStats(void) : bytes(0), frames(0), lines(0), resyncs(0) { }
+    };
+
+private:
+    enum EState { STATE_TEXT, STATE_SIZE, STATE_TYPE, STATE_DATA };
+
+    char buffer[BUFFER_SIZE];
+    char tokenBuffer[MAX_LINE]; // For lines wrapping around the ring or with pending text
+    char frameBuffer[MAX_FRAME_SIZE]; // For frames wrapping around the ring
+    uint32_t head, tail, pos; // Free running, masked on access
+    EState state;
+    uint8_t frameSize;
+    int pendingText; // Text in tokenBuffer, interrupted by a frame
+    SStats stats;
+
+    uint32_t mask(uint32_t i) const { return i & (BUFFER_SIZE - 1); }
+    void copyData(char *dest, uint32_t start, int size) const;
+    // Returns the data in place if possible, copied to scratch + offset otherwise
+    const char *getData(uint32_t start, int size, char *scratch, int offset=0);
+    void storePendingText(void);
+    void resync(void);
+
+public:
+    CSerialParser(void) : head(0), tail(0), pos(0), state(STATE_TEXT),
+                          frameSize(0), pendingText(0) { }
+
+    // Contiguous free space for reading new bytes into
+    char *getWriteBuffer(int &space);
+    void commit(int bytes);
+
+    // Returns false when more bytes are needed
+    bool next(SToken &token);
+
+    const SStats &getStats(void) const { return stats; }
+};
+
+#endif
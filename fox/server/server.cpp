@@ -1,14 +1,18 @@
 #include <assert.h>
-#include <sys/time.h>
 
 #include <QtCore>
 
 #include <luanav.h>
+#include "logger.h"
+#include "luascheduler.h"
 #include "pathengine.h"
+#include "scriptstore.h"
 #include "serial.h"
+#include "serialcommand.h"
 #include "server.h"
 #include "shared.h"
 #include "tcp.h"
+#include "timeutil.h"
 
 namespace {
 
@@ -28,222 +32,231 @@ const char *moveDirToLuaStr(int dir)
 
 }
 
-CControl::CControl(QObject *parent) : QObject(parent)
+CControl::CControl(int id, const QString &port, bool textcommands, bool lowlatency,
+                   CScriptStore *store, size_t luamemlimit)
+    : robotID(id), portName(port), textCommands(textcommands), lowLatency(lowlatency),
+      luaMemoryLimit(luamemlimit), serialPort(0), luaInterface(0), scriptStore(store),
+      sendTcpTimer(0), luaProfileTimer(0), telemetrySequence(0),
+      serialToTcpLatency(10000), poseUpdatesSent(0)
 {
-    QStringList args(QCoreApplication::arguments());
-    QString port = "/dev/ttyUSB0";
-    QString preva;
-    bool daemonize = false;
-
-    foreach(QString a, args)
-    {
-        if (preva == "-d")
-            port = a;
-        else if (a == "-D")
-            daemonize = true;
-        preva = a;
-    }
-
-    if (daemonize)
-    {
-        qInstallMsgHandler(daemonMsgHandler);
-        if (daemon(1, 0) == -1) // Keep working dir, close standard fd's
-            qFatal("Failed to daemonize!");
-    }
+    // Everything else is created by init(), in the thread of the robot
+}
 
-    serialPort = new CSerialPort(this, port);
+void CControl::init()
+{
+    serialPort = new CSerialPort(this, portName, lowLatency);
+    serialPort->setBinaryCommands(!textCommands);
     connect(serialPort, SIGNAL(textAvailable(const QByteArray &)), this,
             SLOT(handleSerialText(const QByteArray &)));
-    connect(serialPort, SIGNAL(msgAvailable(ESerialMessage, const QByteArray &)),
-            this, SLOT(handleSerialMSG(ESerialMessage, const QByteArray &)));
-
-    tcpServer = new CTcpServer(this);
-    connect(tcpServer, SIGNAL(newConnection()), this, SLOT(clientConnected()));
-    connect(tcpServer, SIGNAL(clientTcpReceived(QDataStream &)), this,
-            SLOT(parseClientTcp(QDataStream &)));
+    connect(serialPort, SIGNAL(msgAvailable(ESerialMessage, const QByteArray &, uint32_t)),
+            this, SLOT(handleSerialMSG(ESerialMessage, const QByteArray &, uint32_t)));
 
-    // important: Keep these 3 in order
-    initTcpDataTypes();
-    initSerial2TcpMap();
     initLua();
 
     sendTcpTimer = new QTimer(this);
     connect(sendTcpTimer, SIGNAL(timeout()), this, SLOT(sendTcpData()));
     sendTcpTimer->start(500);
+
+    luaProfileTimer = new QTimer(this);
+    connect(luaProfileTimer, SIGNAL(timeout()), this, SLOT(sendLuaProfile()));
 }
 
-void CControl::initSerial2TcpMap()
+void CControl::shutdown()
 {
-    serial2TcpMap.insert(SERIAL_STATE_SENSORS,
-                         SSerial2TcpInfo(TCP_STATE_SENSORS, "state"));
-
-    serial2TcpMap.insert(SERIAL_BASE_LEDS,
-                         SSerial2TcpInfo(TCP_BASE_LEDS, "baseleds"));
-    serial2TcpMap.insert(SERIAL_M32_LEDS,
-                         SSerial2TcpInfo(TCP_M32_LEDS, "m32leds"));
-    
-    serial2TcpMap.insert(SERIAL_LIGHT_LEFT,
-                         SSerial2TcpInfo(TCP_LIGHT_LEFT, "lightleft"));
-    serial2TcpMap.insert(SERIAL_LIGHT_RIGHT,
-                         SSerial2TcpInfo(TCP_LIGHT_RIGHT, "lightright"));
-    
-    serial2TcpMap.insert(SERIAL_MOTOR_SPEED_LEFT,
-                         SSerial2TcpInfo(TCP_MOTOR_SPEED_LEFT, "speedleft"));
-    serial2TcpMap.insert(SERIAL_MOTOR_SPEED_RIGHT,
-                         SSerial2TcpInfo(TCP_MOTOR_SPEED_RIGHT, "speedright"));
-    serial2TcpMap.insert(SERIAL_MOTOR_DESTSPEED_LEFT,
-                         SSerial2TcpInfo(TCP_MOTOR_DESTSPEED_LEFT, "destspeedleft"));
-    serial2TcpMap.insert(SERIAL_MOTOR_DESTSPEED_RIGHT,
-                         SSerial2TcpInfo(TCP_MOTOR_DESTSPEED_RIGHT, "destspeedright"));
-    serial2TcpMap.insert(SERIAL_MOTOR_DIST_LEFT,
-                         SSerial2TcpInfo(TCP_MOTOR_DIST_LEFT, "distleft"));
-    serial2TcpMap.insert(SERIAL_MOTOR_DIST_RIGHT,
-                         SSerial2TcpInfo(TCP_MOTOR_DIST_RIGHT, "distright"));
-    serial2TcpMap.insert(SERIAL_MOTOR_DESTDIST_LEFT,
-                         SSerial2TcpInfo(TCP_MOTOR_DESTDIST_LEFT, "destdistleft"));
-    serial2TcpMap.insert(SERIAL_MOTOR_DESTDIST_RIGHT,
-                         SSerial2TcpInfo(TCP_MOTOR_DESTDIST_RIGHT, "destdistright"));
-    serial2TcpMap.insert(SERIAL_MOTOR_CURRENT_LEFT,
-                         SSerial2TcpInfo(TCP_MOTOR_CURRENT_LEFT, "motorcurrentleft"));
-    serial2TcpMap.insert(SERIAL_MOTOR_CURRENT_RIGHT,
-                         SSerial2TcpInfo(TCP_MOTOR_CURRENT_RIGHT, "motorcurrentright"));
-    serial2TcpMap.insert(SERIAL_MOTOR_DIRECTIONS,
-                         SSerial2TcpInfo(TCP_MOTOR_DIRECTIONS, "motordirections"));
-
-    serial2TcpMap.insert(SERIAL_BATTERY, SSerial2TcpInfo(TCP_BATTERY, "battery"));
-
-    serial2TcpMap.insert(SERIAL_ACS_POWER, SSerial2TcpInfo(TCP_ACS_POWER, "acspower"));
-
-    serial2TcpMap.insert(SERIAL_MIC, SSerial2TcpInfo(TCP_MIC, "mic"));
-
-    serial2TcpMap.insert(SERIAL_LASTRC5, SSerial2TcpInfo(TCP_LASTRC5, "rc5"));
-
-    serial2TcpMap.insert(SERIAL_SHARPIR, SSerial2TcpInfo(TCP_SHARPIR, "sharpir"));
+    // Timers, the serial port and Lua have to be destroyed by our own thread
+    delete luaInterface;
+    luaInterface = 0;
+    qDeleteAll(children());
+    serialPort = 0;
+    sendTcpTimer = luaProfileTimer = 0;
 }
 
 void CControl::initLua()
 {
-    NLuaNav::registerBindings();
-
-    NLua::registerFunction(luaScriptRunning, "scriptrunning", this);
-    NLua::registerFunction(luaExecCmd, "exec", this);
-    NLua::registerFunction(luaSendText, "sendtext", this);
-    NLua::registerFunction(luaSendMsg, "sendmsg", this);
-    NLua::registerFunction(luaUpdate, "update");
-    NLua::registerFunction(luaGetTimeMS, "gettimems");
+    luaInterface = new NLua::CLuaInterface(luaMemoryLimit);
+    lua_State *l = *luaInterface;
+
+    NLuaNav::registerBindings(l);
+
+    NLua::registerFunction(l, luaScriptRunning, "scriptrunning", this);
+    NLua::registerFunction(l, luaExecCmd, "exec", this);
+    NLua::registerFunction(l, luaSendText, "sendtext", this);
+    NLua::registerFunction(l, luaSendMsg, "sendmsg", this);
+    NLua::registerFunction(l, luaUpdate, "update");
+    NLua::registerFunction(l, luaGetTimeMS, "gettimems");
+    NLua::registerFunction(l, luaGetStats, "getstats", this);
+    NLua::registerFunction(l, luaGetSerialStats, "getserialstats", this);
+    NLua::registerFunction(l, luaGetCommandStats, "getcommandstats", this);
+    NLua::registerFunction(l, luaGetSnapshot, "snapshot", "robot", this);
+    NLua::registerFunction(l, luaWaitFor, "waitfor", this);
+    NLua::registerFunction(l, luaGetPose, "getpose", "robot", this);
+    NLua::registerFunction(l, luaResetPose, "resetpose", "robot", this);
+    NLua::registerFunction(l, luaSetOdometry, "setodometry", "robot", this);
+
+    // Lets scripts shared by several robots tell them apart
+    lua_pushinteger(l, robotID);
+    lua_setglobal(l, "robotid");
 
     registerLuaRobotModule();
 
-    NLua::luaInterface.exec();
+    luaInterface->exec();
 }
 
 void CControl::registerLuaDataFunc(const char *name, ETcpMessage msg,
                                    const char *submod, lua_CFunction func)
 {
-    lua_getglobal(NLua::luaInterface, "robot");
+    lua_State *l = *luaInterface;
 
-    if (lua_isnil(NLua::luaInterface, -1))
+    lua_getglobal(l, "robot");
+
+    if (lua_isnil(l, -1))
     {
-        lua_pop(NLua::luaInterface, 1);
-        lua_newtable(NLua::luaInterface);
+        lua_pop(l, 1);
+        lua_newtable(l);
     }
 
     if (submod)
     {
-        lua_getfield(NLua::luaInterface, -1, submod);
+        lua_getfield(l, -1, submod);
 
-        if (lua_isnil(NLua::luaInterface, -1))
+        if (lua_isnil(l, -1))
         {
-            lua_pop(NLua::luaInterface, 1);
-            lua_newtable(NLua::luaInterface);
+            lua_pop(l, 1);
+            lua_newtable(l);
         }
     }
 
-    lua_pushlightuserdata(NLua::luaInterface, this);
-    lua_pushinteger(NLua::luaInterface, msg);
-    lua_pushcclosure(NLua::luaInterface, func, 2);
-    lua_setfield(NLua::luaInterface, -2, name);
+    lua_pushlightuserdata(l, this);
+    lua_pushinteger(l, msg);
+    lua_pushcclosure(l, func, 2);
+    lua_setfield(l, -2, name);
 
     if (submod)
-        lua_setfield(NLua::luaInterface, -2, submod);
+        lua_setfield(l, -2, submod);
 
-    lua_setglobal(NLua::luaInterface, "robot");
+    lua_setglobal(l, "robot");
 }
 
 void CControl::registerLuaRobotModule()
 {
+    for (int i=0; i<ROBOT_CHANNEL_COUNT; ++i)
+    {
+        if (robotChannels[i].luaFunction)
+            registerLuaDataFunc(robotChannels[i].luaFunction, robotChannels[i].tcpMessage,
+                                robotChannels[i].luaModule);
+    }
+
+    // Data that needs decoding
     registerLuaDataFunc("bumperleft", TCP_STATE_SENSORS, "sensors", luaGetBumperLeft);
     registerLuaDataFunc("bumperright", TCP_STATE_SENSORS, "sensors", luaGetBumperRight);
     registerLuaDataFunc("acsleft", TCP_STATE_SENSORS, "sensors", luaGetACSLeft);
     registerLuaDataFunc("acsright", TCP_STATE_SENSORS, "sensors", luaGetACSRight);
     registerLuaDataFunc("movecomplete", TCP_STATE_SENSORS, "motor", luaGetMoveComplete);
-    registerLuaDataFunc("base", TCP_BASE_LEDS, "leds");
-    registerLuaDataFunc("m32", TCP_M32_LEDS, "leds");
-    registerLuaDataFunc("lightleft", TCP_LIGHT_LEFT, "sensors");
-    registerLuaDataFunc("lightright", TCP_LIGHT_RIGHT, "sensors");
-    registerLuaDataFunc("speedleft", TCP_MOTOR_SPEED_LEFT, "motor");
-    registerLuaDataFunc("speedright", TCP_MOTOR_SPEED_RIGHT, "motor");
-    registerLuaDataFunc("destspeedleft", TCP_MOTOR_DESTSPEED_LEFT, "motor");
-    registerLuaDataFunc("destspeedright", TCP_MOTOR_DESTSPEED_RIGHT, "motor");
-    registerLuaDataFunc("distleft", TCP_MOTOR_DIST_LEFT, "motor");
-    registerLuaDataFunc("distright", TCP_MOTOR_DIST_RIGHT, "motor");
-    registerLuaDataFunc("destdistleft", TCP_MOTOR_DESTDIST_LEFT, "motor");
-    registerLuaDataFunc("destdistright", TCP_MOTOR_DESTDIST_RIGHT, "motor");
-    registerLuaDataFunc("motorcurrentleft", TCP_MOTOR_CURRENT_LEFT, "motor");
-    registerLuaDataFunc("motorcurrentright", TCP_MOTOR_CURRENT_RIGHT, "motor");
     registerLuaDataFunc("motordirleft", TCP_MOTOR_DIRECTIONS, "motor", luaGetMotorDirLeft);
     registerLuaDataFunc("motordirright", TCP_MOTOR_DIRECTIONS, "motor", luaGetMotorDirRight);
-    registerLuaDataFunc("battery", TCP_BATTERY, "sensors");
     registerLuaDataFunc("acspower", TCP_ACS_POWER, "sensors", luaGetACSPower);
-    registerLuaDataFunc("mic", TCP_MIC, "sensors");
     registerLuaDataFunc("key", TCP_LASTRC5, "rc5", luaGetRC5Key);
     registerLuaDataFunc("device", TCP_LASTRC5, "rc5", luaGetRC5Device);
     registerLuaDataFunc("toggle", TCP_LASTRC5, "rc5", luaGetRC5Toggle);
-    registerLuaDataFunc("sharpir", TCP_SHARPIR, "sensors");
 }
 
-void CControl::runScript(const QByteArray &script)
+void CControl::runScript(const QByteArray &script, const QString &name, int priority)
 {
-    NLua::runScript(script);
-    if (tcpServer->hasConnections())
-        NLua::scriptInitClient();
+    NLua::runScript(*luaInterface, script, name, priority);
+    if (hasConnections())
+        NLua::scriptInitClient(*luaInterface);
 }
 
-CControl::TLuaScriptMap CControl::getLuaScripts()
+void CControl::sendLuaScripts()
 {
-    QSettings settings;
-    return settings.value("scripts").toMap();
+    // Hashes let clients only download changed scripts
+    const CScriptStore::TIndex index(scriptStore->getIndex());
+    send(CTcpMsgComposer(TCP_LUASCRIPTS) << index.keys() << index.values());
 }
 
-void CControl::sendLuaScripts()
+void CControl::sendTelemetry(uint32_t time)
 {
-    tcpServer->send(TCP_LUASCRIPTS, getLuaScripts().keys());
+    telemetryWriter.clear();
+    quint8 count = 0;
+    for (int i=0; i<ROBOT_CHANNEL_COUNT; ++i)
+    {
+        if (tcpData[i].hasData())
+            ++count;
+    }
+
+    telemetryWriter << telemetrySequence++ << time << count;
+
+    for (int i=0; i<ROBOT_CHANNEL_COUNT; ++i)
+    {
+        if (tcpData[i].hasData())
+            telemetryWriter << (quint8)robotChannels[i].tcpMessage <<
+                               static_cast<quint16>(tcpData[i].data(time));
+    }
+
+    emit telemetrySend(robotID, QByteArray(telemetryWriter.data(), telemetryWriter.size()));
+}
+
+bool CControl::getTcpMsgFromName(const char *name, ETcpMessage &msg) const
+{
+    for (int i=0; i<ROBOT_CHANNEL_COUNT; ++i)
+    {
+        if (!strcmp(robotChannels[i].statsName, name))
+        {
+            msg = robotChannels[i].tcpMessage;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+CWindowStats::SResult CControl::getChannelStats(ETcpMessage msg, uint32_t window)
+{
+    // The live statistics (and their window) stay as they are
+    return getTcpInfo(msg).getStats().getResult(window, getTimeMS());
+}
+
+CWindowStats::SResult CControl::getLatencyStats()
+{
+    serialToTcpLatency.expire(getTimeMS());
+    return serialToTcpLatency.getResult();
 }
 
 void CControl::handleSerialText(const QByteArray &text)
 {
     if (text == "[READY]")
     {
+        serialPort->restartCommands(); // Before anything is sent to the new m32
         serialPort->sendCommand("s");
         QTimer::singleShot(4000, this, SLOT(enableRP6Slave()));
     }
     else
-        tcpServer->send(TCP_RAWSERIAL, text);
+        send(TCP_RAWSERIAL, text);
 }
 
-void CControl::handleSerialMSG(ESerialMessage msg, const QByteArray &data)
+void CControl::handleSerialMSG(ESerialMessage msg, const QByteArray &data, uint32_t time)
 {
-    const ETcpMessage tcpmsg = serial2TcpMap[msg].tcpMessage;
+    if (!isRobotChannel(msg))
+    {
+        qWarning() << "Unknown serial message:" << msg;
+        return;
+    }
 
+    const int index = getChannelIndex(msg);
+    const SRobotChannel &channel = robotChannels[index];
     int tcpdata;
 
-    switch (tcpDataTypes[tcpmsg])
+    switch (channel.dataType)
     {
         case DATA_BYTE:
+            if (data.size() < 1)
+                return;
             tcpdata = static_cast<uint8_t>(data[0]);
             break;
         case DATA_WORD:
         {
+            if (data.size() < 2)
+                return;
             const uint16_t d = static_cast<uint8_t>(data[0]) +
                 (static_cast<uint8_t>(data[1]) << 8);
             tcpdata = d;
@@ -251,51 +264,50 @@ void CControl::handleSerialMSG(ESerialMessage msg, const QByteArray &data)
         }
     }
 
+    const bool changed = (!tcpData[index].hasData() ||
+                          (tcpData[index].latestData() != tcpdata));
+
     // Store data and sum if we want it averaged
-    switch (tcpmsg)
-    {
-    case TCP_STATE_SENSORS:
-    case TCP_BASE_LEDS:
-    case TCP_M32_LEDS:
-    case TCP_MOTOR_DESTSPEED_LEFT:
-    case TCP_MOTOR_DESTSPEED_RIGHT:
-    case TCP_MOTOR_DIST_LEFT:
-    case TCP_MOTOR_DIST_RIGHT:
-    case TCP_MOTOR_DESTDIST_LEFT:
-    case TCP_MOTOR_DESTDIST_RIGHT:
-    case TCP_MOTOR_DIRECTIONS:
-    case TCP_ACS_POWER:
-    case TCP_LASTRC5:
-        tcpDataMap[tcpmsg].setData(tcpdata);
-        break;
-    case TCP_LIGHT_LEFT:
-    case TCP_LIGHT_RIGHT:
-    case TCP_MOTOR_SPEED_LEFT:
-    case TCP_MOTOR_SPEED_RIGHT:
-    case TCP_MOTOR_CURRENT_LEFT:
-    case TCP_MOTOR_CURRENT_RIGHT:
-    case TCP_BATTERY:
-    case TCP_MIC:
-    case TCP_SHARPIR:
-        tcpDataMap[tcpmsg].addData(tcpdata);
-        break;
-    default:
-        break;
+    if (channel.averaged)
+        tcpData[index].addData(tcpdata, time);
+    else
+        tcpData[index].setData(tcpdata, time);
+
+    if (changed) // Wake up scripts blocked in waitfor()
+        luaInterface->getScheduler()->signalEvent(index, tcpdata);
+
+    // Odometry uses every frame, not just the latest one
+    if (msg == SERIAL_MOTOR_DIST_LEFT)
+        poseEstimator.addMotorDistLeft(tcpdata, time);
+    else if (msg == SERIAL_MOTOR_DIST_RIGHT)
+        poseEstimator.addMotorDistRight(tcpdata, time);
+    else if (msg == SERIAL_MOTOR_DESTDIST_LEFT)
+        poseEstimator.setMotorDestDistLeft(tcpdata);
+    else if (msg == SERIAL_MOTOR_DESTDIST_RIGHT)
+        poseEstimator.setMotorDestDistRight(tcpdata);
+    else if (msg == SERIAL_MOTOR_DIRECTIONS)
+    {
+        SMotorDirections dir;
+        dir.byte = tcpdata;
+        poseEstimator.setMotorDirections(dir);
     }
 }
 
 void CControl::clientConnected()
 {
-    NLua::scriptInitClient();
+    NLua::scriptInitClient(*luaInterface);
 }
 
-void CControl::parseClientTcp(QDataStream &stream)
+void CControl::parseClientTcp(const QByteArray &block, qulonglong receivetime,
+                              qulonglong client)
 {
+    QDataStream stream(block);
+    stream.setVersion(QDataStream::Qt_4_4);
     uint8_t m;
     stream >> m;
     ETcpMessage msg = static_cast<ETcpMessage>(m);
 
-    qDebug() << "msg: " << m;
+    qDebug() << "[tcp] msg:" << m;
     
     if (msg == TCP_UPDATEDELAY)
     {
@@ -307,7 +319,7 @@ void CControl::parseClientTcp(QDataStream &stream)
     {
         QString cmd;
         stream >> cmd;
-        serialPort->sendCommand(cmd);
+        serialPort->sendCommand(cmd, QString(), receivetime);
         qDebug() << "Received client cmd:" << cmd;
     }
     else if (msg == TCP_GETSCRIPTS)
@@ -315,9 +327,13 @@ void CControl::parseClientTcp(QDataStream &stream)
     else if (msg == TCP_RUNLUA)
     {
         QByteArray script;
+        QString name;
+        uint8_t priority = 0;
         stream >> script;
-        qDebug() << "Received script:\n" << script;
-        runScript(script.constData());
+        if (!stream.atEnd()) // Older clients only send the script
+            stream >> name >> priority;
+        qDebug() << "Received script" << name << ":\n" << script;
+        runScript(script, name, priority);
     }
     else if ((msg == TCP_UPLOADLUA) || (msg == TCP_UPRUNLUA))
     {
@@ -325,33 +341,26 @@ void CControl::parseClientTcp(QDataStream &stream)
         QByteArray script;
         stream >> name >> script;
 
-        TLuaScriptMap scripts = getLuaScripts();
-        scripts[name] = script;
-        QSettings().setValue("scripts", scripts);
-
+        scriptStore->setScript(name, script);
         sendLuaScripts();
 
         if (msg == TCP_UPRUNLUA)
-            runScript(script);
+            runScript(scriptStore->getBytecode(name, *luaInterface));
     }
     else if (msg == TCP_RUNSERVERLUA)
     {
         QString name;
         stream >> name;
         
-        TLuaScriptMap scripts = getLuaScripts();
-        if (scripts.find(name) != scripts.end())
-            runScript(scripts[name].toByteArray());
+        if (scriptStore->contains(name))
+            runScript(scriptStore->getBytecode(name, *luaInterface));
     }
     else if (msg == TCP_REMOVESERVERLUA)
     {
         QString name;
         stream >> name;
         
-        TLuaScriptMap scripts = getLuaScripts();
-        scripts.remove(name);
-        QSettings().setValue("scripts", scripts);
-        
+        scriptStore->removeScript(name);
         sendLuaScripts();
     }
     else if (msg == TCP_GETSERVERLUA)
@@ -359,19 +368,73 @@ void CControl::parseClientTcp(QDataStream &stream)
         QString name;
         stream >> name;
         
-        TLuaScriptMap scripts = getLuaScripts();
-        if (scripts.find(name) != scripts.end())
-            tcpServer->send(TCP_REQUESTEDSCRIPT, scripts[name].toByteArray());
+        if (scriptStore->contains(name))
+            send(TCP_REQUESTEDSCRIPT, scriptStore->getScript(name));
     }
     else if (msg == TCP_LUACOMMAND)
     {
-        QString cmd;
+        QString cmd, script;
         QStringList args;
         stream >> cmd >> args;
-        NLua::execScriptCmd(cmd, args);
+        if (!stream.atEnd())
+            stream >> script;
+        NLua::execScriptCmd(*luaInterface, cmd, args, script);
+    }
+    else if (msg == TCP_GETCHANNELSTATS)
+    {
+        uint8_t tcpmsg;
+        uint16_t window;
+        stream >> tcpmsg >> window;
+
+        const ETcpMessage m = static_cast<ETcpMessage>(tcpmsg);
+        if (isRobotChannel(m))
+        {
+            sendToClient(client, CTcpMsgComposer(TCP_CHANNELSTATS) << tcpmsg << window <<
+                         getChannelStats(m, window));
+        }
+    }
+    else if (msg == TCP_GETLATENCYSTATS)
+    {
+        sendToClient(client, CTcpMsgComposer(TCP_LATENCYSTATS) <<
+                     static_cast<uint16_t>(serialToTcpLatency.getWindow()) <<
+                     getLatencyStats());
+    }
+    else if (msg == TCP_SETLUAPROFILE)
+    {
+        bool enable;
+        stream >> enable;
+
+        NLua::CLuaProfiler &profiler = luaInterface->getScheduler()->getProfiler();
+        if (enable)
+        {
+            profiler.start();
+            luaProfileTimer->start(1000);
+        }
+        else
+        {
+            profiler.stop();
+            luaProfileTimer->stop();
+            sendLuaProfile(); // Final results
+        }
     }
 }
 
+void CControl::sendLuaProfile()
+{
+    const NLua::CLuaProfiler &profiler = luaInterface->getScheduler()->getProfiler();
+    const QList<SLuaProfileEntry> entries(profiler.getProfile(MAX_LUA_PROFILE_ENTRIES));
+
+    msgWriter.clear();
+    msgWriter.begin(TCP_LUAPROFILE) << profiler.isActive() << profiler.getDuration() <<
+            profiler.getSamples() << static_cast<quint16>(entries.size());
+    foreach(const SLuaProfileEntry &e, entries)
+    {
+        msgWriter << e;
+    }
+    msgWriter.end();
+    send(msgWriter);
+}
+
 void CControl::enableRP6Slave()
 {
     serialPort->sendCommand("set power 1");
@@ -380,28 +443,77 @@ void CControl::enableRP6Slave()
 
 void CControl::sendTcpData()
 {
-    for (TTcpMap::iterator it=tcpDataMap.begin(); it!=tcpDataMap.end(); ++it)
+    const uint32_t time = getTimeMS();
+
+    if (hasUdpClients())
+        sendTelemetry(time);
+
+    // All data is send in one go
+    tcpDataWriter.clear();
+
+    // Age of new data (ms since it arrived from the serial port), so
+    // clients know how old the values they show are
+    quint8 fresh = 0;
+    for (int i=0; i<ROBOT_CHANNEL_COUNT; ++i)
+    {
+        if (tcpData[i].isFresh())
+            ++fresh;
+    }
+
+    if (fresh)
+    {
+        tcpDataWriter.begin(TCP_DATAAGE) << time << fresh;
+        for (int i=0; i<ROBOT_CHANNEL_COUNT; ++i)
+        {
+            if (!tcpData[i].isFresh())
+                continue;
+
+            const uint32_t age = tcpData[i].getAge(time);
+            serialToTcpLatency.addSample(age, time);
+            tcpDataWriter << static_cast<uint8_t>(robotChannels[i].tcpMessage) <<
+                             static_cast<uint16_t>(qMin(age, 0xFFFFu));
+            tcpData[i].markSent();
+        }
+        tcpDataWriter.end();
+    }
+
+    for (int i=0; i<ROBOT_CHANNEL_COUNT; ++i)
     {
-        switch (tcpDataTypes[it.key()])
+        if (!tcpData[i].hasData())
+            continue;
+
+        tcpDataWriter.begin(robotChannels[i].tcpMessage);
+
+        switch (robotChannels[i].dataType)
         {
             case DATA_BYTE:
-                tcpServer->send(it.key(), static_cast<uint8_t>(it.value().data()));
+                tcpDataWriter << static_cast<uint8_t>(tcpData[i].data(time));
                 break;
             case DATA_WORD:
             {
-                tcpServer->send(it.key(), static_cast<uint16_t>(it.value().data()));
+                tcpDataWriter << static_cast<uint16_t>(tcpData[i].data(time));
                 break;
             }
         }
 
-        it.value().clearAverage();
+        tcpDataWriter.end();
+    }
+
+    if (!tcpDataWriter.isEmpty())
+        send(tcpDataWriter, true);
+
+    // Not telemetry: clients using UDP want it as well
+    if (poseEstimator.getUpdates() != poseUpdatesSent)
+    {
+        send(TCP_POSE, poseEstimator.getPose());
+        poseUpdatesSent = poseEstimator.getUpdates();
     }
 }
 
 int CControl::luaScriptRunning(lua_State *l)
 {
     CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
-    control->tcpServer->send(TCP_SCRIPTRUNNING, static_cast<bool>(lua_toboolean(l, 1)));
+    control->send(TCP_SCRIPTRUNNING, static_cast<bool>(lua_toboolean(l, 1)));
     return 0;
 }
 
@@ -409,8 +521,9 @@ int CControl::luaExecCmd(lua_State *l)
 {
     CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
     const char *cmd = luaL_checkstring(l, 1);
+    const char *key = luaL_optstring(l, 2, NULL); // Coalescing key
     qDebug() << "Exec cmd: " << cmd << "\n";
-    control->serialPort->sendCommand(cmd);
+    control->serialPort->sendCommand(cmd, key);
     return 0;
 }
 
@@ -418,7 +531,7 @@ int CControl::luaSendText(lua_State *l)
 {
     CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
     const char *txt = luaL_checkstring(l, 1);
-    control->tcpServer->send(TCP_LUATEXT, QString(txt));
+    control->send(TCP_LUATEXT, txt);
     return 0;
 }
 
@@ -428,26 +541,17 @@ int CControl::luaSendMsg(lua_State *l)
     const char *msg = luaL_checkstring(l, 1);
     const int nargs = lua_gettop(l);
 
-    CTcpMsgComposer comp(TCP_LUAMSG);
-
-    comp << QString(msg);
-
+    // Encode first, in case of an error the writer isn't left half way
+    CLuaMsgEncoder &encoder = control->luaMsgEncoder;
+    encoder.clear();
     for (int i=2; i<=nargs; ++i)
-    {
-        switch (lua_type(l, i))
-        {
-        case LUA_TBOOLEAN: comp << static_cast<bool>(lua_toboolean(l, i)); break;
-        case LUA_TNUMBER: comp << static_cast<float>(lua_tonumber(l, i)); break;
-        default:
-            qWarning() << "Unknown type: " << lua_typename(l, i) <<
-                    ". Converting to string...";
-            // Fall through
-        case LUA_TSTRING: comp << QString(lua_tostring(l, i)); break;
-        case LUA_TTABLE: comp << NLua::convertLuaTable(l, i); break;
-        }
-    }
+        NLua::encodeLuaValue(l, i, encoder);
 
-    control->tcpServer->send(comp);
+    CTcpMsgWriter &comp = control->luaMsgWriter;
+    comp.clear();
+    comp.begin(TCP_LUAMSG) << msg << encoder.getData();
+    comp.end();
+    control->send(comp);
 
     return 0;
 }
@@ -462,27 +566,257 @@ int CControl::luaUpdate(lua_State *l)
 
 int CControl::luaGetTimeMS(lua_State *l)
 {
-    static timeval start, current;
-    static bool started = false;
+    lua_pushinteger(l, getTimeMS());
+    return 1;
+}
+
+int CControl::luaGetStats(lua_State *l)
+{
+    CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
+    const char *name = luaL_checkstring(l, 1);
+    ETcpMessage msg;
+
+    if (!control->getTcpMsgFromName(name, msg))
+        return luaL_error(l, "Unknown data channel: %s", name);
+
+    CWindowStats &stats = control->getTcpInfo(msg).getStats();
+    const int window = luaL_optint(l, 2, stats.getWindow());
+    const CWindowStats::SResult res = control->getChannelStats(msg, window);
+
+    lua_createtable(l, 0, 8);
+    lua_pushinteger(l, res.count);
+    lua_setfield(l, -2, "count");
+    lua_pushinteger(l, res.min);
+    lua_setfield(l, -2, "min");
+    lua_pushinteger(l, res.max);
+    lua_setfield(l, -2, "max");
+    lua_pushnumber(l, res.mean);
+    lua_setfield(l, -2, "mean");
+    lua_pushnumber(l, res.variance);
+    lua_setfield(l, -2, "variance");
+    lua_pushinteger(l, res.p50);
+    lua_setfield(l, -2, "p50");
+    lua_pushinteger(l, res.p90);
+    lua_setfield(l, -2, "p90");
+    lua_pushinteger(l, res.p99);
+    lua_setfield(l, -2, "p99");
+
+    return 1;
+}
+
+int CControl::luaGetSerialStats(lua_State *l)
+{
+    CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
+    const CSerialPort::SStats stats = control->serialPort->getStats();
+
+    lua_createtable(l, 0, 11);
+    lua_pushinteger(l, stats.parser.bytes);
+    lua_setfield(l, -2, "bytes");
+    lua_pushinteger(l, stats.parser.frames);
+    lua_setfield(l, -2, "frames");
+    lua_pushinteger(l, stats.parser.lines);
+    lua_setfield(l, -2, "lines");
+    lua_pushinteger(l, stats.parser.resyncs);
+    lua_setfield(l, -2, "resyncs");
+    lua_pushinteger(l, stats.framesPerSec);
+    lua_setfield(l, -2, "fps");
+    lua_pushinteger(l, stats.parseTimeUS);
+    lua_setfield(l, -2, "parsetime");
+    lua_pushinteger(l, stats.wakeups);
+    lua_setfield(l, -2, "wakeups");
+    lua_pushinteger(l, stats.readCalls);
+    lua_setfield(l, -2, "reads");
+    lua_pushnumber(l, stats.framesPerWakeup);
+    lua_setfield(l, -2, "framesperwakeup");
+    lua_pushinteger(l, stats.droppedFrames);
+    lua_setfield(l, -2, "droppedframes");
+    lua_pushinteger(l, stats.droppedLines);
+    lua_setfield(l, -2, "droppedlines");
+
+    return 1;
+}
+
+static void pushLatency(lua_State *l, const CSerialPort::SCommandLatency &lat)
+{
+    lua_createtable(l, 0, 5);
+    lua_pushinteger(l, lat.count);
+    lua_setfield(l, -2, "count");
+    lua_pushnumber(l, lat.min / 1000.0);
+    lua_setfield(l, -2, "min");
+    lua_pushnumber(l, lat.max / 1000.0);
+    lua_setfield(l, -2, "max");
+    lua_pushnumber(l, (lat.count) ? ((lat.total / lat.count) / 1000.0) : 0.0);
+    lua_setfield(l, -2, "mean");
+    lua_pushnumber(l, lat.last / 1000.0);
+    lua_setfield(l, -2, "last");
+}
 
-    if (!started)
+int CControl::luaGetCommandStats(lua_State *l)
+{
+    CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
+    const CSerialPort::SStats stats = control->serialPort->getStats();
+
+    lua_createtable(l, 0, 8);
+    lua_pushinteger(l, stats.commandsSent);
+    lua_setfield(l, -2, "sent");
+    lua_pushinteger(l, stats.retransmits);
+    lua_setfield(l, -2, "retransmits");
+    lua_pushinteger(l, stats.droppedCommands);
+    lua_setfield(l, -2, "dropped");
+    lua_pushinteger(l, stats.preemptedCommands);
+    lua_setfield(l, -2, "preempted");
+
+    // Time from receiving a stop command (TCP or script) until it was
+    // written to the serial port, in ms
+    pushLatency(l, stats.priorityLatency);
+    lua_setfield(l, -2, "priority");
+
+    // Acknowledge latency per command, in ms
+    lua_createtable(l, 0, SERIAL_CMD_MAX_INDEX);
+    for (int i=0; i<SERIAL_CMD_MAX_INDEX; ++i)
     {
-        gettimeofday(&start, NULL);
-        started = true;
+        const CSerialPort::SCommandLatency &lat = stats.commandLatency[i];
+        if (!lat.count)
+            continue;
+
+        pushLatency(l, lat);
+        lua_setfield(l, -2, getSerialCommandName(static_cast<ESerialCommand>(i)));
     }
+    lua_setfield(l, -2, "latency");
 
-    gettimeofday(&current, NULL);
-    lua_pushinteger(l, ((current.tv_sec-start.tv_sec) * 1000 ) +
-                    ((current.tv_usec-start.tv_usec) / 1000));
+    // Commands replaced by a newer one with the same key
+    lua_newtable(l);
+    for (int i=0; i<SSerialCommand::MAX_KEYS; ++i)
+    {
+        const QString key(control->serialPort->getCommandKeyName(i));
+        if (key.isEmpty())
+            break;
+        lua_pushinteger(l, stats.coalescedCommands[i]);
+        lua_setfield(l, -2, qPrintable(key));
+    }
+    lua_setfield(l, -2, "coalesced");
 
     return 1;
 }
 
+int CControl::luaGetSnapshot(lua_State *l)
+{
+    // Fills a table with the latest value of every channel (by stats name)
+    // and t.time with their serial arrival times (ms). The table given as
+    // argument is reused, otherwise a new one is created. Only the first
+    // call creates the tables, so scripts calling this every iteration only pay
+    // for setting fields.
+    CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
+
+    if (lua_istable(l, 1))
+        lua_settop(l, 1);
+    else
+    {
+        lua_settop(l, 0);
+        lua_createtable(l, 0, ROBOT_CHANNEL_COUNT + 8);
+    }
+
+    lua_getfield(l, 1, "time");
+    if (!lua_istable(l, -1))
+    {
+        lua_pop(l, 1);
+        lua_createtable(l, 0, ROBOT_CHANNEL_COUNT);
+        lua_pushvalue(l, -1);
+        lua_setfield(l, 1, "time");
+    }
+    const int timetab = lua_gettop(l);
+
+    for (int i=0; i<ROBOT_CHANNEL_COUNT; ++i)
+    {
+        const CTcpInfo &info = control->tcpData[i];
+        if (!info.hasData())
+            continue;
+
+        lua_pushinteger(l, info.latestData());
+        lua_setfield(l, 1, robotChannels[i].statsName);
+        lua_pushinteger(l, info.getTime());
+        lua_setfield(l, timetab, robotChannels[i].statsName);
+    }
+
+    // Decoded state sensors, like robot.sensors.*
+    SStateSensors state;
+    state.byte = control->getTcpInfo(TCP_STATE_SENSORS).latestData();
+    lua_pushboolean(l, state.bumperLeft);
+    lua_setfield(l, 1, "bumperleft");
+    lua_pushboolean(l, state.bumperRight);
+    lua_setfield(l, 1, "bumperright");
+    lua_pushboolean(l, state.ACSLeft);
+    lua_setfield(l, 1, "acsleft");
+    lua_pushboolean(l, state.ACSRight);
+    lua_setfield(l, 1, "acsright");
+    lua_pushboolean(l, state.movementComplete);
+    lua_setfield(l, 1, "movecomplete");
+
+    lua_pushinteger(l, getTimeMS());
+    lua_setfield(l, 1, "now");
+
+    lua_settop(l, 1);
+    return 1;
+}
+
+int CControl::luaWaitFor(lua_State *l)
+{
+    // waitfor(channel, [predicate], [timeout]): blocks the calling task
+    // until the channel (stats name) changes to a value accepted by
+    // predicate. Returns the value, or nil on timeout.
+    CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
+    const char *name = luaL_checkstring(l, 1);
+    ETcpMessage msg;
+
+    if (!control->getTcpMsgFromName(name, msg))
+        return luaL_error(l, "Unknown data channel: %s", name);
+
+    return control->luaInterface->getScheduler()->waitEvent(l, getChannelIndex(msg), 2,
+                                                            luaL_optint(l, 3, 0));
+}
+
+int CControl::luaGetPose(lua_State *l)
+{
+    // Returns x, y (cm), angle (degrees) and their variances. Everything is
+    // returned on the stack, so no table needs to be created.
+    CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
+    const SRobotPose pose = control->poseEstimator.getPose();
+
+    lua_pushnumber(l, pose.x);
+    lua_pushnumber(l, pose.y);
+    lua_pushnumber(l, pose.angle);
+    lua_pushnumber(l, pose.covariance[SRobotPose::COV_XX]);
+    lua_pushnumber(l, pose.covariance[SRobotPose::COV_YY]);
+    lua_pushnumber(l, pose.covariance[SRobotPose::COV_AA]);
+    lua_pushnumber(l, pose.covariance[SRobotPose::COV_XY]);
+
+    return 7;
+}
+
+int CControl::luaResetPose(lua_State *l)
+{
+    CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
+    control->poseEstimator.reset(luaL_optnumber(l, 1, 0.0), luaL_optnumber(l, 2, 0.0),
+                                 luaL_optnumber(l, 3, 0.0));
+    return 0;
+}
+
+int CControl::luaSetOdometry(lua_State *l)
+{
+    // Wheel base (mm), encoder resolution (mm/count), error factor (mm^2/mm)
+    CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
+    CPoseEstimator &pe = control->poseEstimator;
+    pe.setConfig(luaL_optnumber(l, 1, pe.getWheelBase()),
+                 luaL_optnumber(l, 2, pe.getEncoderResolution()),
+                 luaL_optnumber(l, 3, pe.getErrorFactor()));
+    return 0;
+}
+
 int CControl::luaGetGenericData(lua_State *l)
 {
     CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
     ETcpMessage msg = static_cast<ETcpMessage>(lua_tointeger(l, lua_upvalueindex(2)));
-    lua_pushinteger(l, control->tcpDataMap[msg].latestData());
+    lua_pushinteger(l, control->getTcpInfo(msg).latestData());
     return 1;
 }
 
@@ -491,7 +825,7 @@ int CControl::luaGetBumperLeft(lua_State *l)
     CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
     ETcpMessage msg = static_cast<ETcpMessage>(lua_tointeger(l, lua_upvalueindex(2)));
     SStateSensors state;
-    state.byte = control->tcpDataMap[msg].latestData();
+    state.byte = control->getTcpInfo(msg).latestData();
     lua_pushboolean(l, state.bumperLeft);
     return 1;
 }
@@ -501,7 +835,7 @@ int CControl::luaGetBumperRight(lua_State *l)
     CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
     ETcpMessage msg = static_cast<ETcpMessage>(lua_tointeger(l, lua_upvalueindex(2)));
     SStateSensors state;
-    state.byte = control->tcpDataMap[msg].latestData();
+    state.byte = control->getTcpInfo(msg).latestData();
     lua_pushboolean(l, state.bumperRight);
     return 1;
 }
@@ -511,7 +845,7 @@ int CControl::luaGetACSLeft(lua_State *l)
     CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
     ETcpMessage msg = static_cast<ETcpMessage>(lua_tointeger(l, lua_upvalueindex(2)));
     SStateSensors state;
-    state.byte = control->tcpDataMap[msg].latestData();
+    state.byte = control->getTcpInfo(msg).latestData();
     lua_pushboolean(l, state.ACSLeft);
     return 1;
 }
@@ -521,7 +855,7 @@ int CControl::luaGetACSRight(lua_State *l)
     CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
     ETcpMessage msg = static_cast<ETcpMessage>(lua_tointeger(l, lua_upvalueindex(2)));
     SStateSensors state;
-    state.byte = control->tcpDataMap[msg].latestData();
+    state.byte = control->getTcpInfo(msg).latestData();
     lua_pushboolean(l, state.ACSRight);
     return 1;
 }
@@ -531,7 +865,7 @@ int CControl::luaGetMoveComplete(lua_State *l)
     CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
     ETcpMessage msg = static_cast<ETcpMessage>(lua_tointeger(l, lua_upvalueindex(2)));
     SStateSensors state;
-    state.byte = control->tcpDataMap[msg].latestData();
+    state.byte = control->getTcpInfo(msg).latestData();
     lua_pushboolean(l, state.movementComplete);
     return 1;
 }
@@ -541,7 +875,7 @@ int CControl::luaGetMotorDirLeft(lua_State *l)
     CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
     ETcpMessage msg = static_cast<ETcpMessage>(lua_tointeger(l, lua_upvalueindex(2)));
     SMotorDirections dir;
-    dir.byte = control->tcpDataMap[msg].latestData();
+    dir.byte = control->getTcpInfo(msg).latestData();
     lua_pushstring(l, moveDirToLuaStr(dir.left));
     return 1;
 }
@@ -551,7 +885,7 @@ int CControl::luaGetMotorDirRight(lua_State *l)
     CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
     ETcpMessage msg = static_cast<ETcpMessage>(lua_tointeger(l, lua_upvalueindex(2)));
     SMotorDirections dir;
-    dir.byte = control->tcpDataMap[msg].latestData();
+    dir.byte = control->getTcpInfo(msg).latestData();
     lua_pushstring(l, moveDirToLuaStr(dir.right));
     return 1;
 }
@@ -560,7 +894,7 @@ int CControl::luaGetACSPower(lua_State *l)
 {
     CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
     ETcpMessage msg = static_cast<ETcpMessage>(lua_tointeger(l, lua_upvalueindex(2)));
-    EACSPowerState state = static_cast<EACSPowerState>(control->tcpDataMap[msg].latestData());
+    EACSPowerState state = static_cast<EACSPowerState>(control->getTcpInfo(msg).latestData());
 
     switch (state)
     {
@@ -578,7 +912,7 @@ int CControl::luaGetRC5Key(lua_State *l)
     CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
     ETcpMessage msg = static_cast<ETcpMessage>(lua_tointeger(l, lua_upvalueindex(2)));
     RC5data_t rc5;
-    rc5.data = control->tcpDataMap[msg].latestData();
+    rc5.data = control->getTcpInfo(msg).latestData();
     lua_pushnumber(l, rc5.key_code);
     return 1;
 }
@@ -588,7 +922,7 @@ int CControl::luaGetRC5Device(lua_State *l)
     CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
     ETcpMessage msg = static_cast<ETcpMessage>(lua_tointeger(l, lua_upvalueindex(2)));
     RC5data_t rc5;
-    rc5.data = control->tcpDataMap[msg].latestData();
+    rc5.data = control->getTcpInfo(msg).latestData();
     lua_pushnumber(l, rc5.device);
     return 1;
 }
@@ -598,38 +932,196 @@ int CControl::luaGetRC5Toggle(lua_State *l)
     CControl *control = static_cast<CControl *>(lua_touserdata(l, lua_upvalueindex(1)));
     ETcpMessage msg = static_cast<ETcpMessage>(lua_tointeger(l, lua_upvalueindex(2)));
     RC5data_t rc5;
-    rc5.data = control->tcpDataMap[msg].latestData();
+    rc5.data = control->getTcpInfo(msg).latestData();
     lua_pushboolean(l, rc5.toggle_bit);
     return 1;
 }
 
-void CControl::daemonMsgHandler(QtMsgType type, const char *msg)
+
+CServer::CServer(QObject *parent) : QObject(parent), logger(0), scriptStore(0)
 {
-    QFile logfile("server.log");
-    QFile::OpenMode om = QFile::WriteOnly;
+    QStringList args(QCoreApplication::arguments());
+    QStringList ports;
+    QString preva, loglevels;
+    bool daemonize = false, textcommands = false, lowlatency = true;
+    int luamemlimit = 64; // MB
 
-    if (logfile.size() > (1024 * 1024 * 1024))
-        om |= QFile::Truncate;
-    else
-        om |= QFile::Append;
+    foreach(QString a, args)
+    {
+        if (preva == "-d") // Can be given multiple times, one robot each
+            ports << a;
+        else if (preva == "-l")
+            loglevels = a;
+        else if (preva == "-m") // Per robot, 0 for no limit
+            luamemlimit = a.toInt();
+        else if (a == "-D")
+            daemonize = true;
+        else if (a == "-t")
+            textcommands = true;
+        else if (a == "-L")
+            lowlatency = false;
+        preva = a;
+    }
 
-    if (logfile.open(om))
+    if (ports.isEmpty())
+        ports << "/dev/ttyUSB0";
+
+    if (daemonize)
     {
-        QTextStream stream(&logfile);
+        logger = new CLogger(this, "server.log");
+        logger->parseLevels(loglevels);
+        logger->install();
+
+        if (daemon(1, 0) == -1) // Keep working dir, close standard fd's
+            qFatal("Failed to daemonize!");
+
+        // Threads don't survive daemon(), so only start writing afterwards
+        logger->start(QThread::LowPriority);
+    }
+
+    // Next to the settings file
+    scriptStore = new CScriptStore(QFileInfo(QSettings().fileName()).absolutePath() +
+                                   "/scripts");
+
+    tcpServer = new CTcpServer(this);
+    connect(tcpServer, SIGNAL(newConnection(QTcpSocket *)), this,
+            SLOT(clientConnected(QTcpSocket *)));
+    connect(tcpServer, SIGNAL(connectionClosed()), this, SLOT(updateClientCounts()));
+    connect(tcpServer, SIGNAL(clientTcpReceived(QTcpSocket *, const QByteArray &)), this,
+            SLOT(parseClientTcp(QTcpSocket *, const QByteArray &)));
+
+    for (int i=0; i<ports.size(); ++i)
+    {
+        SRobot robot;
+        robot.control = new CControl(i, ports[i], textcommands, lowlatency, scriptStore,
+                                     static_cast<size_t>(luamemlimit) * 1024 * 1024);
+        robot.thread = new QThread(this);
+        robot.control->moveToThread(robot.thread);
+
+        connect(robot.control, SIGNAL(tcpSend(int, const QByteArray &, bool)), this,
+                SLOT(robotTcpSend(int, const QByteArray &, bool)));
+        connect(robot.control, SIGNAL(tcpSendClient(qulonglong, const QByteArray &)), this,
+                SLOT(robotTcpSendClient(qulonglong, const QByteArray &)));
+        connect(robot.control, SIGNAL(telemetrySend(int, const QByteArray &)), this,
+                SLOT(robotTelemetrySend(int, const QByteArray &)));
+
+        robot.thread->start();
+        QMetaObject::invokeMethod(robot.control, "init", Qt::QueuedConnection);
+        robots << robot;
+
+        qDebug() << "Robot" << i << "on" << ports[i];
+    }
+}
+
+CServer::~CServer()
+{
+    foreach(SRobot robot, robots)
+    {
+        QMetaObject::invokeMethod(robot.control, "shutdown", Qt::BlockingQueuedConnection);
+        robot.thread->quit();
+        robot.thread->wait();
+        delete robot.control;
+    }
+
+    delete scriptStore;
+}
+
+void CServer::selectRobot(QTcpSocket *socket, int robot)
+{
+    if ((robot < 0) || (robot >= robots.size()))
+    {
+        qWarning() << "Client selected unknown robot" << robot;
+        return;
+    }
+
+    tcpServer->setClientRobot(socket, robot);
+    updateClientCounts();
+    QMetaObject::invokeMethod(robots[robot].control, "clientConnected", Qt::QueuedConnection);
+}
+
+void CServer::clientConnected(QTcpSocket *socket)
+{
+    QStringList names;
+    foreach(SRobot robot, robots)
+        names << robot.control->getPortName();
+
+    socket->write(CTcpMsgComposer(TCP_ROBOTLIST) << names);
+    selectRobot(socket, 0);
+}
 
-        stream << QDateTime::currentDateTime().toString() << " - ";
+void CServer::updateClientCounts()
+{
+    for (int i=0; i<robots.size(); ++i)
+        robots[i].control->setClientCount(tcpServer->getClientCount(i),
+                                          tcpServer->getUdpClientCount(i));
+}
 
-        switch (type)
+void CServer::parseClientTcp(QTcpSocket *socket, const QByteArray &block)
+{
+    const uint64_t receivetime = getTimeUS();
+
+    if (block.isEmpty())
+        return;
+
+    const ETcpMessage msg = static_cast<ETcpMessage>(static_cast<uint8_t>(block[0]));
+
+    // Messages about the connection itself, everything else is for the
+    // selected robot
+    if ((msg == TCP_SELECTROBOT) || (msg == TCP_UDPTELEMETRY) || (msg == TCP_SETCOMPRESSION))
+    {
+        QDataStream stream(block);
+        stream.setVersion(QDataStream::Qt_4_4);
+        uint8_t m;
+        stream >> m;
+
+        if (msg == TCP_SELECTROBOT)
+        {
+            uint8_t robot;
+            stream >> robot;
+            selectRobot(socket, robot);
+        }
+        else if (msg == TCP_UDPTELEMETRY)
         {
-        case QtDebugMsg: stream << "[Debug]: "; break;
-        case QtWarningMsg: stream << "[Warning]: "; break;
-        case QtCriticalMsg: stream << "[Critical]: "; break;
-        case QtFatalMsg: stream << "[Fatal]: "; break;
+            uint16_t port;
+            stream >> port;
+            tcpServer->setClientUdpPort(socket, port);
+            updateClientCounts();
         }
+        else
+        {
+            uint8_t c;
+            stream >> c;
+
+            // Codecs this server doesn't know are refused
+            const ETcpCodec codec =
+                    (c == TCP_CODEC_DEFLATE) ? TCP_CODEC_DEFLATE : TCP_CODEC_NONE;
+            tcpServer->setClientCodec(socket, codec);
+            socket->write(CTcpMsgComposer(TCP_COMPRESSION) << static_cast<uint8_t>(codec));
+        }
+    }
+    else
+    {
+        QMetaObject::invokeMethod(robots[tcpServer->getClientRobot(socket)].control,
+                                  "parseClientTcp", Qt::QueuedConnection,
+                                  Q_ARG(QByteArray, block),
+                                  Q_ARG(qulonglong, receivetime),
+                                  Q_ARG(qulonglong, tcpServer->getClientID(socket)));
+    }
+}
 
-        stream << " " << msg << "\n";
+void CServer::robotTcpSend(int robot, const QByteArray &data, bool telemetry)
+{
+    tcpServer->send(robot, data, telemetry);
+}
 
-        if (type == QtFatalMsg)
-            abort();
-    }
+void CServer::robotTcpSendClient(qulonglong client, const QByteArray &data)
+{
+    // The client may have disconnected meanwhile, so it's identified by its
+    // ID instead of the socket, whose address may be reused
+    tcpServer->sendToClient(client, data);
+}
+
+void CServer::robotTelemetrySend(int robot, const QByteArray &datagram)
+{
+    tcpServer->sendTelemetry(robot, datagram);
 }
@@ -1,92 +1,151 @@
 #ifndef CONTROL_H
 #define CONTROL_H
 
+#include <QList>
 #include <QMap>
 #include <QObject>
 
 #include "lua.h"
+#include "luamsg.h"
+#include "poseestimator.h"
 #include "shared.h"
+#include "tcputil.h"
+#include "windowstats.h"
 
+class CLogger;
+class CScriptStore;
 class CSerialPort;
 class CTcpServer;
+class QTcpSocket;
+class QThread;
 class QTimer;
 
+// Controls one robot: its serial port, Lua state and channel data. Every
+// robot runs in its own thread, data to and from clients is passed through
+// CServer.
 class CControl: public QObject
 {
     Q_OBJECT
   
-    struct SSerial2TcpInfo
-    {
-        ETcpMessage tcpMessage;
-        const char *luaFunc;
-        SSerial2TcpInfo(void) {}
-        SSerial2TcpInfo(ETcpMessage m, const char *l) : tcpMessage(m), luaFunc(l) {}
-    };
-
-    typedef QMap<QString, QVariant> TLuaScriptMap;
-    typedef QMap<ESerialMessage, SSerial2TcpInfo> TSerial2TcpMap;
-
     class CTcpInfo
     {
-        int32_t total, count, latest;
+        int32_t latest;
+        uint32_t latestTime; // Serial arrival of latest data
+        bool averaged, received, fresh;
+        CWindowStats stats;
 
     public:
-        CTcpInfo(void) : total(0), count(0), latest(0) { }
+        CTcpInfo(void) : latest(0), latestTime(0), averaged(false), received(false),
+                         fresh(false) { }
 
-        int32_t data(void) const
+        // Averaged data is the mean over the stats window, independent
+        // from the TCP send interval.
+        int32_t data(uint32_t time)
         {
-            if (count > 0)
-                return total / count;
+            stats.expire(time);
+            if (averaged && !stats.isEmpty())
+                return stats.mean();
             return latest;
         }
 
         int32_t latestData(void) const { return latest; }
-
-        void addData(int32_t data)
+        bool hasData(void) const { return received; }
+        // Averaged data is as old as its newest sample
+        uint32_t getAge(uint32_t time) const { return time - latestTime; }
+        uint32_t getTime(void) const { return latestTime; }
+        // Received since the last TCP update?
+        bool isFresh(void) const { return fresh; }
+        void markSent(void) { fresh = false; }
+
+        void addData(int32_t data, uint32_t time)
         {
-            total += data;
-            ++count;
             latest = data;
+            latestTime = time;
+            averaged = received = fresh = true;
+            stats.addSample(data, time);
         }
 
-        void setData(int32_t data)
+        void setData(int32_t data, uint32_t time)
         {
             latest = data;
-            total = data;
-            count = 1;
+            latestTime = time;
+            averaged = false;
+            received = fresh = true;
+            stats.addSample(data, time);
         }
 
-        void clearAverage(void) { total = count = 0; }
+        CWindowStats &getStats(void) { return stats; }
     };
 
-    typedef QMap<ETcpMessage, CTcpInfo> TTcpMap;
-
+    int robotID;
+    QString portName;
+    bool textCommands, lowLatency;
+    size_t luaMemoryLimit;
     CSerialPort *serialPort;
-    CTcpServer *tcpServer;
-    TSerial2TcpMap serial2TcpMap;
-    TTcpMap tcpDataMap;
-    QTimer *sendTcpTimer;
-
-    void initSerial2TcpMap(void);
+    NLua::CLuaInterface *luaInterface;
+    CScriptStore *scriptStore;
+    QAtomicInt clientCount, udpClientCount; // Set by CServer
+    CTcpInfo tcpData[ROBOT_CHANNEL_COUNT]; // Indexed by getChannelIndex()
+    QTimer *sendTcpTimer, *luaProfileTimer;
+    quint32 telemetrySequence;
+    CWindowStats serialToTcpLatency; // Age of new data when sent to clients
+    CPoseEstimator poseEstimator;
+    uint32_t poseUpdatesSent;
+    enum { MAX_LUA_PROFILE_ENTRIES = 64 };
+
+    CTcpMsgWriter tcpDataWriter, telemetryWriter, luaMsgWriter, msgWriter;
+    CLuaMsgEncoder luaMsgEncoder;
+
+    CTcpInfo &getTcpInfo(ETcpMessage msg) { return tcpData[getChannelIndex(msg)]; }
+    void send(const CTcpMsgWriter &writer, bool telemetry=false)
+    { emit tcpSend(robotID, QByteArray(writer.data(), writer.size()), telemetry); }
+    void send(const QByteArray &data) { emit tcpSend(robotID, data, false); }
+    // Only to the client that sent the message being handled (parseClientTcp())
+    void sendToClient(qulonglong client, const QByteArray &data)
+    { emit tcpSendClient(client, data); }
+    template <typename C> void send(ETcpMessage msg, const C &value)
+    {
+        msgWriter.clear();
+        msgWriter.begin(msg) << value;
+        msgWriter.end();
+        send(msgWriter, isRobotChannel(msg));
+    }
+    bool hasConnections(void) const { return clientCount != 0; }
+    bool hasUdpClients(void) const { return udpClientCount != 0; }
     void initLua(void);
     void registerLuaDataFunc(const char *name, ETcpMessage msg,
                              const char *submod=NULL,
                              lua_CFunction func=luaGetGenericData);
     void registerLuaRobotModule(void);
-    void runScript(const QByteArray &script);
-    TLuaScriptMap getLuaScripts(void);
+    void runScript(const QByteArray &script, const QString &name=QString(),
+                   int priority=0);
     void sendLuaScripts(void);
+    void sendTelemetry(uint32_t time);
+    bool getTcpMsgFromName(const char *name, ETcpMessage &msg) const;
+    CWindowStats::SResult getChannelStats(ETcpMessage msg, uint32_t window);
+    CWindowStats::SResult getLatencyStats(void);
 
 private slots:
+    void init(void);
+    void shutdown(void);
     void handleSerialText(const QByteArray &text);
-    void handleSerialMSG(ESerialMessage msg, const QByteArray &data);
+    void handleSerialMSG(ESerialMessage msg, const QByteArray &data, uint32_t time);
     void clientConnected(void);
-    void parseClientTcp(QDataStream &stream);
+    // receivetime: getTimeUS(), client: ID of the sender (see CTcpServer), for sendToClient()
+    void parseClientTcp(const QByteArray &block, qulonglong receivetime, qulonglong client);
     void enableRP6Slave(void);
     void sendTcpData(void);
+    void sendLuaProfile(void);
     
 public:
-    CControl(QObject *parent);
+    // luamemlimit: bytes, 0 for no limit
+    CControl(int id, const QString &port, bool textcommands, bool lowlatency,
+             CScriptStore *store, size_t luamemlimit);
+
+    int getID(void) const { return robotID; }
+    const QString &getPortName(void) const { return portName; }
+    // Thread safe
+    void setClientCount(int tcp, int udp) { clientCount = tcp; udpClientCount = udp; }
 
     // Lua bindings
     static int luaScriptRunning(lua_State *l);
@@ -95,6 +154,14 @@ public:
     static int luaSendMsg(lua_State *l);
     static int luaUpdate(lua_State *l);
     static int luaGetTimeMS(lua_State *l);
+    static int luaGetStats(lua_State *l);
+    static int luaGetSerialStats(lua_State *l);
+    static int luaGetCommandStats(lua_State *l);
+    static int luaGetSnapshot(lua_State *l);
+    static int luaWaitFor(lua_State *l);
+    static int luaGetPose(lua_State *l);
+    static int luaResetPose(lua_State *l);
+    static int luaSetOdometry(lua_State *l);
     static int luaGetGenericData(lua_State *l);
     static int luaGetBumperLeft(lua_State *l);
     static int luaGetBumperRight(lua_State *l);
@@ -108,7 +175,42 @@ public:
     static int luaGetRC5Device(lua_State *l);
     static int luaGetRC5Toggle(lua_State *l);
 
-    static void daemonMsgHandler(QtMsgType type, const char *msg);
+signals:
+    void tcpSend(int robot, const QByteArray &data, bool telemetry);
+    void tcpSendClient(qulonglong client, const QByteArray &data);
+    void telemetrySend(int robot, const QByteArray &datagram);
+};
+
+// Owns the TCP server and all robots (one per serial port). Clients select
+// the robot they talk to with TCP_SELECTROBOT.
+class CServer: public QObject
+{
+    Q_OBJECT
+
+    struct SRobot
+    {
+        CControl *control;
+        QThread *thread;
+    };
+
+    CLogger *logger;
+    CScriptStore *scriptStore;
+    CTcpServer *tcpServer;
+    QList<SRobot> robots;
+
+    void selectRobot(QTcpSocket *socket, int robot);
+
+private slots:
+    void clientConnected(QTcpSocket *socket);
+    void updateClientCounts(void);
+    void parseClientTcp(QTcpSocket *socket, const QByteArray &block);
+    void robotTcpSend(int robot, const QByteArray &data, bool telemetry);
+    void robotTcpSendClient(qulonglong client, const QByteArray &data);
+    void robotTelemetrySend(int robot, const QByteArray &datagram);
+
+public:
+    CServer(QObject *parent);
+    ~CServer(void);
 };
 
 #endif
@@ -1,24 +1,46 @@
 TEMPLATE = app
 TARGET = server
 HEADERS += serial.h \
+    logger.h \
+    serialcommand.h \
+    serialparser.h \
+    spscqueue.h \
+    timeutil.h \
     server.h \
     tcp.h \
     shared.h \
     lua.h \
+    luaalloc.h \
+    ../../shared/luamsg.h \
+    luaprofiler.h \
     ../../shared/tcputil.h \
-    luanav.h
+    ../../shared/windowstats.h \
+    luanav.h \
+    luascheduler.h \
+    poseestimator.h \
+    scriptstore.h
 SOURCES += serial.cpp \
+    logger.cpp \
+    serialcommand.cpp \
+    serialparser.cpp \
+    timeutil.cpp \
     tcp.cpp \
     server.cpp \
     main.cpp \
     lua.cpp \
+    luaalloc.cpp \
+    ../../shared/luamsg.cpp \
+    luaprofiler.cpp \
     ../../shared/pathengine.cpp \
-    luanav.cpp
+    ../../shared/windowstats.cpp \
+    luanav.cpp \
+    luascheduler.cpp \
+    poseestimator.cpp \
+    scriptstore.cpp
 
 QT += network
 QT -= gui
-INCLUDEPATH += ../qextserialport/include
-LIBS += -lqextserialport
+include(../../rp6simul/qextserialport/qextserialport.pri)
 INCLUDEPATH += ../../shared
 DEPENDPATH += ../../shared
 SOURCES += tcputil.cpp
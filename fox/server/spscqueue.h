@@ -0,0 +1,42 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <QAtomicInt>
+
+// Bounded lock-free queue for exactly one producer and one consumer thread.
+// Items are filled and read in place: the producer gets a free slot with
+// getWriteSlot() and publishes it with push(), the consumer reads the
+// oldest item with front() and releases it with pop().
+// N must be a power of two.
+template <typename T, unsigned N> class CSPSCQueue
+{
+    T items[N];
+    QAtomicInt head, tail; // head is written by the producer, tail by the consumer
+
+    static unsigned index(int i) { return static_cast<unsigned>(i) & (N - 1); }
+
+public:
+    CSPSCQueue(void) : head(0), tail(0) { }
+
+    // Producer side
+    T *getWriteSlot(void)
+    {
+        const int h = head;
+        if (static_cast<unsigned>(h - tail.fetchAndAddAcquire(0)) == N)
+            return 0; // Full
+        return &items[index(h)];
+    }
+    void push(void) { head.fetchAndAddRelease(1); }
+
+    // Consumer side
+    T *front(void)
+    {
+        const int t = tail;
+        if (head.fetchAndAddAcquire(0) == t)
+            return 0; // Empty
+        return &items[index(t)];
+    }
+    void pop(void) { tail.fetchAndAddRelease(1); }
+};
+
+#endif
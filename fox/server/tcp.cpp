@@ -5,7 +5,7 @@
 
 #include "tcp.h"
 
-CTcpServer::CTcpServer(QObject *parent) : QObject(parent)
+CTcpServer::CTcpServer(QObject *parent) : QObject(parent), nextClientID(1)
 {
     tcpServer = new QTcpServer(this);
     if (!tcpServer->listen(QHostAddress::Any, 40000))
@@ -14,6 +14,11 @@ CTcpServer::CTcpServer(QObject *parent) : QObject(parent)
         QCoreApplication::exit(1);
         return;
     }
+
+    // Telemetry side channel, only used for clients that ask for it
+    udpSocket = new QUdpSocket(this);
+    if (!udpSocket->bind(QHostAddress::Any, UDP_TELEMETRY_PORT))
+        qWarning() << "Failed to bind UDP telemetry socket:" << udpSocket->errorString();
     
     connect(tcpServer, SIGNAL(newConnection()), this, SLOT(clientConnected()));
     
@@ -38,49 +43,192 @@ void CTcpServer::clientConnected()
     connect(socket, SIGNAL(readyRead()), clientDataMapper, SLOT(map()));
     clientDataMapper->setMapping(socket, socket);
     
-    clientInfo[socket] = 0;
+    SClientInfo &info = clientInfo[socket];
+    info.id = nextClientID++;
+    clientSockets[info.id] = socket;
 
-    emit newConnection();
+    emit newConnection(socket);
 }
 
 void CTcpServer::clientDisconnected(QObject *obj)
 {
-    clientInfo.remove(qobject_cast<QTcpSocket *>(obj));
+    const SClientInfo info(clientInfo.take(qobject_cast<QTcpSocket *>(obj)));
+    clientSockets.remove(info.id);
     qDebug() << "Client disconnected";
+
+    if (info.codec != TCP_CODEC_NONE)
+    {
+        qDebug() << "Compression" << getTcpCodecName(info.codec) << ": sent" <<
+                info.sentCompression.messages << "messages at" <<
+                info.sentCompression.getRatio() << "%, received" <<
+                info.receivedCompression.messages << "messages at" <<
+                info.receivedCompression.getRatio() << "%";
+    }
+
     obj->deleteLater();
+    emit connectionClosed();
 }
 
 void CTcpServer::clientHasData(QObject *obj)
 {
     QTcpSocket *socket = qobject_cast<QTcpSocket *>(obj);
-    qDebug() << "Received client data\n";
+    qDebug() << "[tcp] Received client data";
 
     QDataStream in(socket);
     in.setVersion(QDataStream::Qt_4_4);
     
     while (true)
     {
-        if (clientInfo[socket] == 0)
+        SClientInfo &info = clientInfo[socket];
+
+        if (info.blockSize == 0)
         {
             if (socket->bytesAvailable() < (int)sizeof(quint32))
                 return;
             
-            in >> clientInfo[socket];
+            in >> info.blockSize;
         }
         
-        if (socket->bytesAvailable() < clientInfo[socket])
+        if (socket->bytesAvailable() < info.blockSize)
             return;
-        
-        clientTcpReceived(in);
-        clientInfo[socket] = 0;
+
+        // Messages are handled by the thread of the robot they are meant
+        // for, so they have to be taken out of the socket.
+        const QByteArray block(socket->read(info.blockSize));
+        info.blockSize = 0;
+
+        if (!block.isEmpty() && (static_cast<uint8_t>(block[0]) == TCP_COMPRESSED))
+        {
+            QDataStream stream(block);
+            stream.setVersion(QDataStream::Qt_4_4);
+            quint8 msg, codec;
+            QByteArray data;
+            stream >> msg >> codec >> data;
+
+            const QList<QByteArray> blocks(splitTcpMessages(
+                    uncompressTcpMessages(static_cast<ETcpCodec>(codec), data,
+                                          &info.receivedCompression)));
+            foreach(QByteArray b, blocks)
+            {
+                emit clientTcpReceived(socket, b);
+                if (!clientInfo.contains(socket))
+                    return;
+            }
+        }
+        else
+            emit clientTcpReceived(socket, block);
+
+        if (!clientInfo.contains(socket)) // Disconnected meanwhile
+            return;
+    }
+}
+
+void CTcpServer::write(QTcpSocket *socket, SClientInfo &info, const char *data, int size,
+                       QByteArray &compressed, bool &triedcompress)
+{
+    if ((info.codec != TCP_CODEC_NONE) && (size >= TCP_COMPRESS_THRESHOLD))
+    {
+        if (!triedcompress) // Deflate is the only codec
+        {
+            compressed = compressTcpMessages(info.codec, data, size);
+            triedcompress = true;
+        }
+
+        if (!compressed.isEmpty())
+        {
+            ++info.sentCompression.messages;
+            info.sentCompression.rawBytes += size;
+            info.sentCompression.compressedBytes += compressed.size();
+            socket->write(compressed);
+            return;
+        }
+    }
+
+    socket->write(data, size);
+}
+
+void CTcpServer::send(int robot, const char *data, int size, bool telemetry)
+{
+    // Compressed once, for all clients that want it
+    QByteArray compressed;
+    bool triedcompress = false;
+
+    for (TClientInfoMap::iterator it=clientInfo.begin(); it!=clientInfo.end(); ++it)
+    {
+        if ((it.value().robot == robot) && (!telemetry || !it.value().udpPort))
+            write(it.key(), it.value(), data, size, compressed, triedcompress);
     }
 }
 
-void CTcpServer::send(const QByteArray &by)
+void CTcpServer::sendToClient(qulonglong client, const QByteArray &data)
 {
-    for (QMap<QTcpSocket *, quint32>::iterator it=clientInfo.begin();
-        it!=clientInfo.end(); ++it)
+    QTcpSocket *socket = clientSockets.value(client);
+    TClientInfoMap::iterator it = clientInfo.find(socket);
+    if (it == clientInfo.end())
+        return;
+
+    QByteArray compressed;
+    bool triedcompress = false;
+    write(socket, it.value(), data.constData(), data.size(), compressed, triedcompress);
+}
+
+void CTcpServer::sendTelemetry(int robot, const QByteArray &datagram)
+{
+    for (TClientInfoMap::iterator it=clientInfo.begin(); it!=clientInfo.end(); ++it)
+    {
+        if ((it.value().robot == robot) && it.value().udpPort)
+            udpSocket->writeDatagram(datagram, it.key()->peerAddress(), it.value().udpPort);
+    }
+}
+
+void CTcpServer::setClientUdpPort(QTcpSocket *socket, quint16 port)
+{
+    if (clientInfo.contains(socket))
+    {
+        clientInfo[socket].udpPort = port;
+        qDebug() << "UDP telemetry for client" << socket->peerAddress() << "port:" << port;
+    }
+}
+
+void CTcpServer::setClientRobot(QTcpSocket *socket, int robot)
+{
+    if (clientInfo.contains(socket))
+    {
+        clientInfo[socket].robot = robot;
+        qDebug() << "Client" << socket->peerAddress() << "selected robot" << robot;
+    }
+}
+
+void CTcpServer::setClientCodec(QTcpSocket *socket, ETcpCodec codec)
+{
+    if (clientInfo.contains(socket))
+    {
+        clientInfo[socket].codec = codec;
+        qDebug() << "Client" << socket->peerAddress() << "uses compression:" <<
+                getTcpCodecName(codec);
+    }
+}
+
+int CTcpServer::getClientCount(int robot) const
+{
+    int ret = 0;
+    for (TClientInfoMap::const_iterator it=clientInfo.begin(); it!=clientInfo.end(); ++it)
+    {
+        if (it.value().robot == robot)
+            ++ret;
+    }
+
+    return ret;
+}
+
+int CTcpServer::getUdpClientCount(int robot) const
+{
+    int ret = 0;
+    for (TClientInfoMap::const_iterator it=clientInfo.begin(); it!=clientInfo.end(); ++it)
     {
-        it.key()->write(by);
+        if ((it.value().robot == robot) && it.value().udpPort)
+            ++ret;
     }
+
+    return ret;
 }
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 
+#include <QHash>
 #include <QMap>
 #include <QObject>
 #include <QTcpSocket>
@@ -12,14 +13,36 @@
 
 class QSignalMapper;
 class QTcpServer;
+class QUdpSocket;
 
 class CTcpServer: public QObject
 {
     Q_OBJECT
 
+    struct SClientInfo
+    {
+        qulonglong id; // Unique for the lifetime of the server, unlike the socket address
+        quint32 blockSize;
+        quint16 udpPort; // 0 if client doesn't want UDP telemetry
+        int robot; // Selected robot, see TCP_SELECTROBOT
+        ETcpCodec codec; // See TCP_SETCOMPRESSION
+        STcpCompressionStats sentCompression, receivedCompression;
+        SClientInfo(void) : id(0), blockSize(0), udpPort(0), robot(0), codec(TCP_CODEC_NONE) { }
+    };
+
+    typedef QMap<QTcpSocket *, SClientInfo> TClientInfoMap;
+
     QTcpServer *tcpServer;
+    QUdpSocket *udpSocket;
     QSignalMapper *disconnectMapper, *clientDataMapper;
-    QMap<QTcpSocket *, quint32> clientInfo;
+    TClientInfoMap clientInfo;
+    QHash<qulonglong, QTcpSocket *> clientSockets; // ID -> socket
+    qulonglong nextClientID;
+
+    // compressed: shared by all clients getting the same data, empty if
+    // compression didn't pay off (tried is set)
+    void write(QTcpSocket *socket, SClientInfo &info, const char *data, int size,
+               QByteArray &compressed, bool &triedcompress);
 
 private slots:
     void clientConnected(void);
@@ -28,19 +51,30 @@ private slots:
 
 public:
     CTcpServer(QObject *parent);
-    void send(const QByteArray &by);
 
-    // Convenience function
-    template <typename C> void send(ETcpMessage msg, const C &value)
-    {
-        send(CTcpMsgComposer(msg) << value);
-    }
+    // Data is only sent to clients that selected the given robot.
+    // Telemetry is skipped for clients that receive it through UDP
+    void send(int robot, const char *data, int size, bool telemetry=false);
+    void send(int robot, const QByteArray &by, bool telemetry=false)
+    { send(robot, by.constData(), by.size(), telemetry); }
+    // Does nothing if the client disconnected
+    void sendToClient(qulonglong client, const QByteArray &data);
+    void sendTelemetry(int robot, const QByteArray &datagram);
+    void setClientUdpPort(QTcpSocket *socket, quint16 port);
+    void setClientRobot(QTcpSocket *socket, int robot);
+    // Large messages are compressed from now on (unless codec is TCP_CODEC_NONE)
+    void setClientCodec(QTcpSocket *socket, ETcpCodec codec);
+    int getClientRobot(QTcpSocket *socket) const { return clientInfo.value(socket).robot; }
+    qulonglong getClientID(QTcpSocket *socket) const { return clientInfo.value(socket).id; }
 
-    bool hasConnections(void) const { return !clientInfo.isEmpty(); }
+    int getClientCount(int robot) const;
+    int getUdpClientCount(int robot) const;
 
 signals:
-    void newConnection(void);
-    void clientTcpReceived(QDataStream &stream);
+    void newConnection(QTcpSocket *socket);
+    void connectionClosed(void);
+    // block contains one complete message
+    void clientTcpReceived(QTcpSocket *socket, const QByteArray &block);
 };
 
 #endif
@@ -0,0 +1,33 @@
+#include <sys/time.h>
+
+#include "timeutil.h"
+
+namespace {
+
+timeval getStartTime(void)
+{
+    timeval ret;
+    gettimeofday(&ret, NULL);
+    return ret;
+}
+
+// Initialized before main(), so no threads are racing for it
+const timeval startTime = getStartTime();
+
+}
+
+uint32_t getTimeMS()
+{
+    timeval current;
+    gettimeofday(&current, NULL);
+    return ((current.tv_sec-startTime.tv_sec) * 1000) +
+            ((current.tv_usec-startTime.tv_usec) / 1000);
+}
+
+uint64_t getTimeUS()
+{
+    timeval current;
+    gettimeofday(&current, NULL);
+    return (static_cast<uint64_t>(current.tv_sec-startTime.tv_sec) * 1000000) +
+            (current.tv_usec-startTime.tv_usec);
+}
@@ -0,0 +1,12 @@
+#ifndef TIMEUTIL_H
+#define TIMEUTIL_H
+
+#include <stdint.h>
+
+// Milliseconds since server start. Safe to call from any thread.
+uint32_t getTimeMS(void);
+
+// Microseconds since server start, for short intervals
+uint64_t getTimeUS(void);
+
+#endif
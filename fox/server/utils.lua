@@ -34,10 +34,7 @@ function selectone(n, ...)
 end
 
 function waityield(ms)
-    local wait = gettimems() + ms
-    while wait > gettimems() do
-        coroutine.yield()
-    end
+    sleep(ms)
 end
 
 -- Math extensions
@@ -107,6 +107,49 @@ static uint8_t getDir(const char *s)
     return ret;
 }
 
+static void setSlaveMode(uint8_t enable)
+{
+    extern uint8_t slaveMode;
+    slaveMode = enable;
+    if (slaveMode)
+    {
+        if (!isStopwatch4Running())
+        {
+            setStopwatch4(0);
+            startStopwatch4();
+        }
+    }
+    else if (isStopwatch4Running())
+        stopStopwatch4();
+}
+
+static void setSlaveDelay(ESlaveDelay var, uint16_t delay)
+{
+    extern SUpdateSlaveData updateSlaveData;
+
+    switch (var)
+    {
+        case SLAVE_DELAY_LED: updateSlaveData.LEDDelay = delay; break;
+        case SLAVE_DELAY_LIGHT: updateSlaveData.lightDelay = delay; break;
+        case SLAVE_DELAY_MOTOR: updateSlaveData.motorDelay = delay; break;
+        case SLAVE_DELAY_BATTERY: updateSlaveData.batteryDelay = delay; break;
+        case SLAVE_DELAY_ACS: updateSlaveData.ACSDelay = delay; break;
+        case SLAVE_DELAY_MIC: updateSlaveData.micDelay = delay; break;
+        case SLAVE_DELAY_RC5: updateSlaveData.RC5Delay = delay; break;
+        case SLAVE_DELAY_SHARPIR: updateSlaveData.sharpIRDelay = delay; break;
+        default: break;
+    }
+}
+
+static void setServoAngle(uint8_t pos)
+{
+    if (pos > 180)
+        pos = 180;
+
+    // Degree --> servo pos
+    setServo((uint16_t)pos * RIGHT_TOUCH / 180);
+}
+
 void handleSetCommand(const char **cmd, uint8_t count)
 {
     if (count && !strcmp_P(cmd[0], PSTR("help")))
@@ -174,28 +217,15 @@ void handleSetCommand(const char **cmd, uint8_t count)
     else if (!strcmp_P(cmd[0], PSTR("beep")))
         setBeeperPitch(atoi(cmd[1]));
     else if (!strcmp_P(cmd[0], PSTR("slave")))
-    {
-        extern uint8_t slaveMode;
-        slaveMode = cmd[1][0] == '1';
-        if (slaveMode)
-        {
-            if (!isStopwatch4Running())
-            {
-                setStopwatch4(0);
-                startStopwatch4();
-            }
-        }
-        else if (isStopwatch4Running())
-            stopStopwatch4();
-    }
+        setSlaveMode(cmd[1][0] == '1');
     else if (!strcmp_P(cmd[0], PSTR("slavedelay")))
     {
         if (count < 3)
             writeString_P("Error: need atleast 3 arguments\n");
         else
         {
-            extern SUpdateSlaveData updateSlaveData;
             uint16_t delay = atoi(cmd[2]);
+            ESlaveDelay var = SLAVE_DELAY_MAX_INDEX;
 
             writeString_P("Setting "); writeString(cmd[1]);
             writeString_P(" to "); writeInteger(delay, 10); writeChar('\n');
@@ -204,32 +234,27 @@ void handleSetCommand(const char **cmd, uint8_t count)
                 writeString_P("WARNING: delay does not 'fit' to rollback\n");
 
             if (!strcmp_P(cmd[1], PSTR("led")))
-                updateSlaveData.LEDDelay = delay;
+                var = SLAVE_DELAY_LED;
             else if (!strcmp_P(cmd[1], PSTR("light")))
-                updateSlaveData.lightDelay = delay;
+                var = SLAVE_DELAY_LIGHT;
             else if (!strcmp_P(cmd[1], PSTR("motor")))
-                updateSlaveData.motorDelay = delay;
+                var = SLAVE_DELAY_MOTOR;
             else if (!strcmp_P(cmd[1], PSTR("battery")))
-                updateSlaveData.batteryDelay = delay;
+                var = SLAVE_DELAY_BATTERY;
             else if (!strcmp_P(cmd[1], PSTR("acs")))
-                updateSlaveData.ACSDelay = delay;
+                var = SLAVE_DELAY_ACS;
             else if (!strcmp_P(cmd[1], PSTR("mic")))
-                updateSlaveData.micDelay = delay;
+                var = SLAVE_DELAY_MIC;
             else if (!strcmp_P(cmd[1], PSTR("rc5")))
-                updateSlaveData.RC5Delay = delay;
+                var = SLAVE_DELAY_RC5;
             else if (!strcmp_P(cmd[1], PSTR("sharpir")))
-                updateSlaveData.sharpIRDelay = delay;
+                var = SLAVE_DELAY_SHARPIR;
+
+            setSlaveDelay(var, delay);
         }
     }
     else if (!strcmp_P(cmd[0], PSTR("servo")))
-    {
-        uint8_t pos = atoi(cmd[1]);
-        if (pos > 180)
-            pos = 180;
-
-        // Degree --> servo pos
-        setServo((uint16_t)pos * RIGHT_TOUCH / 180);
-    }
+        setServoAngle(atoi(cmd[1]));
     else if (!strcmp_P(cmd[0], PSTR("srange")))
     {
         if (count < 3)
@@ -482,14 +507,119 @@ void handleCommand(const char **cmd, uint8_t count)
         writeNStringP(usageStr);
 }
 
+// Binary command handlers, args are checked for size before calling them
+static uint16_t getWordArg(const uint8_t *args)
+{
+    return args[0] + (args[1] << 8);
+}
+
+static void binBasePower(const uint8_t *args) { setBasePower(args[0]); }
+static void binBaseLEDs(const uint8_t *args) { setBaseLEDs(args[0]); }
+static void binM32LEDs(const uint8_t *args) { externalPort.LEDS = args[0]; outputExt(); }
+static void binACSPower(const uint8_t *args) { setBaseACS(args[0]); }
+static void binSpeed(const uint8_t *args) { setMoveSpeed(args[0], args[1]); }
+static void binDir(const uint8_t *args) { setMoveDirection(args[0]); }
+static void binSlave(const uint8_t *args) { setSlaveMode(args[0]); }
+static void binSlaveDelay(const uint8_t *args) { setSlaveDelay(args[0], getWordArg(&args[1])); }
+static void binServo(const uint8_t *args) { setServoAngle(args[0]); }
+static void binMove(const uint8_t *args) { move(args[0], args[1], getWordArg(&args[2])); }
+static void binRotate(const uint8_t *args) { rotate(args[0], args[1], getWordArg(&args[2])); }
+static void binStop(const uint8_t *args) { stopMovement(); }
+static void binBeep(const uint8_t *args) { beep(args[0], getWordArg(&args[1])); }
+static void binSound(const uint8_t *args)
+{ sound(args[0], getWordArg(&args[1]), getWordArg(&args[3])); }
+
+typedef struct
+{
+    uint8_t argSize;
+    void (*handler)(const uint8_t *args);
+} SBinaryCommand;
+
+// Indexed by opcode (ESerialCommand)
+static const SBinaryCommand binaryCommands[SERIAL_CMD_MAX_INDEX] PROGMEM =
+{
+    [SERIAL_CMD_BASE_POWER] = { 1, binBasePower },
+    [SERIAL_CMD_BASE_LEDS] = { 1, binBaseLEDs },
+    [SERIAL_CMD_M32_LEDS] = { 1, binM32LEDs },
+    [SERIAL_CMD_ACS_POWER] = { 1, binACSPower },
+    [SERIAL_CMD_SPEED] = { 2, binSpeed },
+    [SERIAL_CMD_DIR] = { 1, binDir },
+    [SERIAL_CMD_SLAVE] = { 1, binSlave },
+    [SERIAL_CMD_SLAVE_DELAY] = { 3, binSlaveDelay },
+    [SERIAL_CMD_SERVO] = { 1, binServo },
+    [SERIAL_CMD_MOVE] = { 4, binMove },
+    [SERIAL_CMD_ROTATE] = { 4, binRotate },
+    [SERIAL_CMD_STOP] = { 0, binStop },
+    [SERIAL_CMD_BEEP] = { 3, binBeep },
+    [SERIAL_CMD_SOUND] = { 5, binSound },
+};
+
+// frame[0] = size, frame[1] = opcode, frame[2] = sequence, frame[3-n] = args,
+// frame[size+1] = checksum
+static void handleBinaryCommand(const uint8_t *frame)
+{
+    static uint8_t lastSequence = 0;
+    const uint8_t size = frame[0], opcode = frame[1], seq = frame[2];
+    uint8_t i, checksum = 0;
+
+    for (i=0; i<=size; ++i)
+        checksum ^= frame[i];
+
+    // Not acknowledged: the server will send it again
+    if (checksum != frame[size+1])
+    {
+        writeString_P("Error: binary command checksum mismatch\n");
+        return;
+    }
+
+    // Duplicate or out of order (something got lost before)?
+    if (seq && (seq != ((lastSequence == 255) ? 1 : (lastSequence + 1))))
+    {
+        sendSerialMSGByte(SERIAL_CMD_ACK, lastSequence);
+        return;
+    }
+
+    lastSequence = seq;
+
+    if (opcode >= SERIAL_CMD_MAX_INDEX)
+        writeString_P("Error: unknown binary command\n");
+    else if (pgm_read_byte(&binaryCommands[opcode].argSize) != (size - 2))
+        writeString_P("Error: wrong binary command size\n");
+    else
+    {
+        void (*handler)(const uint8_t *) =
+            (void (*)(const uint8_t *))pgm_read_word(&binaryCommands[opcode].handler);
+        handler(&frame[3]);
+    }
+
+    sendSerialMSGByte(SERIAL_CMD_ACK, seq);
+}
+
 void checkCommands(void)
 {
     #define MAXBUFFER 32
     static char buffer[MAXBUFFER] = { 0 };
-    static uint8_t bufindex = 0;
+    static uint8_t bufindex = 0, binaryCommand = 0;
     
     while (getBufferLength())
     {
+        if (binaryCommand)
+        {
+            buffer[bufindex++] = readChar();
+
+            if ((bufindex == 1) && (!buffer[0] || (buffer[0] > SERIAL_CMD_MAX_SIZE)))
+            {
+                writeString_P("Error: invalid binary command size\n");
+                binaryCommand = bufindex = buffer[0] = 0;
+            }
+            else if ((bufindex > 1) && (bufindex == ((uint8_t)buffer[0] + 2)))
+            {
+                handleBinaryCommand((const uint8_t *)buffer);
+                binaryCommand = bufindex = buffer[0] = 0;
+            }
+            continue;
+        }
+
         if ((bufindex + 2) >= MAXBUFFER) //+2: space for '0'
         {
             // Just discard the rest and fake a newline
@@ -499,6 +629,12 @@ void checkCommands(void)
         }
         
         buffer[bufindex] = readChar();
+
+        if ((bufindex == 0) && (buffer[0] == SERIAL_MSG_START))
+        {
+            binaryCommand = 1;
+            continue;
+        }
         
         if (buffer[bufindex] == '\n')
             break;
@@ -506,7 +642,7 @@ void checkCommands(void)
         bufindex++;
     }
     
-    if (buffer[bufindex] == '\n')
+    if (!binaryCommand && (buffer[bufindex] == '\n'))
     {
         buffer[bufindex+1] = 0;
         bufindex = 0;
@@ -11,6 +11,9 @@
 // --- End RP6 base code
 
 
+void sendSerialMSGByte(ESerialMessage msg, uint8_t data);
+void sendSerialMSGWord(ESerialMessage msg, uint16_t data);
+
 void initI2C(void);
 void setBasePower(uint8_t enable);
 void setBaseACS(EACSPowerState state);
@@ -101,6 +101,7 @@ QextSerialPortPrivate::QextSerialPortPrivate(QextSerialPort *q)
 {
     lastErr = E_NO_ERROR;
     settingsDirtyFlags = DFE_ALL;
+    lowLatency = false;
 
     platformSpecificInit();
 }
@@ -321,6 +322,14 @@ void QextSerialPortPrivate::setCustomBaudRate(int customBaudRate, bool update)
         updatePortSettings();
 }
 
+void QextSerialPortPrivate::setLowLatency(bool enable, bool update)
+{
+    lowLatency = enable;
+    settingsDirtyFlags |= DFE_LowLatency;
+    if (update && q_func()->isOpen())
+        updatePortSettings();
+}
+
 void QextSerialPortPrivate::setPortSettings(const QextPortSettings &settings, bool update)
 {
     setBaudRate(settings.BaudRate, false);
@@ -338,12 +347,38 @@ void QextSerialPortPrivate::setPortSettings(const QextPortSettings &settings, bo
 
 void QextSerialPortPrivate::_q_canRead()
 {
+    ++readStats.notifications;
+
+    if (lowLatency) {
+        // Read everything in as few system calls as possible, without
+        // asking for the number of available bytes first
+        const qint64 chunk = 4096;
+        qint64 total = 0, bytesRead;
+        do {
+            char * writePtr = readBuffer.reserve(size_t(chunk));
+            bytesRead = readData_sys(writePtr, chunk);
+            ++readStats.reads;
+            readBuffer.chop(chunk - qMax(bytesRead, qint64(0)));
+            if (bytesRead > 0)
+                total += bytesRead;
+        } while (bytesRead == chunk);
+
+        readStats.bytes += total;
+        if (total > 0) {
+            Q_Q(QextSerialPort);
+            Q_EMIT q->readyRead();
+        }
+        return;
+    }
+
     qint64 maxSize = bytesAvailable_sys();
     if (maxSize > 0) {
         char * writePtr = readBuffer.reserve(size_t(maxSize));
         qint64 bytesRead = readData_sys(writePtr, maxSize);
         if (bytesRead < maxSize)
             readBuffer.chop(maxSize - bytesRead);
+        ++readStats.reads;
+        readStats.bytes += qMax(bytesRead, qint64(0));
         Q_Q(QextSerialPort);
         Q_EMIT q->readyRead();
     }
@@ -965,6 +1000,39 @@ void QextSerialPort::setTimeout(long millisec)
         d->setTimeout(millisec, true);
 }
 
+/*!
+    Enables or disables low latency mode. Reads return immediately with
+    whatever is available (VMIN and VTIME are 0), the driver is asked to pass
+    on received data right away (ASYNC_LOW_LATENCY, Linux only, ignored when
+    not supported), and in event driven mode all available data is read with
+    as few system calls as possible when the port is notified.
+*/
+void QextSerialPort::setLowLatency(bool enable)
+{
+    Q_D(QextSerialPort);
+    QWriteLocker locker(&d->lock);
+    if (d->lowLatency != enable)
+        d->setLowLatency(enable, true);
+}
+
+/*!
+    Returns true if low latency mode is enabled.
+*/
+bool QextSerialPort::lowLatency() const
+{
+    QReadLocker locker(&d_func()->lock);
+    return d_func()->lowLatency;
+}
+
+/*!
+    Returns read statistics, see QextReadStats.
+*/
+QextReadStats QextSerialPort::readStats() const
+{
+    QReadLocker locker(&d_func()->lock);
+    return d_func()->readStats;
+}
+
 /*!
     Sets DTR line to the requested state (\a set default to high).  This function will have no effect if
     the port associated with the class is not currently open.
@@ -1007,10 +1075,14 @@ qint64 QextSerialPort::readData(char *data, qint64 maxSize)
         bytesFromBuffer = d->readBuffer.read(data, maxSize);
         if (bytesFromBuffer == maxSize)
             return bytesFromBuffer;
+        // The notifier already read everything that was available
+        if (d->lowLatency && d->_queryMode == EventDriven)
+            return bytesFromBuffer;
     }
     qint64 bytesFromDevice = d->readData_sys(data+bytesFromBuffer, maxSize-bytesFromBuffer);
     if (bytesFromDevice < 0) {
-        return -1;
+        // Don't lose what was taken from the buffer
+        return bytesFromBuffer ? bytesFromBuffer : -1;
     }
     return bytesFromBuffer + bytesFromDevice;
 }
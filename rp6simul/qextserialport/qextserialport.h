@@ -145,6 +145,19 @@ struct PortSettings
     long Timeout_Millisec;
 };
 
+/*!
+ * Counters for the event driven read path: how often the port was notified
+ * about new data, how many read() system calls that took and how many bytes
+ * they returned.
+ */
+struct QEXTSERIALPORT_EXPORT QextReadStats
+{
+    QextReadStats() : notifications(0), reads(0), bytes(0) {}
+    quint64 notifications;
+    quint64 reads;
+    quint64 bytes;
+};
+
 class QextSerialPortPrivate;
 class QEXTSERIALPORT_EXPORT QextSerialPort: public QIODevice
 {
@@ -174,6 +187,8 @@ public:
     StopBitsType stopBits() const;
     FlowType flowControl() const;
     int customBaudRate() const;
+    bool lowLatency() const;
+    QextReadStats readStats() const;
 
     bool open(OpenMode mode);
     bool isSequential() const;
@@ -197,6 +212,7 @@ public Q_SLOTS:
     void setFlowControl(FlowType);
     void setTimeout(long);
     void setCustomBaudRate(int baudRate);
+    void setLowLatency(bool enable);
 
     void setDtr(bool set=true);
     void setRts(bool set=true);
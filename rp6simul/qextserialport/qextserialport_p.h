@@ -195,6 +195,7 @@ public:
         DFE_DataBits = 0x0008,
         DFE_Flow = 0x0010,
         DFE_TimeOut = 0x0100,
+        DFE_LowLatency = 0x0200,
         DFE_ALL = 0x0fff,
         DFE_Settings_Mask = 0x00ff //without TimeOut
     };
@@ -205,6 +206,8 @@ public:
     int settingsDirtyFlags;
     ulong lastErr;
     QextSerialPort::QueryMode _queryMode;
+    bool lowLatency;
+    QextReadStats readStats;
 
     // platform specific members
 #ifdef Q_OS_UNIX
@@ -236,6 +239,7 @@ public:
     void setFlowControl(FlowType flow, bool update=true);
     void setTimeout(long millisec, bool update=true);
     void setCustomBaudRate(int customBaudRate, bool update=true);
+    void setLowLatency(bool enable, bool update=true);
     void setPortSettings(const QextPortSettings& settings, bool update=true);
 
     void platformSpecificDestruct();
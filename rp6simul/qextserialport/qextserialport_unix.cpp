@@ -37,6 +37,9 @@
 #include <sys/time.h>
 #include <sys/ioctl.h>
 #include <sys/select.h>
+#ifdef Q_OS_LINUX
+#  include <linux/serial.h>
+#endif
 #include <QtCore/QMutexLocker>
 #include <QtCore/QDebug>
 #include <QtCore/QSocketNotifier>
@@ -403,9 +406,28 @@ void QextSerialPortPrivate::updatePortSettings()
             ::fcntl(fd, F_SETFL, O_SYNC);
         }
         ::tcgetattr(fd, & Posix_CommConfig);
-        Posix_CommConfig.c_cc[VTIME] = millisec/100;
+        Posix_CommConfig.c_cc[VTIME] = lowLatency ? 0 : millisec/100;
         ::tcsetattr(fd, TCSAFLUSH, & Posix_CommConfig);
     }
 
+    if (settingsDirtyFlags & DFE_LowLatency) {
+        // Return from read() with whatever is there, no inter byte timer
+        Posix_CommConfig.c_cc[VMIN] = 0;
+        Posix_CommConfig.c_cc[VTIME] = lowLatency ? 0 : Settings.Timeout_Millisec/100;
+        ::tcsetattr(fd, TCSANOW, &Posix_CommConfig);
+#ifdef Q_OS_LINUX
+        // Hand received data to the tty layer right away instead of
+        // batching it. Not supported by all drivers (e.g. ptys).
+        struct serial_struct serial;
+        if (::ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+            if (lowLatency)
+                serial.flags |= ASYNC_LOW_LATENCY;
+            else
+                serial.flags &= ~ASYNC_LOW_LATENCY;
+            ::ioctl(fd, TIOCSSERIAL, &serial);
+        }
+#endif
+    }
+
     settingsDirtyFlags = 0;
 }
@@ -0,0 +1,377 @@
+#include <math.h>
+#include <string.h>
+
+#include <QDebug>
+#include <QtEndian>
+
+#include "luamsg.h"
+
+using namespace NLuaMsg;
+
+void CLuaMsgEncoder::putVarint(uint64_t v)
+{
+    reserve(10);
+    char *p = buffer.data();
+    while (v >= 0x80)
+    {
+        p[used++] = static_cast<char>((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    p[used++] = static_cast<char>(v);
+}
+
+void CLuaMsgEncoder::putBytes(const char *data, int size)
+{
+    reserve(size);
+    memcpy(buffer.data() + used, data, size);
+    used += size;
+}
+
+void CLuaMsgEncoder::putHeader(uint8_t fixtag, int fixmax, uint8_t tag, uint32_t n)
+{
+    if (n <= static_cast<uint32_t>(fixmax))
+        putByte(fixtag | n);
+    else
+    {
+        putByte(tag);
+        putVarint(n);
+    }
+}
+
+void CLuaMsgEncoder::writeNumber(double n)
+{
+    // Most numbers (coordinates, sizes) are small integers
+    if ((n == floor(n)) && (fabs(n) < 9007199254740992.0)) // 2^53
+    {
+        if (n >= 0.0)
+        {
+            const uint64_t i = static_cast<uint64_t>(n);
+            if (i <= 0x7f)
+                putByte(TAG_POSFIXINT | i);
+            else
+            {
+                putByte(TAG_UINT);
+                putVarint(i);
+            }
+        }
+        else
+        {
+            putByte(TAG_NINT);
+            putVarint(static_cast<uint64_t>(-n) - 1);
+        }
+    }
+    else if (static_cast<double>(static_cast<float>(n)) == n)
+    {
+        union { float f; quint32 i; } u;
+        u.f = static_cast<float>(n);
+        putByte(TAG_FLOAT);
+        reserve(sizeof(quint32));
+        qToBigEndian(u.i, reinterpret_cast<uchar *>(buffer.data() + used));
+        used += sizeof(quint32);
+    }
+    else
+    {
+        union { double d; quint64 i; } u;
+        u.d = n;
+        putByte(TAG_DOUBLE);
+        reserve(sizeof(quint64));
+        qToBigEndian(u.i, reinterpret_cast<uchar *>(buffer.data() + used));
+        used += sizeof(quint64);
+    }
+}
+
+void CLuaMsgEncoder::writeString(const char *s, int size)
+{
+    putHeader(TAG_FIXSTR, 31, TAG_STR, size);
+    putBytes(s, size);
+}
+
+void CLuaMsgEncoder::writeKey(const void *id, const char *s, int size)
+{
+    // Messages only have a few different keys, so a linear search is fine
+    const int count = keys.size();
+    for (int i=0; i<count; ++i)
+    {
+        if (keys[i] == id)
+        {
+            if (i < 32)
+                putByte(TAG_FIXKEYREF | i);
+            else
+            {
+                putByte(TAG_KEYREF);
+                putVarint(i);
+            }
+            return;
+        }
+    }
+
+    if (count >= MAX_KEYS)
+    {
+        writeString(s, size);
+        return;
+    }
+
+    keys.append(id);
+    putByte(TAG_NEWKEY);
+    putVarint(size);
+    putBytes(s, size);
+}
+
+
+void CLuaMsgReader::setInvalid()
+{
+    if (valid)
+        qWarning() << "Invalid or unexpected Lua message data at" << pos;
+    valid = false;
+}
+
+bool CLuaMsgReader::getVarint(uint64_t &v)
+{
+    v = 0;
+    for (int shift=0; (shift < 64) && (pos < data.size()); shift += 7)
+    {
+        const uint8_t b = data[pos++];
+        v |= static_cast<uint64_t>(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+
+    setInvalid();
+    return false;
+}
+
+bool CLuaMsgReader::getBytes(int size, const char *&p)
+{
+    if ((size < 0) || (size > (data.size() - pos)))
+    {
+        setInvalid();
+        return false;
+    }
+
+    p = data.constData() + pos;
+    pos += size;
+    return true;
+}
+
+CLuaMsgReader::EType CLuaMsgReader::peekType() const
+{
+    if (atEnd())
+        return TYPE_END;
+
+    const uint8_t tag = data[pos];
+    if ((tag < TAG_FIXMAP) || (tag == TAG_UINT) || (tag == TAG_NINT) || (tag == TAG_FLOAT) ||
+        (tag == TAG_DOUBLE))
+        return TYPE_NUMBER;
+    if ((tag < TAG_FIXARRAY) || (tag == TAG_MAP))
+        return TYPE_MAP;
+    if ((tag < TAG_FIXSTR) || (tag == TAG_ARRAY))
+        return TYPE_ARRAY;
+    if ((tag < TAG_NIL) || (tag >= TAG_FIXKEYREF) || (tag == TAG_STR) || (tag == TAG_KEYREF) ||
+        (tag == TAG_NEWKEY))
+        return TYPE_STRING;
+    if (tag == TAG_NIL)
+        return TYPE_NIL;
+    if ((tag == TAG_FALSE) || (tag == TAG_TRUE))
+        return TYPE_BOOL;
+    return TYPE_INVALID;
+}
+
+bool CLuaMsgReader::readNumber(double &n)
+{
+    n = 0.0;
+    if (peekType() != TYPE_NUMBER)
+    {
+        setInvalid();
+        return false;
+    }
+
+    const uint8_t tag = data[pos++];
+    uint64_t i;
+
+    if (tag < TAG_FIXMAP)
+        n = tag;
+    else if (tag == TAG_UINT)
+    {
+        if (!getVarint(i))
+            return false;
+        n = static_cast<double>(i);
+    }
+    else if (tag == TAG_NINT)
+    {
+        if (!getVarint(i))
+            return false;
+        n = -static_cast<double>(i) - 1.0;
+    }
+    else if (tag == TAG_FLOAT)
+    {
+        const char *p;
+        if (!getBytes(sizeof(quint32), p))
+            return false;
+        union { float f; quint32 i; } u;
+        u.i = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(p));
+        n = u.f;
+    }
+    else // TAG_DOUBLE
+    {
+        const char *p;
+        if (!getBytes(sizeof(quint64), p))
+            return false;
+        union { double d; quint64 i; } u;
+        u.i = qFromBigEndian<quint64>(reinterpret_cast<const uchar *>(p));
+        n = u.d;
+    }
+
+    return true;
+}
+
+bool CLuaMsgReader::readString(QString &s)
+{
+    s.clear();
+    if (peekType() != TYPE_STRING)
+    {
+        setInvalid();
+        return false;
+    }
+
+    const uint8_t tag = data[pos++];
+    uint64_t v;
+    const char *p;
+
+    if ((tag >= TAG_FIXKEYREF) || (tag == TAG_KEYREF))
+    {
+        if (tag >= TAG_FIXKEYREF)
+            v = tag - TAG_FIXKEYREF;
+        else if (!getVarint(v))
+            return false;
+
+        if (v >= static_cast<uint64_t>(keys.size()))
+        {
+            setInvalid();
+            return false;
+        }
+        s = keys[v];
+        return true;
+    }
+
+    if (tag < TAG_NIL)
+        v = tag - TAG_FIXSTR;
+    else if (!getVarint(v))
+        return false;
+
+    if ((v > static_cast<uint64_t>(data.size())) || !getBytes(v, p))
+    {
+        setInvalid();
+        return false;
+    }
+
+    s = QString::fromUtf8(p, v);
+    if (tag == TAG_NEWKEY)
+        keys.append(s);
+    return true;
+}
+
+bool CLuaMsgReader::readHeader(uint8_t fixtag, uint8_t tag, int &n)
+{
+    n = 0;
+    const uint8_t t = data[pos++];
+    uint64_t v;
+
+    if (t == tag)
+    {
+        if (!getVarint(v))
+            return false;
+    }
+    else
+        v = t - fixtag;
+
+    // Every value takes at least a byte
+    if (v > static_cast<uint64_t>(data.size() - pos))
+    {
+        setInvalid();
+        return false;
+    }
+
+    n = v;
+    return true;
+}
+
+CLuaMsgReader &CLuaMsgReader::operator >>(bool &b)
+{
+    b = false;
+    if (peekType() != TYPE_BOOL)
+        setInvalid();
+    else
+        b = (data[pos++] == static_cast<char>(TAG_TRUE));
+    return *this;
+}
+
+CLuaMsgReader &CLuaMsgReader::operator >>(double &n)
+{
+    readNumber(n);
+    return *this;
+}
+
+CLuaMsgReader &CLuaMsgReader::operator >>(float &n)
+{
+    double d;
+    readNumber(d);
+    n = d;
+    return *this;
+}
+
+CLuaMsgReader &CLuaMsgReader::operator >>(int &n)
+{
+    double d;
+    readNumber(d);
+    n = static_cast<int>(d);
+    return *this;
+}
+
+CLuaMsgReader &CLuaMsgReader::operator >>(QString &s)
+{
+    readString(s);
+    return *this;
+}
+
+int CLuaMsgReader::readArray()
+{
+    int n = 0;
+    if (peekType() != TYPE_ARRAY)
+        setInvalid();
+    else
+        readHeader(TAG_FIXARRAY, TAG_ARRAY, n);
+    return n;
+}
+
+int CLuaMsgReader::readMap()
+{
+    int n = 0;
+    if (peekType() != TYPE_MAP)
+        setInvalid();
+    else if (readHeader(TAG_FIXMAP, TAG_MAP, n) && (n > ((data.size() - pos) / 2)))
+    {
+        setInvalid();
+        n = 0;
+    }
+    return n;
+}
+
+void CLuaMsgReader::skip()
+{
+    // Iterative, so nesting depth doesn't matter
+    int left = 1;
+    while ((left > 0) && valid)
+    {
+        --left;
+        switch (peekType())
+        {
+        case TYPE_NIL: ++pos; break;
+        case TYPE_BOOL: { bool b; *this >> b; break; }
+        case TYPE_NUMBER: { double n; readNumber(n); break; }
+        case TYPE_STRING: { QString s; readString(s); break; } // Keys are still registered
+        case TYPE_ARRAY: left += readArray(); break;
+        case TYPE_MAP: left += readMap() * 2; break;
+        default: setInvalid(); break;
+        }
+    }
+}
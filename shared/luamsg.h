@@ -0,0 +1,126 @@
+#ifndef LUAMSG_H
+#define LUAMSG_H
+
+#include <stdint.h>
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+// Compact (MessagePack like) encoding of the Lua values sent with sendmsg()
+// (TCP_LUAMSG: QString message, QByteArray values). Every value starts
+// with a tag byte:
+//  0x00-0x7f   integer 0-127
+//  0x80-0x8f   map with 0-15 key/value pairs
+//  0x90-0x9f   array with 0-15 values
+//  0xa0-0xbf   string with 0-31 bytes
+//  0xc0        nil
+//  0xc2/0xc3   false/true
+//  0xc4        integer (varint)
+//  0xc5        negative integer (varint of -1 - value)
+//  0xca/0xcb   float/double (big endian)
+//  0xd4        key reference (varint)
+//  0xd5        new key (varint length + bytes)
+//  0xd9        string (varint length + bytes)
+//  0xdc        array (varint count + values)
+//  0xde        map (varint count + key/value pairs)
+//  0xe0-0xff   key reference 0-31
+// Varints are little endian base 128. String keys of maps are interned per
+// message: the first time a key is written it gets the next index, after
+// that it is written as a reference to this index.
+
+namespace NLuaMsg
+{
+
+enum
+{
+    TAG_POSFIXINT = 0x00, TAG_FIXMAP = 0x80, TAG_FIXARRAY = 0x90, TAG_FIXSTR = 0xa0,
+    TAG_NIL = 0xc0, TAG_FALSE = 0xc2, TAG_TRUE = 0xc3, TAG_UINT = 0xc4, TAG_NINT = 0xc5,
+    TAG_FLOAT = 0xca, TAG_DOUBLE = 0xcb, TAG_KEYREF = 0xd4, TAG_NEWKEY = 0xd5, TAG_STR = 0xd9,
+    TAG_ARRAY = 0xdc, TAG_MAP = 0xde, TAG_FIXKEYREF = 0xe0
+};
+
+enum { MAX_KEYS = 64 }; // Further keys are written as plain strings
+
+}
+
+// Writes values into a reusable buffer, which doesn't allocate once it has
+// grown large enough.
+class CLuaMsgEncoder
+{
+    QByteArray buffer; // Never shrinks, 'used' marks the actual size
+    int used;
+    QVector<const void *> keys;
+
+    void reserve(int n)
+    {
+        if ((used + n) > buffer.size())
+            buffer.resize(qMax(buffer.size() * 2, used + n));
+    }
+
+    void putByte(uint8_t b) { reserve(1); buffer.data()[used++] = b; }
+    void putVarint(uint64_t v);
+    void putBytes(const char *data, int size);
+    void putHeader(uint8_t fixtag, int fixmax, uint8_t tag, uint32_t n);
+
+public:
+    CLuaMsgEncoder(int size=1024) : buffer(size, 0), used(0) { keys.reserve(NLuaMsg::MAX_KEYS); }
+
+    void clear(void) { used = 0; keys.resize(0); }
+    // Refers to the internal buffer, valid until the encoder is changed
+    QByteArray getData(void) const { return QByteArray::fromRawData(buffer.constData(), used); }
+
+    void writeNil(void) { putByte(NLuaMsg::TAG_NIL); }
+    void writeBool(bool b) { putByte((b) ? NLuaMsg::TAG_TRUE : NLuaMsg::TAG_FALSE); }
+    void writeNumber(double n); // Integers are stored as such
+    void writeString(const char *s, int size);
+    // id: identifies the key (e.g. the pointer to an interned Lua string),
+    // equal keys must have equal ids while the message is written
+    void writeKey(const void *id, const char *s, int size);
+    void writeArray(uint32_t count) { putHeader(NLuaMsg::TAG_FIXARRAY, 15, NLuaMsg::TAG_ARRAY, count); }
+    void writeMap(uint32_t count) { putHeader(NLuaMsg::TAG_FIXMAP, 15, NLuaMsg::TAG_MAP, count); }
+};
+
+// Reads values from a CLuaMsgEncoder buffer. Reading a value of the wrong
+// type or beyond the end returns a default value (0, false, empty) and marks
+// the reader as invalid.
+class CLuaMsgReader
+{
+public:
+    enum EType { TYPE_END=0, TYPE_NIL, TYPE_BOOL, TYPE_NUMBER, TYPE_STRING, TYPE_ARRAY,
+                 TYPE_MAP, TYPE_INVALID };
+
+private:
+    QByteArray data;
+    int pos;
+    bool valid;
+    QVector<QString> keys;
+
+    bool getVarint(uint64_t &v);
+    bool getBytes(int size, const char *&p);
+    bool readNumber(double &n);
+    bool readString(QString &s);
+    bool readHeader(uint8_t fixtag, uint8_t tag, int &n);
+    void setInvalid(void);
+
+public:
+    CLuaMsgReader(const QByteArray &d) : data(d), pos(0), valid(true) { }
+
+    bool atEnd(void) const { return pos >= data.size(); }
+    bool isValid(void) const { return valid; }
+    EType peekType(void) const;
+
+    CLuaMsgReader &operator >>(bool &b);
+    CLuaMsgReader &operator >>(double &n);
+    CLuaMsgReader &operator >>(float &n);
+    CLuaMsgReader &operator >>(int &n);
+    CLuaMsgReader &operator >>(QString &s); // Strings and map keys
+
+    // Return the number of values or key/value pairs that follow, which
+    // may be arrays and maps themselves
+    int readArray(void);
+    int readMap(void);
+    void skip(void); // Skips a value, including all values of arrays and maps
+};
+
+#endif
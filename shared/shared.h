@@ -149,43 +149,105 @@ enum
     I2C_CMD_MAX_INDEX
 };
 
+// Robot data channels. This table generates the serial and TCP message
+// enums and the channel info used by the server and clients (tcputil.h).
+// Adding a channel only requires a new line here (and the firmware code
+// that sends it).
+// Fields:  name, data type, averaged, stats name, Lua module, Lua function
+//  - data type: DATA_BYTE or DATA_WORD (see EDataType in tcputil.h)
+//  - averaged: whether data is averaged by the server before sending it to
+//    clients (otherwise latest value is used)
+//  - stats name: name used by getstats() from Lua
+//  - Lua module/function: generic data function in the robot table, NULL if
+//    the data needs a special decoder
+#define ROBOT_CHANNELS \
+    CHANNEL(STATE_SENSORS, DATA_BYTE, 0, "state", NULL, NULL) \
+    CHANNEL(BASE_LEDS, DATA_BYTE, 0, "baseleds", "leds", "base") \
+    CHANNEL(M32_LEDS, DATA_BYTE, 0, "m32leds", "leds", "m32") \
+    CHANNEL(LIGHT_LEFT, DATA_WORD, 1, "lightleft", "sensors", "lightleft") \
+    CHANNEL(LIGHT_RIGHT, DATA_WORD, 1, "lightright", "sensors", "lightright") \
+    CHANNEL(MOTOR_SPEED_LEFT, DATA_BYTE, 1, "speedleft", "motor", "speedleft") \
+    CHANNEL(MOTOR_SPEED_RIGHT, DATA_BYTE, 1, "speedright", "motor", "speedright") \
+    CHANNEL(MOTOR_DESTSPEED_LEFT, DATA_BYTE, 0, "destspeedleft", "motor", "destspeedleft") \
+    CHANNEL(MOTOR_DESTSPEED_RIGHT, DATA_BYTE, 0, "destspeedright", "motor", "destspeedright") \
+    CHANNEL(MOTOR_DIST_LEFT, DATA_WORD, 0, "distleft", "motor", "distleft") \
+    CHANNEL(MOTOR_DIST_RIGHT, DATA_WORD, 0, "distright", "motor", "distright") \
+    CHANNEL(MOTOR_DESTDIST_LEFT, DATA_WORD, 0, "destdistleft", "motor", "destdistleft") \
+    CHANNEL(MOTOR_DESTDIST_RIGHT, DATA_WORD, 0, "destdistright", "motor", "destdistright") \
+    CHANNEL(MOTOR_CURRENT_LEFT, DATA_WORD, 1, "motorcurrentleft", "motor", "motorcurrentleft") \
+    CHANNEL(MOTOR_CURRENT_RIGHT, DATA_WORD, 1, "motorcurrentright", "motor", "motorcurrentright") \
+    CHANNEL(MOTOR_DIRECTIONS, DATA_BYTE, 0, "motordirections", NULL, NULL) \
+    CHANNEL(BATTERY, DATA_WORD, 1, "battery", "sensors", "battery") \
+    CHANNEL(ACS_POWER, DATA_BYTE, 0, "acspower", NULL, NULL) \
+    CHANNEL(MIC, DATA_WORD, 1, "mic", "sensors", "mic") \
+    CHANNEL(LASTRC5, DATA_WORD, 0, "rc5", NULL, NULL) \
+    CHANNEL(SHARPIR, DATA_BYTE, 1, "sharpir", "sensors", "sharpir")
+
 // Slave serial update messages
 typedef enum
 {
     // To mark serial output as update msg.
     // Using 0 wouldn't make things easier with 0 terminated strings :)
     SERIAL_MSG_START=1,
-    
-    SERIAL_STATE_SENSORS,
-
-    SERIAL_BASE_LEDS,
-    SERIAL_M32_LEDS,
-    
-    SERIAL_LIGHT_LEFT,
-    SERIAL_LIGHT_RIGHT,
-    
-    SERIAL_MOTOR_SPEED_LEFT,
-    SERIAL_MOTOR_SPEED_RIGHT,
-    SERIAL_MOTOR_DESTSPEED_LEFT,
-    SERIAL_MOTOR_DESTSPEED_RIGHT,
-    SERIAL_MOTOR_DIST_LEFT,
-    SERIAL_MOTOR_DIST_RIGHT,
-    SERIAL_MOTOR_DESTDIST_LEFT,
-    SERIAL_MOTOR_DESTDIST_RIGHT,
-    SERIAL_MOTOR_CURRENT_LEFT,
-    SERIAL_MOTOR_CURRENT_RIGHT,
-    SERIAL_MOTOR_DIRECTIONS,
 
-    SERIAL_BATTERY,
+#define CHANNEL(name, type, avg, stat, mod, func) SERIAL_##name,
+    ROBOT_CHANNELS
+#undef CHANNEL
+    SERIAL_MAX_ROBOT_INDEX,
 
-    SERIAL_ACS_POWER,
+    SERIAL_CMD_ACK=SERIAL_MAX_ROBOT_INDEX, // uint8 sequence of last executed command
 
-    SERIAL_MIC,
+    SERIAL_MAX_INDEX
+} ESerialMessage;
 
-    SERIAL_LASTRC5,
+// Binary commands from the server to the m32. Text commands are still
+// accepted (ie for debugging from a terminal).
+// Format (mirrors serial messages):
+//  0: Start marker (SERIAL_MSG_START)
+//  1: Size (opcode + sequence + args)
+//  2: Opcode
+//  3: Sequence
+//  n: Arguments (fixed size per opcode, words are little endian)
+//  n+1: Checksum (XOR of size, opcode, sequence and arguments)
+// Commands are executed in sequence order (1-255, wrapping to 1) and
+// acknowledged with SERIAL_CMD_ACK. Out of order commands are dropped and
+// the last sequence is acknowledged again. Sequence 0 is always accepted
+// and restarts the sequence.
+typedef enum
+{
+    SERIAL_CMD_BASE_POWER=0, // uint8 on/off
+    SERIAL_CMD_BASE_LEDS, // uint8 leds
+    SERIAL_CMD_M32_LEDS, // uint8 leds
+    SERIAL_CMD_ACS_POWER, // uint8 EACSPowerState
+    SERIAL_CMD_SPEED, // uint8 left, uint8 right
+    SERIAL_CMD_DIR, // uint8 direction
+    SERIAL_CMD_SLAVE, // uint8 on/off
+    SERIAL_CMD_SLAVE_DELAY, // uint8 ESlaveDelay, uint16 delay
+    SERIAL_CMD_SERVO, // uint8 degrees
+    SERIAL_CMD_MOVE, // uint8 speed, uint8 direction, uint16 distance
+    SERIAL_CMD_ROTATE, // uint8 speed, uint8 direction, uint16 angle
+    SERIAL_CMD_STOP,
+    SERIAL_CMD_BEEP, // uint8 pitch, uint16 time
+    SERIAL_CMD_SOUND, // uint8 pitch, uint16 time, uint16 delay
+
+    SERIAL_CMD_MAX_INDEX
+} ESerialCommand;
+
+enum { SERIAL_CMD_MAX_SIZE = 7 }; // Largest opcode + sequence + args
 
-    SERIAL_SHARPIR,
-} ESerialMessage;
+typedef enum
+{
+    SLAVE_DELAY_LED=0,
+    SLAVE_DELAY_LIGHT,
+    SLAVE_DELAY_MOTOR,
+    SLAVE_DELAY_BATTERY,
+    SLAVE_DELAY_ACS,
+    SLAVE_DELAY_MIC,
+    SLAVE_DELAY_RC5,
+    SLAVE_DELAY_SHARPIR,
+
+    SLAVE_DELAY_MAX_INDEX
+} ESlaveDelay;
 
 typedef enum
 {
@@ -193,27 +255,9 @@ typedef enum
     TCP_RAWSERIAL=0,
     
     TCP_MIN_ROBOT_INDEX,
-    TCP_STATE_SENSORS,
-    TCP_BASE_LEDS,
-    TCP_M32_LEDS,
-    TCP_LIGHT_LEFT,
-    TCP_LIGHT_RIGHT,
-    TCP_MOTOR_SPEED_LEFT,
-    TCP_MOTOR_SPEED_RIGHT,
-    TCP_MOTOR_DESTSPEED_LEFT,
-    TCP_MOTOR_DESTSPEED_RIGHT,
-    TCP_MOTOR_DIST_LEFT,
-    TCP_MOTOR_DIST_RIGHT,
-    TCP_MOTOR_DESTDIST_LEFT,
-    TCP_MOTOR_DESTDIST_RIGHT,
-    TCP_MOTOR_CURRENT_LEFT,
-    TCP_MOTOR_CURRENT_RIGHT,
-    TCP_MOTOR_DIRECTIONS,
-    TCP_BATTERY,
-    TCP_ACS_POWER,
-    TCP_MIC,
-    TCP_LASTRC5,
-    TCP_SHARPIR,
+#define CHANNEL(name, type, avg, stat, mod, func) TCP_##name,
+    ROBOT_CHANNELS
+#undef CHANNEL
     TCP_MAX_ROBOT_INDEX,
 
     // Fox
@@ -227,16 +271,38 @@ typedef enum
     TCP_UPDATEDELAY,
     TCP_COMMAND,
     TCP_GETSCRIPTS,
-    TCP_RUNLUA,
+    TCP_RUNLUA, // Script, [name (empty: main script), priority (1-10, 0: default)]
     TCP_UPLOADLUA,
     TCP_UPRUNLUA,
     TCP_RUNSERVERLUA,
     TCP_REMOVESERVERLUA,
     TCP_GETSERVERLUA,
-    TCP_LUACOMMAND,
+    TCP_LUACOMMAND, // Command, arguments, [script name (empty: main script)]
+
+    // New messages are appended, so existing message ids stay the same
+
+    // Fox
+    TCP_CHANNELSTATS,
+    TCP_DATAAGE, // Precedes robot data: age of new values since last update
+    TCP_LATENCYSTATS,
+    TCP_ROBOTLIST, // Sent on connect: names (serial ports) of all robots
+    TCP_POSE, // SRobotPose, when changed
+    TCP_LUAPROFILE, // Every second while profiling and when stopped (see tcputil.h)
+    TCP_COMPRESSION, // Reply to TCP_SETCOMPRESSION: quint8 codec used from now on
+    TCP_COMPRESSED, // Also sent by clients: quint8 codec, QByteArray messages (see tcputil.h)
+
+    // Client
+    TCP_GETCHANNELSTATS,
+    TCP_UDPTELEMETRY,
+    TCP_GETLATENCYSTATS,
+    TCP_SELECTROBOT, // Index in TCP_ROBOTLIST, robot 0 is used by default
+    TCP_SETLUAPROFILE, // bool: start (clears the profile) or stop profiling
+    TCP_SETCOMPRESSION, // quint8 codec the client can handle, ETcpCodec (tcputil.h)
 
     TCP_MAX_INDEX
 } ETcpMessage;
 
+enum { ROBOT_CHANNEL_COUNT = TCP_MAX_ROBOT_INDEX - TCP_MIN_ROBOT_INDEX - 1 };
+
 #endif
 
@@ -18,6 +18,9 @@
  *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
  ***************************************************************************/
 
+#include <string.h>
+
+#include <QDebug>
 #include <QTcpSocket>
 
 #include "shared.h"
@@ -47,28 +50,242 @@ CTcpMsgComposer::operator QByteArray()
 }
 
 
-QMap<ETcpMessage, EDataType> tcpDataTypes;
-void initTcpDataTypes()
-{
-    tcpDataTypes[TCP_STATE_SENSORS] = DATA_BYTE;
-    tcpDataTypes[TCP_BASE_LEDS] = DATA_BYTE;
-    tcpDataTypes[TCP_M32_LEDS] = DATA_BYTE;
-    tcpDataTypes[TCP_LIGHT_LEFT] = DATA_WORD;
-    tcpDataTypes[TCP_LIGHT_RIGHT] = DATA_WORD;
-    tcpDataTypes[TCP_MOTOR_SPEED_LEFT] = DATA_BYTE;
-    tcpDataTypes[TCP_MOTOR_SPEED_RIGHT] = DATA_BYTE;
-    tcpDataTypes[TCP_MOTOR_DESTSPEED_LEFT] = DATA_BYTE;
-    tcpDataTypes[TCP_MOTOR_DESTSPEED_RIGHT] = DATA_BYTE;
-    tcpDataTypes[TCP_MOTOR_DIST_LEFT] = DATA_WORD;
-    tcpDataTypes[TCP_MOTOR_DIST_RIGHT] = DATA_WORD;
-    tcpDataTypes[TCP_MOTOR_DESTDIST_LEFT] = DATA_WORD;
-    tcpDataTypes[TCP_MOTOR_DESTDIST_RIGHT] = DATA_WORD;
-    tcpDataTypes[TCP_MOTOR_CURRENT_LEFT] = DATA_WORD;
-    tcpDataTypes[TCP_MOTOR_CURRENT_RIGHT] = DATA_WORD;
-    tcpDataTypes[TCP_MOTOR_DIRECTIONS] = DATA_BYTE;
-    tcpDataTypes[TCP_BATTERY] = DATA_WORD;
-    tcpDataTypes[TCP_ACS_POWER] = DATA_BYTE;
-    tcpDataTypes[TCP_MIC] = DATA_WORD;
-    tcpDataTypes[TCP_LASTRC5] = DATA_WORD;
-    tcpDataTypes[TCP_SHARPIR] = DATA_BYTE;
+CTcpMsgWriter &CTcpMsgWriter::begin(ETcpMessage msg)
+{
+    msgStart = used;
+    put((quint32)0); // Reserve place for size
+    put((quint8)msg);
+    return *this;
+}
+
+void CTcpMsgWriter::end()
+{
+    Q_ASSERT(msgStart != -1);
+
+    // Put in the size
+    const quint32 size = used - msgStart - sizeof(quint32);
+    qToBigEndian(size, reinterpret_cast<uchar *>(buffer.data() + msgStart));
+    msgStart = -1;
+}
+
+CTcpMsgWriter &CTcpMsgWriter::operator <<(float v)
+{
+    union { float f; quint32 i; } u;
+    u.f = v;
+    put(u.i);
+    return *this;
+}
+
+CTcpMsgWriter &CTcpMsgWriter::operator <<(const QString &v)
+{
+    if (v.isNull())
+    {
+        put((quint32)0xFFFFFFFF);
+        return *this;
+    }
+
+    const int len = v.length();
+    put((quint32)(len * sizeof(quint16)));
+    reserve(len * sizeof(quint16));
+
+    const QChar *chars = v.constData();
+    for (int i=0; i<len; ++i)
+        put((quint16)chars[i].unicode());
+
+    return *this;
+}
+
+CTcpMsgWriter &CTcpMsgWriter::operator <<(const char *v)
+{
+    if (!v)
+    {
+        put((quint32)0xFFFFFFFF); // Null string
+        return *this;
+    }
+
+    const int len = strlen(v);
+    put((quint32)(len * sizeof(quint16)));
+    reserve(len * sizeof(quint16));
+
+    for (int i=0; i<len; ++i)
+        put((quint16)(uchar)v[i]);
+
+    return *this;
+}
+
+CTcpMsgWriter &CTcpMsgWriter::operator <<(const QByteArray &v)
+{
+    if (v.isNull())
+    {
+        put((quint32)0xFFFFFFFF);
+        return *this;
+    }
+
+    put((quint32)v.size());
+    reserve(v.size());
+    memcpy(buffer.data() + used, v.constData(), v.size());
+    used += v.size();
+
+    return *this;
+}
+
+CTcpMsgWriter &CTcpMsgWriter::operator <<(const QList<QString> &v)
+{
+    put((quint32)v.size());
+    for (QList<QString>::const_iterator it=v.begin(); it!=v.end(); ++it)
+        *this << *it;
+    return *this;
+}
+
+CTcpMsgWriter &CTcpMsgWriter::operator <<(const CWindowStats::SResult &v)
+{
+    *this << (quint32)v.count << (qint32)v.min << (qint32)v.max;
+    *this << v.mean << v.variance;
+    *this << (qint32)v.p50 << (qint32)v.p90 << (qint32)v.p99;
+    return *this;
+}
+
+CTcpMsgWriter &CTcpMsgWriter::operator <<(const SRobotPose &v)
+{
+    *this << v.time << v.x << v.y << v.angle;
+    for (int i=0; i<SRobotPose::COV_SIZE; ++i)
+        *this << v.covariance[i];
+    return *this;
+}
+
+CTcpMsgWriter &CTcpMsgWriter::operator <<(const SLuaProfileEntry &v)
+{
+    return *this << v.function << v.source << v.line << v.samples << v.timeUS << v.allocBytes;
+}
+
+const char *getTcpCodecName(ETcpCodec codec)
+{
+    switch (codec)
+    {
+        case TCP_CODEC_NONE: return "none";
+        case TCP_CODEC_DEFLATE: return "deflate";
+    }
+
+    return "unknown";
+}
+
+QByteArray compressTcpMessages(ETcpCodec codec, const char *data, int size,
+                               STcpCompressionStats *stats)
+{
+    if ((codec != TCP_CODEC_DEFLATE) || (size < TCP_COMPRESS_THRESHOLD))
+        return QByteArray();
+
+    // Fastest level: messages are mostly text, which still shrinks well
+    const QByteArray msg(CTcpMsgComposer(TCP_COMPRESSED) << static_cast<quint8>(codec) <<
+                         qCompress(reinterpret_cast<const uchar *>(data), size, 1));
+    if (msg.size() >= size)
+        return QByteArray();
+
+    if (stats)
+    {
+        ++stats->messages;
+        stats->rawBytes += size;
+        stats->compressedBytes += msg.size();
+    }
+
+    return msg;
+}
+
+QByteArray uncompressTcpMessages(ETcpCodec codec, const QByteArray &data,
+                                 STcpCompressionStats *stats)
+{
+    // qUncompress() allocates the size stored in front of the data, so
+    // check it before trusting it
+    if ((codec != TCP_CODEC_DEFLATE) || (data.size() < static_cast<int>(sizeof(quint32))) ||
+        (qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(data.constData())) >
+         TCP_MAX_UNCOMPRESSED_SIZE))
+    {
+        qWarning() << "Invalid compressed message (codec" << codec << ")";
+        return QByteArray();
+    }
+
+    const QByteArray ret(qUncompress(data));
+    if (stats && !ret.isEmpty())
+    {
+        ++stats->messages;
+        stats->rawBytes += ret.size();
+        // Size of the whole TCP_COMPRESSED message: size, message, codec, data size
+        stats->compressedBytes += sizeof(quint32) * 2 + sizeof(quint8) * 2 + data.size();
+    }
+
+    return ret;
+}
+
+QList<QByteArray> splitTcpMessages(const QByteArray &messages)
+{
+    QList<QByteArray> ret;
+    int pos = 0;
+
+    while ((pos + static_cast<int>(sizeof(quint32))) <= messages.size())
+    {
+        const quint32 size =
+                qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(messages.constData() + pos));
+        pos += sizeof(quint32);
+
+        if (size > static_cast<quint32>(messages.size() - pos))
+            break;
+
+        ret << messages.mid(pos, size);
+        pos += size;
+    }
+
+    if (pos != messages.size())
+        qWarning() << "Incomplete message in compressed data";
+
+    return ret;
+}
+
+
+const SRobotChannel robotChannels[ROBOT_CHANNEL_COUNT] =
+{
+#define CHANNEL(name, type, avg, stat, mod, func) \
+    { SERIAL_##name, TCP_##name, type, avg, stat, mod, func },
+    ROBOT_CHANNELS
+#undef CHANNEL
+};
+
+QDataStream &operator<<(QDataStream &out, const CWindowStats::SResult &stats)
+{
+    out << (quint32)stats.count << (qint32)stats.min << (qint32)stats.max;
+    out << stats.mean << stats.variance;
+    out << (qint32)stats.p50 << (qint32)stats.p90 << (qint32)stats.p99;
+    return out;
+}
+
+QDataStream &operator>>(QDataStream &in, CWindowStats::SResult &stats)
+{
+    quint32 count;
+    qint32 min, max, p50, p90, p99;
+
+    in >> count >> min >> max;
+    in >> stats.mean >> stats.variance;
+    in >> p50 >> p90 >> p99;
+
+    stats.count = count;
+    stats.min = min;
+    stats.max = max;
+    stats.p50 = p50;
+    stats.p90 = p90;
+    stats.p99 = p99;
+
+    return in;
+}
+
+QDataStream &operator>>(QDataStream &in, SRobotPose &pose)
+{
+    in >> pose.time >> pose.x >> pose.y >> pose.angle;
+    for (int i=0; i<SRobotPose::COV_SIZE; ++i)
+        in >> pose.covariance[i];
+    return in;
+}
+
+QDataStream &operator>>(QDataStream &in, SLuaProfileEntry &entry)
+{
+    return in >> entry.function >> entry.source >> entry.line >> entry.samples >>
+            entry.timeUS >> entry.allocBytes;
 }
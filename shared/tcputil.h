@@ -24,8 +24,68 @@
 #include <QByteArray>
 #include <QDataStream>
 #include <QMap>
+#include <QStringList>
+#include <QVariant>
+#include <QtEndian>
 
 #include "shared.h"
+#include "windowstats.h"
+
+// Robot pose as estimated by the server from the wheel encoders (TCP_POSE).
+// Positions are in cm with y pointing downwards, the angle is in degrees
+// clockwise, with 0 facing upwards (same as the nav Lua module).
+struct SRobotPose
+{
+    enum { COV_XX=0, COV_XY, COV_XA, COV_YY, COV_YA, COV_AA, COV_SIZE };
+
+    quint32 time; // Server time (ms) of the latest encoder update
+    float x, y, angle;
+    float covariance[COV_SIZE]; // Upper triangle of the (x, y, angle) matrix
+    SRobotPose(void) : time(0), x(0.0f), y(0.0f), angle(0.0f)
+    { for (int i=0; i<COV_SIZE; ++i) covariance[i] = 0.0f; }
+};
+
+// Flat profile of server Lua scripts (TCP_LUAPROFILE):
+//  bool active, quint32 duration (ms), quint32 samples, quint16 count,
+//  count * SLuaProfileEntry (most time first)
+// Samples are taken per line, the function is the name it was called by.
+struct SLuaProfileEntry
+{
+    QString function, source;
+    qint32 line;
+    quint32 samples;
+    quint64 timeUS, allocBytes;
+    SLuaProfileEntry(void) : line(0), samples(0), timeUS(0), allocBytes(0) { }
+};
+
+// Compression of large messages. Clients ask for a codec with
+// TCP_SETCOMPRESSION, which the server confirms with TCP_COMPRESSION (with
+// TCP_CODEC_NONE if it can't use it). After that, both sides may replace
+// messages (sizes included) of at least TCP_COMPRESS_THRESHOLD bytes by a
+// TCP_COMPRESSED message, if that makes them smaller.
+enum ETcpCodec { TCP_CODEC_NONE=0, TCP_CODEC_DEFLATE }; // Deflate: qCompress()
+enum { TCP_COMPRESS_THRESHOLD = 512, TCP_MAX_UNCOMPRESSED_SIZE = 16 * 1024 * 1024 };
+
+struct STcpCompressionStats
+{
+    quint32 messages; // Compressed messages
+    quint64 rawBytes, compressedBytes;
+    STcpCompressionStats(void) : messages(0), rawBytes(0), compressedBytes(0) { }
+    // Compressed size in percent of the original
+    int getRatio(void) const
+    { return (rawBytes) ? static_cast<int>(compressedBytes * 100 / rawBytes) : 100; }
+};
+
+const char *getTcpCodecName(ETcpCodec codec);
+// data: one or more complete messages. Returns a TCP_COMPRESSED message, or
+// an empty array if compression wouldn't make the data smaller.
+QByteArray compressTcpMessages(ETcpCodec codec, const char *data, int size,
+                               STcpCompressionStats *stats=NULL);
+// Returns the messages of a TCP_COMPRESSED message, an empty array on errors
+QByteArray uncompressTcpMessages(ETcpCodec codec, const QByteArray &data,
+                                 STcpCompressionStats *stats=NULL);
+// Splits complete messages into blocks without size (as read from sockets)
+QList<QByteArray> splitTcpMessages(const QByteArray &messages);
 
 class CTcpMsgComposer
 {
@@ -45,10 +105,90 @@ public:
     operator QByteArray(void);
 };
 
+// Like CTcpMsgComposer, but writes (QDataStream compatible) data directly
+// into a reusable buffer. Multiple messages can be appended before the buffer
+// is sent and cleared. Once the buffer has grown large enough no heap
+// allocations are done.
+class CTcpMsgWriter
+{
+    QByteArray buffer; // Never shrinks, 'used' marks the actual size
+    int used, msgStart;
+
+    void reserve(int n)
+    {
+        if ((used + n) > buffer.size())
+            buffer.resize(qMax(buffer.size() * 2, used + n));
+    }
+
+    template <typename T> void put(T v)
+    {
+        reserve(sizeof(T));
+        qToBigEndian(v, reinterpret_cast<uchar *>(buffer.data() + used));
+        used += sizeof(T);
+    }
+
+public:
+    CTcpMsgWriter(int size=1024) : buffer(size, 0), used(0), msgStart(-1) { }
+
+    CTcpMsgWriter &begin(ETcpMessage msg);
+    void end(void);
+    void clear(void) { used = 0; msgStart = -1; }
+
+    const char *data(void) const { return buffer.constData(); }
+    int size(void) const { return used; }
+    bool isEmpty(void) const { return used == 0; }
+
+    CTcpMsgWriter &operator <<(quint8 v) { put(v); return *this; }
+    CTcpMsgWriter &operator <<(quint16 v) { put(v); return *this; }
+    CTcpMsgWriter &operator <<(quint32 v) { put(v); return *this; }
+    CTcpMsgWriter &operator <<(quint64 v) { put(v); return *this; }
+    CTcpMsgWriter &operator <<(qint32 v) { put(v); return *this; }
+    CTcpMsgWriter &operator <<(bool v) { put(static_cast<quint8>(v)); return *this; }
+    CTcpMsgWriter &operator <<(float v);
+    CTcpMsgWriter &operator <<(const QString &v);
+    CTcpMsgWriter &operator <<(const char *v); // Written as (latin1) QString
+    CTcpMsgWriter &operator <<(const QByteArray &v);
+    CTcpMsgWriter &operator <<(const QList<QString> &v);
+    CTcpMsgWriter &operator <<(const QStringList &v)
+    { return *this << static_cast<const QList<QString> &>(v); }
+    CTcpMsgWriter &operator <<(const CWindowStats::SResult &v);
+    CTcpMsgWriter &operator <<(const SRobotPose &v);
+    CTcpMsgWriter &operator <<(const SLuaProfileEntry &v);
+};
+
+// UDP telemetry datagram (same port as TCP server):
+//  quint32 sequence, quint32 server time (ms), quint8 count,
+//  count * (quint8 ETcpMessage, quint16 data)
+// Clients only use the newest datagram, stale ones are dropped.
+enum { UDP_TELEMETRY_PORT = 40000 };
+
 typedef enum { DATA_BYTE=0, DATA_WORD } EDataType;
-extern QMap<ETcpMessage, EDataType> tcpDataTypes;
 
-void initTcpDataTypes(void);
+// Generated from ROBOT_CHANNELS (shared.h)
+struct SRobotChannel
+{
+    ESerialMessage serialMessage;
+    ETcpMessage tcpMessage;
+    EDataType dataType;
+    bool averaged;
+    const char *statsName, *luaModule, *luaFunction;
+};
+
+extern const SRobotChannel robotChannels[ROBOT_CHANNEL_COUNT];
+
+inline bool isRobotChannel(ETcpMessage msg)
+{ return (msg > TCP_MIN_ROBOT_INDEX) && (msg < TCP_MAX_ROBOT_INDEX); }
+inline bool isRobotChannel(ESerialMessage msg)
+{ return (msg > SERIAL_MSG_START) && (msg < SERIAL_MAX_ROBOT_INDEX); }
+inline int getChannelIndex(ETcpMessage msg) { return msg - TCP_MIN_ROBOT_INDEX - 1; }
+inline int getChannelIndex(ESerialMessage msg) { return msg - SERIAL_MSG_START - 1; }
+inline EDataType getTcpDataType(ETcpMessage msg)
+{ return robotChannels[getChannelIndex(msg)].dataType; }
+
+QDataStream &operator<<(QDataStream &out, const CWindowStats::SResult &stats);
+QDataStream &operator>>(QDataStream &in, CWindowStats::SResult &stats);
+QDataStream &operator>>(QDataStream &in, SRobotPose &pose);
+QDataStream &operator>>(QDataStream &in, SLuaProfileEntry &entry);
 
 
 #endif
@@ -0,0 +1,209 @@
+#include <string.h>
+
+#include "windowstats.h"
+
+CWindowStats::CWindowStats(uint32_t w) : window(w)
+{
+    clear();
+}
+
+int32_t CWindowStats::clampValue(int32_t v)
+{
+    // Channel data is at most 16 bit
+    if (v < 0)
+        return 0;
+    if (v > 0xFFFF)
+        return 0xFFFF;
+    return v;
+}
+
+int CWindowStats::binIndex(int32_t v)
+{
+    v = clampValue(v);
+
+    if (v < 16)
+        return v;
+
+    int msb = 4;
+    while ((v >> (msb + 1)) != 0)
+        ++msb;
+
+    // 16 linear sub-bins per power of two
+    return 16 + ((msb - 4) * 16) + ((v >> (msb - 4)) & 15);
+}
+
+int32_t CWindowStats::binValue(int bin)
+{
+    if (bin < 16)
+        return bin;
+
+    const int msb = ((bin - 16) / 16) + 4, sub = (bin - 16) % 16;
+    const int32_t width = 1 << (msb - 4);
+    return (1 << msb) + (sub * width) + (width / 2); // Middle of bin
+}
+
+void CWindowStats::removeOldest()
+{
+    const uint32_t seq = nextSeq - size;
+    const int32_t v = sample(seq).value;
+
+    sum -= v;
+    sumSq -= static_cast<int64_t>(v) * v;
+    --histogram[binIndex(v)];
+
+    if (minQueue.count && (minQueue.first() == seq))
+        minQueue.popFront();
+    if (maxQueue.count && (maxQueue.first() == seq))
+        maxQueue.popFront();
+
+    --size;
+}
+
+int32_t CWindowStats::percentile(const uint16_t *hist, uint32_t count, int p, int32_t min,
+                                 int32_t max)
+{
+    const uint32_t rank = ((count * p) + 99) / 100;
+    uint32_t n = 0;
+
+    for (int i=0; i<HISTOGRAM_BINS; ++i)
+    {
+        n += hist[i];
+        if (n >= rank)
+        {
+            // Bins are approximations: keep within real bounds
+            const int32_t ret = binValue(i);
+            if (ret < min)
+                return min;
+            if (ret > max)
+                return max;
+            return ret;
+        }
+    }
+
+    return max;
+}
+
+int32_t CWindowStats::percentile(int p) const
+{
+    if (!size)
+        return 0;
+
+    return percentile(histogram, size, p, sample(minQueue.first()).value,
+                      sample(maxQueue.first()).value);
+}
+
+void CWindowStats::addSample(int32_t value, uint32_t time)
+{
+    value = clampValue(value);
+
+    expire(time);
+
+    if (size == MAX_SAMPLES)
+        removeOldest();
+
+    const uint32_t seq = nextSeq++;
+    samples[seq % MAX_SAMPLES].value = value;
+    samples[seq % MAX_SAMPLES].time = time;
+    ++size;
+
+    sum += value;
+    sumSq += static_cast<int64_t>(value) * value;
+    ++histogram[binIndex(value)];
+
+    while (minQueue.count && (sample(minQueue.last()).value >= value))
+        minQueue.popBack();
+    minQueue.push(seq);
+
+    while (maxQueue.count && (sample(maxQueue.last()).value <= value))
+        maxQueue.popBack();
+    maxQueue.push(seq);
+}
+
+void CWindowStats::expire(uint32_t time)
+{
+    while (size && ((time - sample(nextSeq - size).time) > window))
+        removeOldest();
+}
+
+void CWindowStats::clear()
+{
+    nextSeq = size = 0;
+    sum = sumSq = 0;
+    minQueue.front = minQueue.count = 0;
+    maxQueue.front = maxQueue.count = 0;
+    memset(histogram, 0, sizeof(histogram));
+}
+
+CWindowStats::SResult CWindowStats::getResult() const
+{
+    SResult ret;
+
+    if (!size)
+        return ret;
+
+    ret.count = size;
+    ret.min = sample(minQueue.first()).value;
+    ret.max = sample(maxQueue.first()).value;
+    ret.mean = static_cast<float>(sum) / size;
+
+    if (size > 1)
+    {
+        const double m = static_cast<double>(sum) / size;
+        const double v = (static_cast<double>(sumSq) - (m * sum)) / (size - 1);
+        ret.variance = (v > 0.0) ? v : 0.0;
+    }
+
+    ret.p50 = percentile(50);
+    ret.p90 = percentile(90);
+    ret.p99 = percentile(99);
+
+    return ret;
+}
+
+CWindowStats::SResult CWindowStats::getResult(uint32_t w, uint32_t time) const
+{
+    // Walk back from the newest sample, O(MAX_SAMPLES) at most
+    uint16_t hist[HISTOGRAM_BINS];
+    memset(hist, 0, sizeof(hist));
+    uint32_t count = 0;
+    int64_t s = 0, sq = 0;
+    int32_t min = 0, max = 0;
+
+    for (; count < size; ++count)
+    {
+        const SSample &smp = sample(nextSeq - 1 - count);
+        if (((time - smp.time) > w) || ((time - smp.time) > window))
+            break;
+
+        const int32_t v = smp.value;
+        if (!count || (v < min))
+            min = v;
+        if (!count || (v > max))
+            max = v;
+        s += v;
+        sq += static_cast<int64_t>(v) * v;
+        ++hist[binIndex(v)];
+    }
+
+    SResult ret;
+    if (!count)
+        return ret;
+
+    ret.count = count;
+    ret.min = min;
+    ret.max = max;
+    ret.mean = static_cast<float>(s) / count;
+
+    if (count > 1)
+    {
+        const double m = static_cast<double>(s) / count;
+        const double v = (static_cast<double>(sq) - (m * s)) / (count - 1);
+        ret.variance = (v > 0.0) ? v : 0.0;
+    }
+
+    ret.p50 = percentile(hist, count, 50, min, max);
+    ret.p90 = percentile(hist, count, 90, min, max);
+    ret.p99 = percentile(hist, count, 99, min, max);
+
+    return ret;
+}
@@ -0,0 +1,81 @@
+#ifndef WINDOWSTATS_H
+#define WINDOWSTATS_H
+
+#include <stdint.h>
+
+// Keeps statistics of a single data channel over a sliding time window.
+// All memory is allocated up front: the window holds at most MAX_SAMPLES
+// samples and adding a sample is O(1) (amortized for min/max).
+// Percentiles are approximated with a log-linear histogram (~6% error).
+class CWindowStats
+{
+public:
+    enum { MAX_SAMPLES = 512, HISTOGRAM_BINS = 208, DEFAULT_WINDOW = 500 };
+
+    struct SResult
+    {
+        uint32_t count;
+        int32_t min, max;
+        float mean, variance;
+        int32_t p50, p90, p99;
+        SResult(void) : count(0), min(0), max(0), mean(0.0f), variance(0.0f),
+                        p50(0), p90(0), p99(0) { }
+    };
+
+private:
+    struct SSample
+    {
+        int32_t value;
+        uint32_t time;
+    };
+
+    // Monotonic queue of sample sequence numbers, used for min/max
+    struct SMonoQueue
+    {
+        uint32_t seqs[MAX_SAMPLES];
+        uint16_t front, count;
+        SMonoQueue(void) : front(0), count(0) { }
+        uint32_t first(void) const { return seqs[front]; }
+        uint32_t last(void) const { return seqs[(front + count - 1) % MAX_SAMPLES]; }
+        void popFront(void) { front = (front + 1) % MAX_SAMPLES; --count; }
+        void popBack(void) { --count; }
+        void push(uint32_t s) { seqs[(front + count) % MAX_SAMPLES] = s; ++count; }
+    };
+
+    SSample samples[MAX_SAMPLES];
+    uint32_t nextSeq, size, window;
+    int64_t sum, sumSq;
+    SMonoQueue minQueue, maxQueue;
+    uint16_t histogram[HISTOGRAM_BINS];
+
+    const SSample &sample(uint32_t seq) const { return samples[seq % MAX_SAMPLES]; }
+    void removeOldest(void);
+    int32_t percentile(int p) const;
+
+    static int32_t percentile(const uint16_t *hist, uint32_t count, int p, int32_t min,
+                              int32_t max);
+
+    static int32_t clampValue(int32_t v);
+    static int binIndex(int32_t v);
+    static int32_t binValue(int bin);
+
+public:
+    CWindowStats(uint32_t w=DEFAULT_WINDOW);
+
+    void addSample(int32_t value, uint32_t time);
+    void expire(uint32_t time);
+    void clear(void);
+
+    void setWindow(uint32_t w) { window = w; }
+    uint32_t getWindow(void) const { return window; }
+    uint32_t getCount(void) const { return size; }
+    bool isEmpty(void) const { return size == 0; }
+    int32_t mean(void) const { return (size) ? static_cast<int32_t>(sum / size) : 0; }
+
+    SResult getResult(void) const;
+    // Result over the samples of the last w ms, without expiring anything.
+    // Only samples within the current window are kept, so w is at most that.
+    SResult getResult(uint32_t w, uint32_t time) const;
+};
+
+#endif